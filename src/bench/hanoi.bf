@@ -0,0 +1,30 @@
+Tower of Hanoi disk sequence
+
+Runs a 20 bit binary counter through 4 times 255 times 255 increments and
+prints the letter of the disk moved at each step (A is the smallest disk)
+with one line per 255 moves; each move is a scan over the counter bits
+followed by a scan back to a zero sentinel
+
+>>>>>>+>++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
++>+>++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++>+
+>+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++>+>+
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++>+>++
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++>+>++
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++>+>+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++>+
+>+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
++>+>++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
++++++>+>++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+++++++++++>+>+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+++++++++++++++++>+>+++++++++++++++++++++++++++++++++++++++++++++++++++++
++++++++++++++++++++++++>+>++++++++++++++++++++++++++++++++++++++++++++++
++++++++++++++++++++++++++++++++>+>++++++++++++++++++++++++++++++++++++++
+++++++++++++++++++++++++++++++++++++++++>+>+++++++++++++++++++++++++++++
+++++++++++++++++++++++++++++++++++++++++++++++++++>+>+++++++++++++++++++
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++>+>++++++++
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
++>+>++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+++++++++++++++>+>+++++++++++++++++++++++++++++++++++++++++++++++++++++++
+++++++++++++++++++++++++++++>+>+++++++++++++++++++++++++++++++++++++++++
++++++++++++++++++++++++++++++++++++++++++++<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+<<<<<<<<<<<<<++++++++++<<<++++[->-[->-[->>>>-[>>-]++>.<[<<]<<]>.<<]<]
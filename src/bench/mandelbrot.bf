@@ -0,0 +1,18 @@
+Mandelbrot style escape time heat map
+
+For every cell of a 32 by 16 grid this iterates z equals z times z plus x
+times y plus x plus 3 three times with 8 bit wraparound and prints z divided
+by 32 as a digit; multiplication is done with nested copy loops so almost
+all of the time is spent in balanced inner loops
+
+>>>>>>>>>>>++++++++++<<<<<<<<<<<++++++++++++++++[-
+>++++++++++++++++++++++++++++++++>>[-]<<[->>>>[-]<+++[->[->+>+<<]>[->[-
+>>+<+<]>[-<+>]<<]>[-]>>[-<<<<+>>>>]<[-]<<<<<[->>>+>>+<<<<<]>>>>>[-
+<<<<<+>>>>>][-]<<<<<<[->>>>>+>+<<<<<<]>>>>>>[-<<<<<<+>>>>>>]<<[->[-
+>>+<+<]>[-<+>]<<]>[-]>>[-<<<<+>>>>]<[-]<<<<<[->>>+>>+<<<<<]>>>>>[-
+<<<<<+>>>>>]<<[-<+>]<+++<]>>>>>>>>>>>>>>>>[-]>[-]>[-]>[-]>[-]>[-
+]<<<<<<<<<<<<<<<<<<<<[-
+>>>>>>>>>>>>>>>+<<<<<<<<<<<<<<<]>>>>>>>>>>>>>>>>>+++++++++++++++++++++++
++++++++++<<[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]>[-]>[-]>[-
+]>++++++++++++++++++++++++++++++++++++++++++++++++.[-
+]<<<<<<<<<<<<<<<<<<<<<+<<]>>>>>>>>>>.<<<<<<<<<+<<]
@@ -0,0 +1,33 @@
+Number printing
+
+Prints every 8 bit value from 0 to 255 as three decimal digits on its own
+line and repeats that 40 times; each number takes two divmod by 10 loops
+
+>>>>++++++++++<<<<++++++++++++++++++++++++++++++++++++++++[->[-]>[-]-[-
+>[-]<<[->>>>>>>>>>>>+<<<<<<<<<<+<<]>>[-
+<<+>>]>>>>>>>>>>>>>>>>>>>>>>>>>>>[-]>[-]>[-]>[-]>[-]>[-
+]<<<<<<<<<<<<<<<<<<<<<<[-
+>>>>>>>>>>>>>>>>>+<<<<<<<<<<<<<<<<<]>>>>>>>>>>>>>>>>>>>++++++++++<<[-
+>+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]>>>[-<<<<<<<<<<<+>>>>>>>>>>>]>[-
+<<<<<<<<<<<<<<<<<<<<+>>>>>>>>>>>>>>>>>>>>]<<<<[-]>[-]>[-]>[-]>[-]>[-
+]<<<<<<<<<<<<<<<<<<<<<[-
+>>>>>>>>>>>>>>>>+<<<<<<<<<<<<<<<<]>>>>>>>>>>>>>>>>>>++++++++++<<[->+>-
+[>+>>]>[+[-<+>]>+>>]<<<<<<]>>>[-<<<<<<<<<<<<+>>>>>>>>>>>>]>[-
+<<<<<<<<<<<<<<+>>>>>>>>>>>>>>]<<<<<<<<<<<<<<++++++++++++++++++++++++++++
+++++++++++++++++++++.[-
+]>++++++++++++++++++++++++++++++++++++++++++++++++.[-
+]>++++++++++++++++++++++++++++++++++++++++++++++++.[-
+]<<<<<<<<<<<<<<<<<<.<<<+>]+[->[-]<<[->>>>>>>>>>>>+<<<<<<<<<<+<<]>>[-
+<<+>>]>>>>>>>>>>>>>>>>>>>>>>>>>>>[-]>[-]>[-]>[-]>[-]>[-
+]<<<<<<<<<<<<<<<<<<<<<<[-
+>>>>>>>>>>>>>>>>>+<<<<<<<<<<<<<<<<<]>>>>>>>>>>>>>>>>>>>++++++++++<<[-
+>+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]>>>[-<<<<<<<<<<<+>>>>>>>>>>>]>[-
+<<<<<<<<<<<<<<<<<<<<+>>>>>>>>>>>>>>>>>>>>]<<<<[-]>[-]>[-]>[-]>[-]>[-
+]<<<<<<<<<<<<<<<<<<<<<[-
+>>>>>>>>>>>>>>>>+<<<<<<<<<<<<<<<<]>>>>>>>>>>>>>>>>>>++++++++++<<[->+>-
+[>+>>]>[+[-<+>]>+>>]<<<<<<]>>>[-<<<<<<<<<<<<+>>>>>>>>>>>>]>[-
+<<<<<<<<<<<<<<+>>>>>>>>>>>>>>]<<<<<<<<<<<<<<++++++++++++++++++++++++++++
+++++++++++++++++++++.[-
+]>++++++++++++++++++++++++++++++++++++++++++++++++.[-
+]>++++++++++++++++++++++++++++++++++++++++++++++++.[-
+]<<<<<<<<<<<<<<<<<<.<<<+>]<<]
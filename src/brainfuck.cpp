@@ -4,325 +4,1382 @@
 If you have gcc:
 
 ----
-g++ -o brainfuck.exe brainfuck.cpp
+g++ -std=c++11 -pthread -c libbrainfuck.cpp optimizer.cpp
+ar rcs libbrainfuck.a libbrainfuck.o optimizer.o
+g++ -std=c++11 -pthread -o brainfuck.exe brainfuck.cpp libbrainfuck.a
 brainfuck.exe helloworld.bf
 ----
+
+The parser, tree and engines are in the library (see brainfuck.h), and so are the optimizer passes
+(see optimizer.h); this file is just the driver. The tests are in tests.cpp, which builds the same way.
+
+To run lots of programs at once on every core (output comes back in argument order, or as each finishes with --stream):
+
+----
+brainfuck.exe --batch -j 32 --budget 100000000 helloworld.bf 99botles.bf bench/mandelbrot.bf bench/hanoi.bf
+----
+
+To run a program that can be stopped (SIGTERM, or out of budget) and resumed later, maybe on another machine:
+
+----
+brainfuck.exe --run bench/mandelbrot.bf --checkpoint job.snapshot --budget 100000000 < input
+brainfuck.exe --run bench/mandelbrot.bf --checkpoint job.snapshot --resume job.snapshot < input
+----
+
+Add --prelude STEPS to work out the part before the first , (up to that many steps) ahead of time.
+-O0 to -O3 pick how hard the optimizer works on the program first (-O3 does the prelude too),
+--passes runs a list of passes on top of that, and --report says what each pass did and how long it took.
+To get the C code for a program, with the same options:
+
+----
+brainfuck.exe --compile 99botles.bf -O3 --report > 99botles.c
+----
+
+To search the straight-line blocks of some programs for shorter code (as long as it takes, ahead of time),
+and then have -O3 use what it found:
+
+----
+brainfuck.exe --superoptimize rewrites.db --length 5 bench/mandelbrot.bf bench/hanoi.bf bench/numbers.bf
+brainfuck.exe --compile bench/mandelbrot.bf -O3 --rewrites rewrites.db > mandelbrot.c
+----
+
+To run one program once per line (or NUL-separated record, with --nul) of a file, reusing one tape:
+
+----
+brainfuck.exe --each program.bf ../american-english.txt
+----
+
+Add --memo to skip ahead over input prefixes earlier runs already went through (sorted word lists love this).
+
+Or in parallel (each run is a fork of a ready-to-go copy, outputs in order):
+
+----
+brainfuck.exe --fork-server program.bf ../american-english.txt -j 8 -O3
+----
+
+To keep parsed programs around in a daemon and run them over a Unix domain socket:
+
+----
+brainfuck.exe --serve /tmp/brainfuck.sock --cache 512 &
+brainfuck.exe --client /tmp/brainfuck.sock 99botles.bf < /dev/null
+----
+
+To compare the engines on the workloads in bench/ (prints JSON, needs a C compiler for the Compiler):
+
+----
+brainfuck.exe --bench --warmup 1 --reps 5 -O2
+----
+
+To measure parser throughput on a big synthetic program (sizes take K, M and G suffixes):
+
+----
+brainfuck.exe --generate 64M --depth 8 --comments 0.1 --run 3 > synthetic.bf
+brainfuck.exe --bench-parse synthetic.bf
+----
 */
 
-#include <vector>
-#include <iostream>
+#include "brainfuck.h"
+#include "optimizer.h"
 #include <fstream>
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <new>
+#include <memory>
+#include <csignal>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
 
 using namespace std;
+using namespace brainfuck;
 
 /**
- * Primitive Brainfuck commands
+ * A work-stealing thread pool: every worker has its own deque of jobs.
+ * Workers take jobs off the front of their own deque, and when that's empty they steal from the back of
+ * somebody else's, so a few slow jobs stuck behind each other don't leave the other cores idle.
+ * The destructor finishes every job that was submitted before it joins the workers.
  */
-typedef enum { 
-    INCREMENT, // +
-    DECREMENT, // -
-    SHIFT_LEFT, // <
-    SHIFT_RIGHT, // >
-    INPUT, // ,
-    OUTPUT, // .
-    ZERO
-} Command;
-
-// Forward references. Silly C++!
-class CommandNode;
-class Loop;
-class Program;
+class ThreadPool {
+public:
+    ThreadPool(int workers) : next(0), queued(0), stopping(false) {
+        workers = max(1, workers);
+        for (int i = 0; i < workers; i++) {
+            queues.push_back(unique_ptr<Queue>(new Queue()));
+        }
+        for (int i = 0; i < workers; i++) {
+            threads.push_back(thread(&ThreadPool::work, this, i));
+        }
+    }
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto it = threads.begin(); it != threads.end(); ++it) {
+            it->join();
+        }
+    }
+
+    // hand out jobs round robin; stealing evens things out later
+    void submit(function<void()> job) {
+        Queue & queue = *queues[next++ % queues.size()];
+        {
+            lock_guard<mutex> lock(queue.m);
+            queue.jobs.push_back(job);
+        }
+        lock_guard<mutex> lock(m);
+        queued++;
+        wake.notify_one();
+    }
+
+private:
+    struct Queue {
+        mutex m;
+        deque<function<void()> > jobs;
+    };
+
+    // our own oldest job, or else the newest job of whoever has one
+    bool take(size_t self, function<void()> & job) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            Queue & queue = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> lock(queue.m);
+            if (queue.jobs.empty()) continue;
+            if (i == 0) {
+                job = queue.jobs.front();
+                queue.jobs.pop_front();
+            } else {
+                job = queue.jobs.back();
+                queue.jobs.pop_back();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void work(size_t self) {
+        while (true) {
+            function<void()> job;
+            if (take(self, job)) {
+                job();
+                continue;
+            }
+            unique_lock<mutex> lock(m);
+            wake.wait(lock, [this] { return queued > 0 || stopping; });
+            if (stopping && queued == 0) return;
+        }
+    }
+
+    vector<unique_ptr<Queue> > queues; // one per worker
+    vector<thread> threads;
+    atomic<size_t> next; // where the next job goes
+    atomic<int> queued; // jobs submitted but not taken yet (only goes up under m)
+    bool stopping;
+    mutex m;
+    condition_variable wake; // there's a job to take (or we're stopping)
+};
+
+// how one file of a batch went
+struct BatchResult {
+    BatchResult() : done(false) {}
+    string output; // what the program printed
+    string error; // why it didn't finish, if it didn't
+    bool done;
+};
 
 /**
- * Visits?!? Well, that'd indicate visitors!
- * A visitor is an interface that allows you to walk through a tree and do stuff.
+ * Parse and run every file on a thread pool, each with its own tape, output buffer and error status.
+ * Programs get no input (, reads EOF), and with a budget they're stopped after about that many steps.
+ * Results are printed in argument order, or as soon as each one finishes if stream is set.
  */
-class Visitor {
-    public:
-        virtual void visit(const CommandNode * leaf) = 0;
-        virtual void visit(const Loop * loop) = 0;
-        virtual void visit(const Program * program) = 0;
-};
+int batch(const vector<string> & files, int workers, bool stream, unsigned long long budget) {
+    vector<BatchResult> results(files.size());
+    mutex m;
+    condition_variable finished;
+    int failures = 0;
+
+    auto print = [&](size_t i) {
+        cout << "==> " << files[i] << " <==\n" << results[i].output;
+        cout.flush();
+        if (!results[i].error.empty()) {
+            cerr << files[i] << ": " << results[i].error << endl;
+            failures++;
+        }
+    };
+    {
+        ThreadPool pool(workers);
+        for (size_t i = 0; i < files.size(); i++) {
+            pool.submit([&, i] {
+                BatchResult result;
+                fstream file(files[i].c_str(), fstream::in);
+                if (!file) {
+                    result.error = "No such file.";
+                } else {
+                    Program program;
+                    parse(file, &program);
+                    BufferIO io;
+                    Evaluator eval(30000, &io);
+                    Evaluator::Status status = eval.run(&program, budget);
+                    if (status == Evaluator::OUT_OF_BOUNDS) {
+                        result.error = "Went off the end of the tape.";
+                    } else if (status != Evaluator::FINISHED) {
+                        result.error = "Ran out of steps.";
+                    }
+                    result.output.swap(io.output);
+                }
+                lock_guard<mutex> lock(m);
+                results[i].output.swap(result.output);
+                results[i].error.swap(result.error);
+                results[i].done = true;
+                if (stream) print(i);
+                finished.notify_all();
+            });
+        }
+        if (!stream) {
+            for (size_t i = 0; i < files.size(); i++) {
+                unique_lock<mutex> lock(m);
+                finished.wait(lock, [&] { return results[i].done; });
+                print(i);
+            }
+        }
+    }
+    return failures ? 1 : 0;
+}
 
 /**
- * The Node class (like a Java abstract class) accepts visitors, but since it's pure virtual, we can't use it directly.
+ * Run one program over every input in a file, one after another, with one Evaluator.
+ * Inputs are separated by newlines, or by NULs with nul set. Between runs the Evaluator only
+ * clears the part of the tape the last run touched, instead of the whole thing.
+ * With memo, runs go through a PrefixCache instead, so inputs that start the same way share that work.
  */
-class Node {
-    public:
-        virtual void accept (Visitor *v) = 0;
-};
+int each(const string & programFile, const string & inputsFile, bool nul, bool memo, unsigned long long budget) {
+    fstream file(programFile.c_str(), fstream::in);
+    if (!file) {
+        cerr << programFile << ": No such file." << endl;
+        return 1;
+    }
+    ifstream inputs(inputsFile.c_str(), ios::binary);
+    if (!inputs) {
+        cerr << inputsFile << ": No such file." << endl;
+        return 1;
+    }
+    Program program;
+    parse(file, &program);
+    BufferIO io;
+    Evaluator eval(30000, &io);
+    int failures = 0;
+    string input;
+    PrefixCache cache;
+    while (getline(inputs, input, nul ? '\0' : '\n')) {
+        if (memo) {
+            RunResult result = cache.run(&program, input, budget);
+            if (result.status != Evaluator::FINISHED) failures++;
+            fwrite(result.output.data(), 1, result.output.size(), stdout);
+            continue;
+        }
+        io.reset(input);
+        eval.reset();
+        if (eval.run(&program, budget) != Evaluator::FINISHED) failures++;
+        fwrite(io.output.data(), 1, io.output.size(), stdout);
+    }
+    fflush(stdout);
+    if (failures) cerr << programFile << ": " << failures << " run(s) didn't finish." << endl;
+    return failures ? 1 : 0;
+}
 
-// a custom exception for commands that aren't real commands
-class CommandNotValidException : virtual public exception {
-public:
-    CommandNotValidException() : exception("Tried to create a command from an invalid character") {}
+// set by SIGTERM/SIGINT, so a checkpointing run can save itself and stop
+static volatile sig_atomic_t stopRequested = 0;
+
+void requestStop(int) {
+    stopRequested = 1;
+}
+
+// how far -O3 (and the +prelude bench engines) run each program ahead of time (see evaluatePrelude)
+static const unsigned long long PRELUDE_STEPS = 1ULL << 24;
+
+/**
+ * The optimizer options --run, --compile, --fork-server and --bench share: -O0 to -O3, --passes LIST (run after
+ * the level's passes), --rewrites FILE (a rewrite database for the rewrites pass, which -O3 runs)
+ * and --report (what each pass did, on stderr). --compile optimizes for the C it writes, the rest for the Evaluator.
+ */
+struct Optimization {
+    Optimization() : level(0), report(false) {}
+
+    // is argv[i] one of ours? (i moves past the option's value, if it has one)
+    bool parse(int argc, char * argv[], int & i) {
+        string arg = argv[i];
+        if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '9') level = arg[2] - '0';
+        else if (arg == "--passes" && i + 1 < argc) passes = argv[++i];
+        else if (arg == "--report") report = true;
+        else if (arg == "--rewrites" && i + 1 < argc) {
+            if (!RewriteDatabase::standard().load(argv[++i])) cerr << argv[i] << ": No such file." << endl;
+        }
+        else return false;
+        return true;
+    }
+
+    // optimize program (from file) for target. false if there's no such pass.
+    bool apply(Program * program, const string & file, Target target = INTERPRETER) const {
+        PassManager manager(target);
+        manager.addLevel(level);
+        if (!manager.add(passes)) {
+            cerr << passes << ": No such pass." << endl;
+            return false;
+        }
+        manager.run(program);
+        if (report) {
+            const vector<PassManager::Report> & reports = manager.getReports();
+            for (auto it = reports.begin(); it != reports.end(); ++it) {
+                cerr << file << ": " << it->name << " changed " << it->changed << " nodes in "
+                    << it->seconds * 1000 << " ms" << endl;
+            }
+        }
+        return true;
+    }
+
+    int level;
+    string passes;
+    bool report;
 };
 
 /**
- * CommandNode publicly extends Node to accept visitors.
- * CommandNode represents a leaf node with a primitive Brainfuck command in it.
+ * Superoptimize the blocks of straight-line code in each program (optimized first, so they're the blocks the
+ * rewrites pass will see) up to length commands at a time, into the rewrite database in databaseFile.
+ * Blocks already in there don't get searched again, so the database only grows.
  */
-class CommandNode : public Node {
-    public:
-        Command command;
-        int count;
-        CommandNode(char c, int count = 1) {
-            switch(c) {
-                case '+': command = INCREMENT; break;
-                case '-': command = DECREMENT; break;
-                case '<': command = SHIFT_LEFT; break;
-                case '>': command = SHIFT_RIGHT; break;
-                case ',': command = INPUT; break;
-                case '.': command = OUTPUT; break;
-                case '0': command = ZERO; break;
-                default: throw new CommandNotValidException();
+int superoptimize(const string & databaseFile, const vector<string> & files, int length, const Optimization & optimization) {
+    RewriteDatabase database;
+    database.load(databaseFile);
+    for (auto it = files.begin(); it != files.end(); ++it) {
+        fstream file(it->c_str(), fstream::in);
+        if (!file) {
+            cerr << *it << ": No such file." << endl;
+            return 1;
+        }
+        Program program;
+        parse(file, &program);
+        if (!optimization.apply(&program, *it)) return 1;
+        size_t known = database.size();
+        auto start = chrono::steady_clock::now();
+        int shorter = database.learn(&program, length);
+        cout << *it << ": searched " << database.size() - known << " new blocks in "
+            << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s, "
+            << shorter << " got shorter" << endl;
+        // save as we go: the searches can take a while
+        if (!database.save(databaseFile)) {
+            cerr << databaseFile << ": Couldn't write the database." << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Run a program on stdin and stdout in slices, so it can be stopped and picked up again later (somewhere else).
+ * With checkpoint, running out of budget or getting SIGTERM/SIGINT saves a snapshot there and exits with 3.
+ * With resume, start from a snapshot instead of from the beginning; the same input has to be on stdin,
+ * and whatever the snapshot already read is skipped.
+ * With prelude, run up to that many steps of the part before the first , ahead of time and start from there.
+ * The program gets optimized first (snapshots only resume with the same optimization).
+ */
+int runFile(const string & programFile, const string & checkpoint, const string & resume, unsigned long long budget,
+            unsigned long long prelude, const Optimization & optimization) {
+    fstream file(programFile.c_str(), fstream::in);
+    if (!file) {
+        cerr << programFile << ": No such file." << endl;
+        return 1;
+    }
+    Program program;
+    parse(file, &program);
+    if (!optimization.apply(&program, programFile)) return 1;
+    Evaluator eval(30000);
+    if (!resume.empty()) {
+        ifstream snapshot(resume.c_str(), ios::binary);
+        if (!eval.restore(snapshot, &program)) {
+            cerr << resume << ": Not a snapshot of " << programFile << "." << endl;
+            return 1;
+        }
+        for (unsigned long long i = 0; i < eval.getInputPosition(); i++) {
+            getchar();
+        }
+    } else if (prelude) {
+        eval.start(evaluatePrelude(&program, prelude), &program);
+    }
+    if (!checkpoint.empty()) {
+        signal(SIGTERM, requestStop);
+        signal(SIGINT, requestStop);
+    }
+    unsigned long long limit = budget ? eval.getSteps() + budget : ~0ULL;
+    Evaluator::Status status;
+    while ((status = eval.run(&program, min(limit - eval.getSteps(), 1ULL << 20))) != Evaluator::FINISHED) {
+        if (status == Evaluator::OUT_OF_BOUNDS) {
+            cerr << programFile << ": Went off the end of the tape after " << eval.getSteps() << " steps." << endl;
+            return 1;
+        }
+        if (stopRequested || eval.getSteps() >= limit) {
+            if (checkpoint.empty()) return 3;
+            ofstream snapshot(checkpoint.c_str(), ios::binary);
+            eval.save(snapshot, &program);
+            if (!snapshot) {
+                cerr << checkpoint << ": Couldn't write the snapshot." << endl;
+                return 1;
             }
-            this->count = count;
+            cerr << programFile << ": Saved to " << checkpoint << " after " << eval.getSteps() << " steps." << endl;
+            return 3;
         }
-        void accept (Visitor * v) {
-            v->visit(this);
+    }
+    return 0;
+}
+
+/**
+ * Every heap allocation goes through here, so the parser benchmark can report allocations per KB.
+ * Only a thread that points allocations at a counter (benchParse, around parse()) counts anything:
+ * everyone else just pays for a look at their own thread-local, not an atomic on a shared cache line.
+ */
+static thread_local unsigned long long * allocations = nullptr;
+
+void * operator new(size_t size) {
+    if (allocations) ++*allocations;
+    if (void * p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+// g++ inlines these into callers and then can't tell our operator new is where the pointer came from
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void * p) throw() {
+    free(p);
+}
+void operator delete(void * p, size_t) throw() {
+    free(p);
+}
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+/**
+ * Write a synthetic Brainfuck source of (about) size bytes.
+ * depth bounds loop nesting, comments is the fraction of bytes that are comment characters,
+ * and run lengths of + - < > are geometric with mean runLength.
+ * The source is streamed out in chunks, so gigabyte programs don't need gigabytes of memory.
+ */
+void generate(FILE * out, unsigned long long size, int depth, double comments, double runLength, unsigned seed) {
+    static const char commentChars[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789\n";
+    static const char runChars[] = "+-<>";
+    mt19937 random(seed);
+    bernoulli_distribution comment(comments);
+    geometric_distribution<int> run(1.0 / max(1.0, runLength));
+    uniform_int_distribution<int> commentChar(0, sizeof(commentChars) - 2);
+    uniform_int_distribution<int> what(0, 15);
+    vector<char> buffer;
+    buffer.reserve(1 << 16);
+    unsigned long long written = 0;
+    int open = 0;
+
+    while (written + buffer.size() < size) {
+        if (comment(random)) {
+            buffer.push_back(commentChars[commentChar(random)]);
+        } else {
+            int choice = what(random);
+            if (choice == 0 && open < depth) {
+                buffer.push_back('[');
+                open++;
+            } else if (choice == 1 && open > 0) {
+                buffer.push_back(']');
+                open--;
+            } else if (choice == 2) {
+                buffer.push_back('.');
+            } else if (choice == 3) {
+                buffer.push_back(',');
+            } else {
+                buffer.insert(buffer.end(), run(random) + 1, runChars[choice & 3]);
+            }
         }
-};
+        if (buffer.size() >= (1 << 16) - 1) {
+            written += fwrite(&buffer[0], 1, buffer.size(), out);
+            buffer.clear();
+        }
+    }
+    buffer.insert(buffer.end(), open, ']');
+    if (!buffer.empty()) fwrite(&buffer[0], 1, buffer.size(), out);
+}
 
-class Container: public Node {
-    public:
-        vector<Node*> children;
-        virtual void accept (Visitor * v) = 0;
-};
+// sizes like 512K, 16M or 2G
+unsigned long long parseSize(const string & text) {
+    unsigned long long size = strtoull(text.c_str(), nullptr, 10);
+    switch (text.empty() ? ' ' : text[text.size() - 1]) {
+    case 'G': case 'g': size <<= 10;
+        // fall through
+    case 'M': case 'm': size <<= 10;
+        // fall through
+    case 'K': case 'k': size <<= 10;
+    }
+    return size;
+}
+
+// count the nodes in a tree
+unsigned long long countNodes(const Container * container) {
+    unsigned long long count = container->children.size();
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        if (const Container * child = dynamic_cast<const Container *>(*it)) {
+            count += countNodes(child);
+        }
+    }
+    return count;
+}
+
+// JSON strings need their quotes and backslashes escaped
+string jsonString(const string & s) {
+    string result = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\') result += '\\';
+        result += s[i];
+    }
+    return result + "\"";
+}
 
 /**
- * Loop publicly extends Node to accept visitors.
- * Loop represents a loop in Brainfuck.
+ * Time parse() over each source and print a JSON report:
+ * median throughput in MB/s, heap allocations per KB of source and the size of the tree.
  */
-class Loop : public Container {
-    public:
-        void accept (Visitor * v) {
-            v->visit(this);
+int benchParse(const vector<string> & sources, int repetitions) {
+    stringstream report;
+    int failures = 0;
+
+    report << "{\n  \"repetitions\": " << repetitions << ",\n  \"results\": [";
+    for (size_t i = 0; i < sources.size(); i++) {
+        vector<double> times;
+        unsigned long long bytes = 0, allocated = 0, nodes = 0;
+        for (int r = 0; r < repetitions; r++) {
+            fstream file(sources[i].c_str(), fstream::in);
+            if (!file) break;
+            file.seekg(0, fstream::end);
+            bytes = file.tellg();
+            file.seekg(0, fstream::beg);
+
+            Program * program = new Program();
+            allocated = 0;
+            allocations = &allocated;
+            auto start = chrono::steady_clock::now();
+            parse(file, program);
+            times.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+            allocations = nullptr;
+            nodes = countNodes(program);
+            delete program;
+        }
+        if (times.empty()) {
+            cerr << sources[i] << ": No such file." << endl;
+            failures++;
+            continue;
+        }
+        sort(times.begin(), times.end());
+        double median = times[times.size() / 2];
+        report << (i ? ",\n" : "\n") << "    { \"source\": " << jsonString(sources[i])
+            << ", \"bytes\": " << bytes
+            << ", \"median_ms\": " << median * 1000
+            << ", \"mb_per_sec\": " << (median > 0 ? bytes / median / (1 << 20) : 0)
+            << ", \"allocations\": " << allocated
+            << ", \"allocations_per_kb\": " << (bytes ? allocated * 1024.0 / bytes : 0)
+            << ", \"nodes\": " << nodes << " }";
+    }
+    report << "\n  ]\n}\n";
+    cout << report.str();
+    return failures ? 1 : 0;
+}
+
+#ifndef _WIN32
+/**
+ * The benchmark harness.
+ * Every workload is parsed once, then run through every engine a few times.
+ * Each run happens in a forked child with stdin and stdout on /dev/null,
+ * so every sample gets its own wall time and its own peak resident set size.
+ */
+class Engine {
+public:
+    virtual ~Engine() {}
+    // what we call this strategy in the report
+    virtual const char * name() const = 0;
+    // get ready to run the program (compile it, etc). false if we can't.
+    virtual bool prepare(Program * program) = 0;
+    // run the prepared program. called in the child, which exits afterwards.
+    virtual void run() = 0;
+    // how many of the program's steps prepare already took care of, so run doesn't do them
+    virtual unsigned long long skipped() const { return 0; }
+    // what the program gets optimized for before it gets here
+    virtual Target target() const { return INTERPRETER; }
+};
+
+// walk the tree with the Evaluator (after skipping the prelude, with prelude set)
+class EvaluatorEngine : public Engine {
+public:
+    EvaluatorEngine(bool prelude = false) : program(nullptr), prelude(prelude) {}
+    const char * name() const { return prelude ? "evaluator+prelude" : "evaluator"; }
+    bool prepare(Program * program) {
+        this->program = program;
+        if (prelude) start = evaluatePrelude(program, PRELUDE_STEPS);
+        return true;
+    }
+    void run() {
+        Evaluator eval(30000);
+        if (prelude) eval.start(start, program);
+        program->accept(&eval);
+    }
+    unsigned long long skipped() const { return prelude ? start.steps : 0; }
+private:
+    Program * program;
+    bool prelude; // start where the input-independent part of the program leaves off?
+    Prelude start; // where that is
+};
+
+// translate to C with the Compiler, build it with $CC (or cc) and run the binary
+class CompilerEngine : public Engine {
+public:
+    CompilerEngine(bool prelude = false) : prelude(prelude) {
+        char dir[] = "/tmp/bfbench-XXXXXX";
+        if (mkdtemp(dir)) {
+            this->dir = dir;
         }
+    }
+    ~CompilerEngine() {
+        if (!dir.empty()) {
+            remove(source().c_str());
+            remove(binary().c_str());
+            rmdir(dir.c_str());
+        }
+    }
+    const char * name() const { return prelude ? "compiler+prelude" : "compiler"; }
+    bool prepare(Program * program) {
+        if (dir.empty()) return false;
+        ofstream c(source().c_str());
+        if (prelude) start = evaluatePrelude(program, PRELUDE_STEPS);
+        Compiler compile(c, 0, prelude ? &start : nullptr);
+        program->accept(&compile);
+        c.close();
+        const char * cc = getenv("CC");
+        string command = string(cc ? cc : "cc") + " -O2 -o " + binary() + " " + source();
+        return system(command.c_str()) == 0;
+    }
+    void run() {
+        execl(binary().c_str(), binary().c_str(), (char *)nullptr);
+    }
+    unsigned long long skipped() const { return prelude ? start.steps : 0; }
+    Target target() const { return COMPILED; }
+private:
+    string source() const { return dir + "/program.c"; }
+    string binary() const { return dir + "/program"; }
+    string dir; // scratch space for the generated code
+    bool prelude; // bake the input-independent part of the program into the binary?
+    Prelude start; // the part that gets baked in
 };
 
 /**
- * Program is the root of a Brainfuck program abstract syntax tree.
- * Because Brainfuck is so primitive, the parse tree is the abstract syntax tree.
+ * Hardware performance counters for one child process, via perf_event_open on Linux.
+ * Each counter is opened on its own, so if the CPU, the VM or perf_event_paranoid
+ * won't give us one of them, that one just reads as -1 and the rest still work.
  */
-class Program : public Container {
-    public:
-        void accept (Visitor * v) {
-            v->visit(this);
+class Counters {
+public:
+    enum { CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, ITLB_MISSES, COUNT };
+
+    Counters() {
+        for (int i = 0; i < COUNT; i++) fds[i] = -1;
+    }
+    ~Counters() {
+        for (int i = 0; i < COUNT; i++) if (fds[i] >= 0) close(fds[i]);
+    }
+
+    // start counting user-space events of pid (which should be waiting for us)
+    void attach(pid_t pid) {
+#ifdef __linux__
+        const unsigned long long cache = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const struct { unsigned type; unsigned long long config; } events[COUNT] = {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | cache },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB | cache },
+        };
+        for (int i = 0; i < COUNT; i++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[i].type;
+            attr.config = events[i].config;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = 1;
+            fds[i] = syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+        }
+#endif
+    }
+
+    // read the final counts, after the child exits
+    void read(long long values[COUNT]) const {
+        for (int i = 0; i < COUNT; i++) {
+            values[i] = -1;
+            if (fds[i] >= 0 && ::read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i])) {
+                values[i] = -1;
+            }
         }
+    }
+
+private:
+    int fds[COUNT];
+};
+
+// one timed run of one engine
+struct Sample {
+    double seconds; // wall time, fork to reap
+    long peakKb; // peak resident set size of the child
+    bool ok; // did the child exit cleanly?
+    long long counters[Counters::COUNT]; // hardware counters (-1 if unavailable)
 };
 
+Sample runSample(Engine & engine) {
+    Sample sample = { 0, 0, false, { -1, -1, -1, -1, -1 } };
+    int go[2];
+    if (pipe(go) != 0) return sample;
+    fflush(stdout);
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // wait until the parent has the counters attached, then run
+        char ready;
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, 0);
+        dup2(null, 1);
+        close(go[1]);
+        if (::read(go[0], &ready, 1) != 1) _exit(1);
+        engine.run();
+        _exit(0);
+    }
+    close(go[0]);
+    if (pid < 0) {
+        close(go[1]);
+        return sample;
+    }
+    Counters counters;
+    counters.attach(pid);
+    if (write(go[1], "", 1) != 1) kill(pid, SIGKILL);
+    close(go[1]);
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    sample.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    sample.peakKb = usage.ru_maxrss;
+    sample.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    counters.read(sample.counters);
+    return sample;
+}
+
+// a counter total as JSON, or null if we couldn't read it
+string jsonCounter(long long value) {
+    if (value < 0) return "null";
+    stringstream s;
+    s << value;
+    return s.str();
+}
+
+// count how many steps a workload takes, so we can report steps per second
+unsigned long long countSteps(Program * program) {
+    FILE * null = fopen("/dev/null", "r+");
+    Evaluator eval(30000, null, null);
+    program->accept(&eval);
+    fclose(null);
+    return eval.getSteps();
+}
+
 /**
- * Read in the file by recursive descent.
- * Modify as necessary and add whatever functions you need to get things done.
+ * Run every workload through every engine and print a JSON report:
+ * median wall time, steps per second and peak RSS per (workload, engine),
+ * plus the mean hardware counters, IPC and branch mispredicts per executed step.
+ * Steps are the ones the timed run executed: a +prelude engine's prelude is reported apart, as prelude_steps.
+ * Each workload gets optimized first, for each engine's target; optimize_ms says what that cost, to weigh against
+ * the runtime it saves.
  */
-void parse(fstream & file, Container * container) {
-    char c = '\0';
-    Loop* loop = nullptr;
-    int multiples = 0;
+int bench(const vector<string> & workloads, int warmups, int repetitions, const Optimization & optimization) {
+    EvaluatorEngine evaluator, evaluatorPrelude(true);
+    CompilerEngine compiler, compilerPrelude(true);
+    Engine * engines[] = { &evaluator, &evaluatorPrelude, &compiler, &compilerPrelude };
+    stringstream report;
+    bool first = true;
+    int failures = 0;
 
-    while (file >> c)
-    {
-        switch (c)
-        {
-        case '+':
-        case '-':
-        case '<':
-        case '>':
-        case ',':
-        case '.':
-            multiples = 1;
-            while (file.peek() == c){
-                multiples++;
-                file >> c;
+    report << "{\n  \"warmups\": " << warmups << ",\n  \"repetitions\": " << repetitions
+        << ",\n  \"opt_level\": " << optimization.level << ",\n  \"passes\": " << jsonString(optimization.passes)
+        << ",\n  \"results\": [";
+    for (size_t w = 0; w < workloads.size(); w++) {
+        fstream file(workloads[w].c_str(), fstream::in);
+        if (!file) {
+            cerr << workloads[w] << ": No such file." << endl;
+            failures++;
+            continue;
+        }
+        // optimized once for each target, since the engines don't all want the same thing
+        stringstream source;
+        source << file.rdbuf();
+        Program programs[COMPILED + 1];
+        double optimizeSeconds[COMPILED + 1];
+        unsigned long long totals[COMPILED + 1];
+        for (int target = INTERPRETER; target <= COMPILED; target++) {
+            string text = source.str();
+            parse(text.data(), text.size(), &programs[target]);
+            auto start = chrono::steady_clock::now();
+            if (!optimization.apply(&programs[target], workloads[w], (Target)target)) return 1;
+            optimizeSeconds[target] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            totals[target] = countSteps(&programs[target]);
+        }
+
+        for (Engine * engine : engines) {
+            Program & program = programs[engine->target()];
+            unsigned long long total = totals[engine->target()];
+            if (!engine->prepare(&program)) {
+                cerr << workloads[w] << ": " << engine->name() << " could not prepare the program." << endl;
+                failures++;
+                continue;
             }
-            container->children.push_back(new CommandNode(c, multiples));
-            break;
-        case '[':
-            loop = new Loop();
-            parse(file, loop);
-            if (loop->children.size() == 1)
-            {
-                CommandNode*leaf = (CommandNode*)loop->children[0];
-                if (leaf->command == '+' || leaf->command == '-')
-                {
-                    container->children.push_back(new CommandNode('0', 1));
-                    break;
-                }
-                else
-                {
-                    container->children.push_back(loop);
-                    break;
+            for (int i = 0; i < warmups; i++) {
+                runSample(*engine);
+            }
+            vector<double> times;
+            long peakKb = 0;
+            long long counters[Counters::COUNT] = { 0 };
+            for (int i = 0; i < repetitions; i++) {
+                Sample sample = runSample(*engine);
+                if (!sample.ok) failures++;
+                times.push_back(sample.seconds);
+                peakKb = max(peakKb, sample.peakKb);
+                for (int c = 0; c < Counters::COUNT; c++) {
+                    counters[c] = counters[c] < 0 || sample.counters[c] < 0 ? -1 : counters[c] + sample.counters[c];
                 }
             }
-            container->children.push_back(loop);
-            break;
-        case ']':
-            return;
+            sort(times.begin(), times.end());
+            double median = times.size() % 2 ? times[times.size() / 2]
+                : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2;
+            // counters are averaged over the repetitions
+            for (int c = 0; c < Counters::COUNT; c++) {
+                if (counters[c] >= 0) counters[c] /= repetitions;
+            }
+            long long cycles = counters[Counters::CYCLES], instructions = counters[Counters::INSTRUCTIONS];
+            long long branchMisses = counters[Counters::BRANCH_MISSES];
+            // the steps the timed runs did; a prelude's were done in prepare, untimed
+            unsigned long long prelude = min(engine->skipped(), total), steps = total - prelude;
+
+            report << (first ? "\n" : ",\n") << "    { \"workload\": " << jsonString(workloads[w])
+                << ", \"engine\": " << jsonString(engine->name())
+                << ", \"optimize_ms\": " << optimizeSeconds[engine->target()] * 1000
+                << ", \"median_ms\": " << median * 1000
+                << ", \"steps\": " << steps
+                << ", \"prelude_steps\": " << prelude
+                << ", \"steps_per_sec\": " << (median > 0 ? steps / median : 0)
+                << ", \"peak_rss_kb\": " << peakKb
+                << ", \"cycles\": " << jsonCounter(cycles)
+                << ", \"instructions\": " << jsonCounter(instructions)
+                << ", \"branch_misses\": " << jsonCounter(branchMisses)
+                << ", \"l1d_misses\": " << jsonCounter(counters[Counters::L1D_MISSES])
+                << ", \"itlb_misses\": " << jsonCounter(counters[Counters::ITLB_MISSES])
+                << ", \"ipc\": ";
+            if (cycles > 0 && instructions >= 0) report << (double)instructions / cycles;
+            else report << "null";
+            report << ", \"mispredicts_per_op\": ";
+            if (branchMisses >= 0 && steps > 0) report << (double)branchMisses / steps;
+            else report << "null";
+            report << " }";
+            first = false;
         }
     }
+    report << "\n  ]\n}\n";
+    cout << report.str();
+    return failures ? 1 : 0;
 }
+#endif
 
+#ifndef _WIN32
 /**
- * A printer for Brainfuck abstract syntax trees.
- * As a visitor, it will just print out the commands as is.
- * For Loops and the root Program node, it walks trough all the children.
+ * The daemon: brainfuck.exe --serve SOCKET keeps parsed programs in a ProgramCache and runs them
+ * for whoever connects to the Unix domain socket, so repeat customers skip startup and parse().
+ * Each connection gets its own thread and can send any number of requests:
+ *
+ *   LOAD <length>\n<source>          -> OK <digest>\n
+ *   RUN <digest> <length>\n<input>   -> OUT <length>\n<output> ... END finished|paused|out-of-bounds <steps>\n
+ *                                       or MISS <digest>\n if the program isn't cached (LOAD it, then RUN again)
+ *
+ * Digests are digestSource(), SHA-256 in hex. Output streams back in chunks while the program runs.
+ * Every run gets at most budget steps, no request can be longer than maxSize bytes (it gets ERR too big),
+ * and there are at most connections clients at a time (the rest wait).
  */
-class Printer : public Visitor {
-    public:
-        void visit(const CommandNode * leaf) {
-            switch (leaf->command) {
-            case INCREMENT:   for (int i = 0; i < leaf->count; i++){
-                cout << '+';
-            } break;
-            case DECREMENT:   for (int i = 0; i < leaf->count; i++){
-                cout << '-';
-            } break;
-            case SHIFT_LEFT:  for (int i = 0; i < leaf->count; i++){
-                cout << '<';
-            } break;
-            case SHIFT_RIGHT: for (int i = 0; i < leaf->count; i++){
-                cout << '>';
-            } break;
-            case INPUT:       for (int i = 0; i < leaf->count; i++){
-                cout << ',';
-            } break;
-            case OUTPUT:      for (int i = 0; i < leaf->count; i++){
-                cout << '.';
-            } break;
-            case ZERO:        for (int i = 0; i < leaf->count; i++){
-                cout << '[+]';
-            } break;
-            }
+bool readFully(int fd, char * data, size_t length) {
+    while (length > 0) {
+        ssize_t got = recv(fd, data, length, 0);
+        if (got <= 0) return false;
+        data += got;
+        length -= got;
+    }
+    return true;
+}
+
+bool writeFully(int fd, const char * data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, 0);
+        if (sent <= 0) return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+bool writeFully(int fd, const string & data) {
+    return writeFully(fd, data.data(), data.size());
+}
+
+// headers are short, so a byte at a time is fine
+bool readLine(int fd, string & line) {
+    line.clear();
+    char c;
+    while (readFully(fd, &c, 1)) {
+        if (c == '\n') return true;
+        line += c;
+        if (line.size() > 256) return false;
+    }
+    return false;
+}
+
+void serveClient(int fd, ProgramCache * cache, unsigned long long budget, size_t maxSize) {
+    string line;
+    while (readLine(fd, line)) {
+        stringstream header(line);
+        string command, digest;
+        size_t length = 0;
+        header >> command;
+        if (command == "RUN") header >> digest;
+        header >> length;
+        if (!header || (command != "LOAD" && command != "RUN")) {
+            writeFully(fd, "ERR bad request\n");
+            break;
         }
-        void visit(const Loop * loop) {
-            cout << '[';
-            for (vector<Node*>::const_iterator it = loop->children.begin(); it != loop->children.end(); ++it) {
-                (*it)->accept(this);
-            }
-            cout << ']';
+        if (length > maxSize) {
+            writeFully(fd, "ERR too big\n");
+            break;
         }
-        void visit(const Program * program) {
-            for (vector<Node*>::const_iterator it = program->children.begin(); it != program->children.end(); ++it) {
-                (*it)->accept(this);
-            }
-            cout << '\n';
+        string body(length, '\0');
+        if (length && !readFully(fd, &body[0], length)) break;
+
+        if (command == "LOAD") {
+            if (!writeFully(fd, "OK " + cache->add(body.data(), body.size()) + "\n")) break;
+            continue;
         }
-};
+        shared_ptr<const Program> program = cache->find(digest);
+        if (!program) {
+            if (!writeFully(fd, "MISS " + digest + "\n")) break;
+            continue;
+        }
+        size_t pos = 0;
+        bool connected = true;
+        CallbackIO io([&] { return pos < body.size() ? (unsigned char)body[pos++] : EOF; },
+            [&](const char * data, size_t length) {
+                stringstream chunk;
+                chunk << "OUT " << length << "\n";
+                connected = connected && writeFully(fd, chunk.str()) && writeFully(fd, data, length);
+            });
+        Evaluator eval(30000, &io);
+        Evaluator::Status status = eval.run(program.get(), budget);
+        stringstream end;
+        end << "END " << (status == Evaluator::FINISHED ? "finished" : status == Evaluator::OUT_OF_BOUNDS ? "out-of-bounds" : "paused")
+            << " " << eval.getSteps() << "\n";
+        if (!connected || !writeFully(fd, end.str())) break;
+    }
+    close(fd);
+}
 
-// the evaluator. based on http://en.wikipedia.org/wiki/Brainfuck#Commands
-class Evaluator : public Visitor {
-public:
-    // create an evaluator with a limit of memory (overuse throws)
-    Evaluator(int maxMemory) : max(maxMemory), pos(0), arr(new unsigned char[maxMemory])
-    {
-        memset(arr, 0, sizeof(arr));
-        ptr = arr;
-    }
-
-    // handle all the ops of the commandnode
-    void visit(const CommandNode * leaf) {
-        switch (leaf->command) {
-        case INCREMENT:     for (int i = 0; i < leaf->count; i++){
-            ++*ptr;
-        } break;
-        case DECREMENT:     for (int i = 0; i < leaf->count; i++){
-            --*ptr;
-        } break;
-        case SHIFT_RIGHT:   for (int i = 0; i < leaf->count; i++){
-            ++ptr;
-        } break;
-        case SHIFT_LEFT:    for (int i = 0; i < leaf->count; i++){
-            --ptr;
-        } break;
-        case INPUT:         for (int i = 0; i < leaf->count; i++){
-            *ptr = getchar();
-        } break;
-        case OUTPUT:        for (int i = 0; i < leaf->count; i++){
-            putchar(*ptr);
-        } break;
-        case ZERO:          for (int i = 0; i < leaf->count; i++){
-            *ptr = 0;
-        } break;
-        }
-    }
-
-    // handle a loop
-    void visit(const Loop * loop) {
-        while (*ptr) {
-            for (auto it = loop->children.begin(); it != loop->children.end(); ++it) {
-                (*it)->accept(this);
-            }
+int serve(const string & path, size_t capacity, unsigned long long budget, int connections, size_t maxSize) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << path << ": Socket path is too long." << endl;
+        return 1;
+    }
+    strcpy(address.sun_path, path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listener < 0 || ::bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        perror(path.c_str());
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    ProgramCache cache(capacity);
+    mutex m;
+    condition_variable freed; // a client went away
+    int clients = 0; // connections with a thread right now
+    while (true) {
+        {
+            unique_lock<mutex> lock(m);
+            freed.wait(lock, [&] { return clients < connections; });
+        }
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) continue;
+        {
+            lock_guard<mutex> lock(m);
+            clients++;
         }
+        // we never return, so the threads can hang on to our locals
+        thread([&, fd] {
+            serveClient(fd, &cache, budget, maxSize);
+            lock_guard<mutex> lock(m);
+            clients--;
+            freed.notify_one();
+        }).detach();
     }
+}
+
+// the other end: run file on the daemon, with our stdin as its input
+int client(const string & path, const string & filename) {
+    ifstream file(filename.c_str(), ios::binary);
+    if (!file) {
+        cerr << filename << ": No such file." << endl;
+        return 1;
+    }
+    stringstream source, input;
+    source << file.rdbuf();
+    input << cin.rdbuf();
+    string program = source.str(), data = input.str();
 
-    // handle a program
-    void visit(const Program * program) {
-        for (auto it = program->children.begin(); it != program->children.end(); ++it) {
-            (*it)->accept(this);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        perror(path.c_str());
+        return 1;
+    }
+    stringstream run;
+    run << "RUN " << digestSource(program.data(), program.size()) << " " << data.size() << "\n";
+    string line;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!writeFully(fd, run.str()) || !writeFully(fd, data) || !readLine(fd, line)) break;
+        if (line.compare(0, 5, "MISS ") == 0) {
+            stringstream load;
+            load << "LOAD " << program.size() << "\n";
+            if (!writeFully(fd, load.str()) || !writeFully(fd, program) || !readLine(fd, line)) break;
+            continue;
         }
-        cout << '\n';
+        while (line.compare(0, 4, "OUT ") == 0) {
+            string chunk(strtoul(line.c_str() + 4, nullptr, 10), '\0');
+            if (!readFully(fd, &chunk[0], chunk.size())) break;
+            cout.write(chunk.data(), chunk.size());
+            if (!readLine(fd, line)) break;
+        }
+        cout.flush();
+        close(fd);
+        if (line.compare(0, 13, "END finished ") == 0) return 0;
+        cerr << filename << ": " << (line.empty() ? "Lost the connection." : line) << endl;
+        return 1;
     }
+    close(fd);
+    cerr << filename << ": Lost the connection." << endl;
+    return 1;
+}
+#endif
 
-private:
-    unsigned char* ptr; // the instruction pointer
-    int pos; // the instruction pointer position (for memory safety checks)
-    int max; // the size of memory we have to work in (for memory safety checks)
-    unsigned char* arr; // the actual memory we have to work in
-};
+#ifndef _WIN32
+/**
+ * The fork-server: parse the program and set up an Evaluator once (tape allocated, and with a prelude,
+ * the part before the first , already run), then fork() a child per input. The children share the tree
+ * and the ready tape with us copy-on-write, so each input costs a fork instead of all that.
+ * Each line of the inputs file is one input; the outputs come back in the same order.
+ * Up to jobs children run at once; a child's output comes back over a pipe.
+ * The program gets optimized before the prelude, so that's done once too.
+ */
+int forkServer(const string & programFile, const string & inputsFile, int jobs, unsigned long long budget,
+               unsigned long long prelude, const Optimization & optimization) {
+    fstream file(programFile.c_str(), fstream::in);
+    if (!file) {
+        cerr << programFile << ": No such file." << endl;
+        return 1;
+    }
+    ifstream inputs(inputsFile.c_str(), ios::binary);
+    if (!inputs) {
+        cerr << inputsFile << ": No such file." << endl;
+        return 1;
+    }
+    Program program;
+    parse(file, &program);
+    if (!optimization.apply(&program, programFile)) return 1;
+    BufferIO io("", false);
+    Evaluator ready(30000, &io); // every child starts from this one
+    if (prelude) ready.start(evaluatePrelude(&program, prelude), &program);
 
-// the compiler outputs c code
-class Compiler : public Visitor {
-public:    
-    // handle all the ops of the commandnode
-    void visit(const CommandNode * leaf) {
-        switch (leaf->command) {
-        case INCREMENT:     for (int i = 0; i < leaf->count; i++){
-            cout << "++*ptr;" << endl;
-        } break;
-        case DECREMENT:     for (int i = 0; i < leaf->count; i++){
-            cout << "--*ptr;" << endl;
-        } break;
-        case SHIFT_RIGHT:   for (int i = 0; i < leaf->count; i++){
-            cout << "++ptr;" << endl;
-        } break;
-        case SHIFT_LEFT:    for (int i = 0; i < leaf->count; i++){
-            cout << "--ptr;" << endl;
-        } break;
-        case INPUT:         for (int i = 0; i < leaf->count; i++){
-            cout << "*ptr = getchar();" << endl;
-        } break;
-        case OUTPUT:        for (int i = 0; i < leaf->count; i++){
-            cout << "putchar(*ptr);" << endl;
-        } break;
-        case ZERO:          for (int i = 0; i < leaf->count; i++){
-            cout << "*ptr = 0;" << endl;
-        } break;
-        }
-    }
-
-    // handle a loop
-    void visit(const Loop * loop) {
-        cout << "while (*ptr) {" << endl;
-        for (auto it = loop->children.begin(); it != loop->children.end(); ++it) {
-            (*it)->accept(this);
-        }
-        cout << "}" << endl;
-    }
-
-    // handle a program
-    void visit(const Program * program) {
-        cout << "#include <stdio.h>" << endl;
-        cout << "int main(int argc, char** argv) {" << endl;
-        for (auto it = program->children.begin(); it != program->children.end(); ++it) {
-            (*it)->accept(this);
-        }
-        cout << '}' << endl;
+    struct Child {
+        pid_t pid;
+        int output; // the read end of the child's pipe
+    };
+    deque<Child> running;
+    int failures = 0;
+    string line;
+    bool more = true;
+    fflush(stdout);
+
+    while (more || !running.empty()) {
+        // keep jobs children going
+        while (more && (int)running.size() < max(1, jobs)) {
+            if (!getline(inputs, line)) {
+                more = false;
+                break;
+            }
+            int pipes[2];
+            if (pipe(pipes) != 0) {
+                perror("pipe");
+                return 1;
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(pipes[0]);
+                io.feed(line, true);
+                Evaluator::Status status = ready.run(&program, budget);
+                const char * data = io.output.data();
+                size_t length = io.output.size();
+                while (length > 0) {
+                    ssize_t sent = write(pipes[1], data, length);
+                    if (sent <= 0) break;
+                    data += sent;
+                    length -= sent;
+                }
+                _exit(status == Evaluator::FINISHED ? 0 : 3);
+            }
+            close(pipes[1]);
+            if (pid < 0) {
+                perror("fork");
+                close(pipes[0]);
+                return 1;
+            }
+            Child child = { pid, pipes[0] };
+            running.push_back(child);
+        }
+        if (running.empty()) break;
+
+        // copy the oldest child's output through, in order
+        Child child = running.front();
+        running.pop_front();
+        char buffer[1 << 14];
+        ssize_t got;
+        while ((got = read(child.output, buffer, sizeof(buffer))) > 0) {
+            fwrite(buffer, 1, got, stdout);
+        }
+        close(child.output);
+        int status = 0;
+        waitpid(child.pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failures++;
     }
-};
+    fflush(stdout);
+    if (failures) cerr << programFile << ": " << failures << " run(s) didn't finish." << endl;
+    return failures ? 1 : 0;
+}
+#endif
 
 int main(int argc, char *argv[]) {
     fstream file;
+    if (argc > 2 && (string(argv[1]) == "--serve" || string(argv[1]) == "--client")) {
+#ifndef _WIN32
+        // brainfuck.exe --serve SOCKET [--cache PROGRAMS] [--budget STEPS] [--connections N] [--max-size SIZE]
+        // brainfuck.exe --client SOCKET program.bf < input
+        if (string(argv[1]) == "--client") return client(argv[2], argc > 3 ? argv[3] : "");
+        size_t capacity = 256;
+        // anybody can connect, so nobody gets to hold a thread forever, or all our memory
+        // (a budget of 0 still means no limit, if you ask for it)
+        unsigned long long budget = 1ULL << 30;
+        int connections = 64;
+        size_t maxSize = 16 << 20;
+        for (int i = 3; i + 1 < argc; i += 2) {
+            string arg = argv[i];
+            if (arg == "--cache") capacity = strtoul(argv[i + 1], nullptr, 10);
+            else if (arg == "--budget") budget = strtoull(argv[i + 1], nullptr, 10);
+            else if (arg == "--connections") connections = max(1, atoi(argv[i + 1]));
+            else if (arg == "--max-size") maxSize = parseSize(argv[i + 1]);
+        }
+        return serve(argv[2], capacity, budget, connections, maxSize);
+#else
+        cout << argv[0] << ": " << argv[1] << " needs Unix domain sockets." << endl;
+        return 1;
+#endif
+    }
+    if (argc > 2 && string(argv[1]) == "--run") {
+        // brainfuck.exe --run program.bf [--checkpoint FILE] [--resume FILE] [--budget STEPS] [--prelude STEPS]
+        //               [-O0..-O3] [--passes LIST] [--report] < input
+        string checkpoint, resume;
+        unsigned long long budget = 0, prelude = 0;
+        Optimization optimization;
+        for (int i = 3; i < argc; i++) {
+            string arg = argv[i];
+            if (optimization.parse(argc, argv, i)) continue;
+            if (i + 1 >= argc) break;
+            if (arg == "--checkpoint") checkpoint = argv[++i];
+            else if (arg == "--resume") resume = argv[++i];
+            else if (arg == "--budget") budget = strtoull(argv[++i], nullptr, 10);
+            else if (arg == "--prelude") prelude = strtoull(argv[++i], nullptr, 10);
+        }
+        if (optimization.level >= 3 && !prelude) prelude = PRELUDE_STEPS;
+        return runFile(argv[2], checkpoint, resume, budget, prelude, optimization);
+    }
+    if (argc > 2 && string(argv[1]) == "--compile") {
+        // brainfuck.exe --compile program.bf [--budget STEPS] [--prelude STEPS] [-O0..-O3] [--passes LIST] [--report] > program.c
+        unsigned long long budget = 0, prelude = 0;
+        Optimization optimization;
+        for (int i = 3; i < argc; i++) {
+            string arg = argv[i];
+            if (optimization.parse(argc, argv, i)) continue;
+            if (i + 1 >= argc) break;
+            if (arg == "--budget") budget = strtoull(argv[++i], nullptr, 10);
+            else if (arg == "--prelude") prelude = strtoull(argv[++i], nullptr, 10);
+        }
+        if (optimization.level >= 3 && !prelude) prelude = PRELUDE_STEPS;
+        file.open(argv[2], fstream::in);
+        if (!file) {
+            cerr << argv[2] << ": No such file." << endl;
+            return 1;
+        }
+        Program program;
+        parse(file, &program);
+        if (!optimization.apply(&program, argv[2], COMPILED)) return 1;
+        Prelude start;
+        if (prelude) start = evaluatePrelude(&program, prelude);
+        Compiler compile(cout, budget, prelude ? &start : nullptr);
+        program.accept(&compile);
+        return 0;
+    }
+    if (argc > 3 && string(argv[1]) == "--superoptimize") {
+        // brainfuck.exe --superoptimize rewrites.db [--length N] [-O0..-O3] [--passes LIST] [--report] program.bf ...
+        int length = 5;
+        vector<string> files;
+        Optimization optimization;
+        optimization.level = 2;
+        for (int i = 3; i < argc; i++) {
+            string arg = argv[i];
+            if (optimization.parse(argc, argv, i)) continue;
+            if (arg == "--length" && i + 1 < argc) length = atoi(argv[++i]);
+            else files.push_back(arg);
+        }
+        return superoptimize(argv[2], files, length, optimization);
+    }
+    if (argc > 3 && string(argv[1]) == "--each") {
+        // brainfuck.exe --each program.bf inputs.txt [--nul] [--memo] [--budget STEPS]
+        bool nul = false, memo = false;
+        unsigned long long budget = 0;
+        for (int i = 4; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--nul") nul = true;
+            else if (arg == "--memo") memo = true;
+            else if (arg == "--budget" && i + 1 < argc) budget = strtoull(argv[++i], nullptr, 10);
+        }
+        return each(argv[2], argv[3], nul, memo, budget);
+    }
+    if (argc > 3 && string(argv[1]) == "--fork-server") {
+#ifndef _WIN32
+        // brainfuck.exe --fork-server program.bf inputs.txt [-j N] [--budget STEPS] [--prelude STEPS]
+        //               [-O0..-O3] [--passes LIST] [--report]
+        int jobs = max(1u, thread::hardware_concurrency());
+        unsigned long long budget = 0, prelude = 0;
+        Optimization optimization;
+        for (int i = 4; i < argc; i++) {
+            string arg = argv[i];
+            if (optimization.parse(argc, argv, i)) continue;
+            if (i + 1 >= argc) break;
+            if (arg == "-j") jobs = atoi(argv[++i]);
+            else if (arg == "--budget") budget = strtoull(argv[++i], nullptr, 10);
+            else if (arg == "--prelude") prelude = strtoull(argv[++i], nullptr, 10);
+        }
+        if (optimization.level >= 3 && !prelude) prelude = PRELUDE_STEPS;
+        return forkServer(argv[2], argv[3], jobs, budget, prelude, optimization);
+#else
+        cout << argv[0] << ": --fork-server needs fork(), which Windows doesn't have." << endl;
+        return 1;
+#endif
+    }
+    if (argc > 1 && string(argv[1]) == "--batch") {
+        // brainfuck.exe --batch [-j N] [--stream] [--budget STEPS] program.bf ...
+        int workers = max(1u, thread::hardware_concurrency());
+        bool stream = false;
+        unsigned long long budget = 0;
+        vector<string> files;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "-j" && i + 1 < argc) workers = atoi(argv[++i]);
+            else if (arg == "--stream") stream = true;
+            else if (arg == "--budget" && i + 1 < argc) budget = strtoull(argv[++i], nullptr, 10);
+            else files.push_back(arg);
+        }
+        return batch(files, workers, stream, budget);
+    }
+    if (argc > 1 && string(argv[1]) == "--bench") {
+#ifndef _WIN32
+        // brainfuck.exe --bench [--warmup N] [--reps N] [-O0..-O3] [--passes LIST] [--report] [workload.bf ...]
+        int warmups = 1, repetitions = 5;
+        vector<string> workloads;
+        Optimization optimization;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            if (optimization.parse(argc, argv, i)) continue;
+            if (arg == "--warmup" && i + 1 < argc) warmups = atoi(argv[++i]);
+            else if (arg == "--reps" && i + 1 < argc) repetitions = max(1, atoi(argv[++i]));
+            else workloads.push_back(arg);
+        }
+        if (workloads.empty()) {
+            const char * defaults[] = { "helloworld.bf", "99botles.bf",
+                "bench/mandelbrot.bf", "bench/hanoi.bf", "bench/numbers.bf" };
+            workloads.assign(defaults, defaults + sizeof(defaults) / sizeof(defaults[0]));
+        }
+        return bench(workloads, warmups, repetitions, optimization);
+#else
+        cout << argv[0] << ": --bench needs fork(), which Windows doesn't have." << endl;
+        return 1;
+#endif
+    }
+    if (argc > 1 && string(argv[1]) == "--generate") {
+        // brainfuck.exe --generate SIZE [--depth N] [--comments F] [--run N] [--seed N] > synthetic.bf
+        unsigned long long size = argc > 2 ? parseSize(argv[2]) : 1 << 20;
+        int depth = 8;
+        double comments = 0.1, runLength = 3;
+        unsigned seed = 603;
+        for (int i = 3; i + 1 < argc; i += 2) {
+            string arg = argv[i];
+            if (arg == "--depth") depth = atoi(argv[i + 1]);
+            else if (arg == "--comments") comments = atof(argv[i + 1]);
+            else if (arg == "--run") runLength = atof(argv[i + 1]);
+            else if (arg == "--seed") seed = strtoul(argv[i + 1], nullptr, 10);
+        }
+        generate(stdout, size, depth, comments, runLength, seed);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-parse") {
+        // brainfuck.exe --bench-parse [--reps N] source.bf ...
+        int repetitions = 3;
+        vector<string> sources;
+        for (int i = 2; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--reps" && i + 1 < argc) repetitions = max(1, atoi(argv[++i]));
+            else sources.push_back(arg);
+        }
+        return benchParse(sources, repetitions);
+    }
     if (argc == 1) {
         cout << argv[0] << ": No input files." << endl;
     } else if (argc > 1) {
@@ -345,4 +1402,5 @@ int main(int argc, char *argv[]) {
             file.close();
         }
     }
+    return 0;
 }
\ No newline at end of file
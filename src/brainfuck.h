@@ -0,0 +1,1143 @@
+/*
+= libbrainfuck
+
+The parser, the abstract syntax tree and the engines (Printer, Evaluator, Compiler, Scheduler),
+as a static library you can embed. Nothing in here is global: separate instances (parse trees,
+Evaluators, Schedulers) can be used from separate threads at the same time, as long as they
+don't share an IO. The default Evaluator IO is the console, so give each instance its own.
+
+----
+#include "brainfuck.h"
+
+brainfuck::RunResult result = brainfuck::execute(source.data(), source.size(), input);
+std::cout << result.output;
+----
+*/
+
+#ifndef BRAINFUCK_H
+#define BRAINFUCK_H
+
+#include <vector>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <string>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <list>
+#include <unordered_map>
+
+namespace brainfuck {
+
+/**
+ * Primitive Brainfuck commands
+ */
+typedef enum { 
+    INCREMENT, // +
+    DECREMENT, // -
+    SHIFT_LEFT, // <
+    SHIFT_RIGHT, // >
+    INPUT, // ,
+    OUTPUT, // .
+    ZERO, // [-] or [+]
+    PRINT, // a run of . whose bytes we already know (see OutputFolding)
+    SET, // [-]+++: set count cells, from offset on, to value (see SetFusion)
+    MULTIPLY, // [->+++<]: add the cell at source times value to the cell at offset (see MultiplyLoops)
+    SCAN // [>]: move value cells at a time until the pointer's on a 0 (see Peephole)
+} Command;
+
+// Forward references. Silly C++!
+class CommandNode;
+class Loop;
+class Program;
+
+/**
+ * Visits?!? Well, that'd indicate visitors!
+ * A visitor is an interface that allows you to walk through a tree and do stuff.
+ */
+class Visitor {
+    public:
+        virtual void visit(const CommandNode * leaf) = 0;
+        virtual void visit(const Loop * loop) = 0;
+        virtual void visit(const Program * program) = 0;
+};
+
+/**
+ * The Node class (like a Java abstract class) accepts visitors, but since it's pure virtual, we can't use it directly.
+ */
+class Node {
+    public:
+        virtual ~Node() {}
+        virtual void accept (Visitor *v) = 0;
+};
+
+// a custom exception for commands that aren't real commands
+class CommandNotValidException : virtual public std::exception {
+public:
+    const char * what() const throw() { return "Tried to create a command from an invalid character"; }
+};
+
+/**
+ * CommandNode publicly extends Node to accept visitors.
+ * CommandNode represents a leaf node with a primitive Brainfuck command in it.
+ */
+class CommandNode : public Node {
+    public:
+        Command command;
+        int count;
+        int offset; // which cell, relative to the pointer
+        int value; // what a SET sets it to, what a MULTIPLY multiplies by, or how far a SCAN steps
+        int source; // which cell a MULTIPLY reads, relative to the pointer
+        std::string text; // what a PRINT prints
+        CommandNode(char c, int count = 1) : offset(0), value(0), source(0) {
+            switch(c) {
+                case '+': command = INCREMENT; break;
+                case '-': command = DECREMENT; break;
+                case '<': command = SHIFT_LEFT; break;
+                case '>': command = SHIFT_RIGHT; break;
+                case ',': command = INPUT; break;
+                case '.': command = OUTPUT; break;
+                case '0': command = ZERO; break;
+                default: throw new CommandNotValidException();
+            }
+            this->count = count;
+        }
+        explicit CommandNode(const std::string & text) : command(PRINT), count(1), offset(0), value(0), source(0), text(text) {}
+        CommandNode(Command command, int count, int offset = 0, int value = 0, int source = 0)
+            : command(command), count(count), offset(offset), value(value), source(source) {}
+        void accept (Visitor * v) {
+            v->visit(this);
+        }
+};
+
+class Container: public Node {
+    public:
+        std::vector<Node*> children;
+        // containers own their children. Nested loops are emptied out here, instead of each deleting the next,
+        // so a program nested a million deep doesn't run us out of stack on the way out.
+        ~Container() {
+            std::vector<Node *> doomed;
+            doomed.swap(children);
+            while (!doomed.empty()) {
+                Node * node = doomed.back();
+                doomed.pop_back();
+                if (Container * container = dynamic_cast<Container *>(node)) {
+                    doomed.insert(doomed.end(), container->children.begin(), container->children.end());
+                    container->children.clear();
+                }
+                delete node;
+            }
+        }
+        virtual void accept (Visitor * v) = 0;
+};
+
+/**
+ * Loop publicly extends Node to accept visitors.
+ * Loop represents a loop in Brainfuck.
+ */
+class Loop : public Container {
+    public:
+        /**
+         * What the loop does in closed form, when every time around does the same sums on the same cells
+         * (see AffineLoops in optimizer.h), or when it's a well-known algorithm (see Idioms).
+         * The engines use it to skip to the end of the loop.
+         */
+        struct Summary {
+            // sources that aren't cells: the number 1, and the loop's cell (at the start) over divisor and what's left
+            enum { CONSTANT = INT_MIN, QUOTIENT, REMAINDER };
+            // factor times the cell at source, going to the cell at target (all offsets from the loop's cell)
+            struct Term {
+                int target;
+                int factor;
+                int source;
+            };
+            // the cell at offset has to hold value (or not hold it, if equal is false) when the loop starts
+            struct Condition {
+                int offset;
+                int value;
+                bool equal;
+            };
+            Summary() : step(0), shift(0), inverse(0), divisor(0), divisorAt(0), lowest(0), highest(0) {}
+
+            int step; // what each time around adds to the loop's cell (mod 256). 0 means it clears it: the loop's an if
+            int shift; // step is 2^shift times an odd number...
+            int inverse; // ...with this inverse (mod 256)
+            int divisor; // what QUOTIENT and REMAINDER divide by: 1 to 256, or 0 for the cell at divisorAt (where 0 means 256)
+            int divisorAt;
+            // the first time around, if it's different from the rest (it can set cells the others only add to):
+            // each target becomes the sum of its terms, all worked out from the cells before. sorted by target.
+            std::vector<Term> first;
+            // each time around (after the first one, if there is one), every target gets its terms added.
+            // no target is a source, so it doesn't matter what order they go in.
+            std::vector<Term> adds;
+            // the summary is only right when these hold (otherwise the engines go around the slow way)
+            std::vector<Condition> conditions;
+            int lowest, highest; // the furthest cells the loop goes to (or looks at), either way
+
+            // how many times the loop goes around when the pointer's on cell (and it isn't 0),
+            // or -1 if it never stops or the summary doesn't work for these cells
+            int trips(const unsigned char * cell) const {
+                for (auto it = conditions.begin(); it != conditions.end(); ++it) {
+                    if ((cell[it->offset] == it->value) != it->equal) return -1;
+                }
+                if (step == 0) return 1;
+                if (*cell & ((1 << shift) - 1)) return -1;
+                return -(*cell >> shift) * inverse & (255 >> shift);
+            }
+
+            // what source is before the loop starts, with the pointer on cell
+            int value(const unsigned char * cell, int source) const {
+                if (source == CONSTANT) return 1;
+                if (source != QUOTIENT && source != REMAINDER) return cell[source];
+                int by = divisor ? divisor : cell[divisorAt] ? cell[divisorAt] : 256;
+                return source == QUOTIENT ? *cell / by : *cell % by;
+            }
+
+            // is everywhere the loop goes on a tape of size cells, with the loop's cell number at?
+            bool fits(long long at, long long size) const {
+                return at + lowest >= 0 && at + highest < size;
+            }
+
+            // stretch lowest and highest over every cell the summary itself reads or writes
+            void span() {
+                const std::vector<Term> * lists[] = { &first, &adds };
+                for (const std::vector<Term> * terms : lists) {
+                    for (auto it = terms->begin(); it != terms->end(); ++it) {
+                        lowest = std::min(lowest, it->target);
+                        highest = std::max(highest, it->target);
+                        if (it->source > REMAINDER) {
+                            lowest = std::min(lowest, it->source);
+                            highest = std::max(highest, it->source);
+                        }
+                    }
+                }
+                for (auto it = conditions.begin(); it != conditions.end(); ++it) {
+                    lowest = std::min(lowest, it->offset);
+                    highest = std::max(highest, it->offset);
+                }
+                if (!divisor) {
+                    lowest = std::min(lowest, divisorAt);
+                    highest = std::max(highest, divisorAt);
+                }
+            }
+        };
+        Summary * summary; // or nullptr: go around the slow way
+
+        Loop() : summary(nullptr) {}
+        ~Loop() {
+            delete summary;
+        }
+        void accept (Visitor * v) {
+            v->visit(this);
+        }
+};
+
+/**
+ * Program is the root of a Brainfuck program abstract syntax tree.
+ * Because Brainfuck is so primitive, the parse tree is the abstract syntax tree.
+ */
+class Program : public Container {
+    public:
+        void accept (Visitor * v) {
+            v->visit(this);
+        }
+};
+
+
+/**
+ * Read in the program by recursive descent.
+ * The second one reads straight out of a buffer in memory, without copying it.
+ */
+void parse(std::istream & file, Container * container);
+void parse(const char * source, size_t length, Container * container);
+
+/**
+ * A printer for Brainfuck abstract syntax trees.
+ * As a visitor, it will just print out the commands as is.
+ * For Loops and the root Program node, it walks trough all the children.
+ */
+class Printer : public Visitor {
+    public:
+        void visit(const CommandNode * leaf) {
+            // a command on a cell off to the side: go over, do it, and come back
+            bool away = leaf->offset != 0 && leaf->command != MULTIPLY;
+            if (away) std::cout << move(leaf->offset);
+            switch (leaf->command) {
+            case INCREMENT:   for (int i = 0; i < leaf->count; i++){
+                std::cout << '+';
+            } break;
+            case DECREMENT:   for (int i = 0; i < leaf->count; i++){
+                std::cout << '-';
+            } break;
+            case SHIFT_LEFT:  for (int i = 0; i < leaf->count; i++){
+                std::cout << '<';
+            } break;
+            case SHIFT_RIGHT: for (int i = 0; i < leaf->count; i++){
+                std::cout << '>';
+            } break;
+            case INPUT:       for (int i = 0; i < leaf->count; i++){
+                std::cout << ',';
+            } break;
+            case OUTPUT:      for (int i = 0; i < leaf->count; i++){
+                std::cout << '.';
+            } break;
+            case ZERO:        for (int i = 0; i < leaf->count; i++){
+                std::cout << "[+]";
+            } break;
+            case PRINT:       // there's no brainfuck for this, so quote it (with the command characters escaped)
+                std::cout << '"';
+                for (size_t i = 0; i < leaf->text.size(); i++) {
+                    unsigned char c = leaf->text[i];
+                    if (c >= ' ' && c <= '~' && !strchr("+-<>,.[]\"\\", c)) std::cout << c;
+                    else std::cout << "\\x" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 15];
+                }
+                std::cout << '"';
+                break;
+            case SET:         // clear each cell and count up (or down) to value
+                for (int i = 0; i < leaf->count; i++) {
+                    if (i) std::cout << '>';
+                    std::cout << "[-]" << (leaf->value < 128 ? std::string(leaf->value, '+') : std::string(256 - leaf->value, '-'));
+                }
+                std::cout << move(1 - leaf->count);
+                break;
+            case MULTIPLY:    // no brainfuck for this either (not without a loop that clears the source)
+                std::cout << '{' << cell(leaf->offset) << " add " << cell(leaf->source) << " times " << leaf->value << '}';
+                break;
+            case SCAN:
+                std::cout << '[' << move(leaf->value) << ']';
+                break;
+            }
+            if (away) std::cout << move(-leaf->offset);
+        }
+        void visit(const Loop * loop) {
+            std::cout << '[';
+            for (std::vector<Node*>::const_iterator it = loop->children.begin(); it != loop->children.end(); ++it) {
+                (*it)->accept(this);
+            }
+            std::cout << ']';
+        }
+        void visit(const Program * program) {
+            for (std::vector<Node*>::const_iterator it = program->children.begin(); it != program->children.end(); ++it) {
+                (*it)->accept(this);
+            }
+            std::cout << '\n';
+        }
+    private:
+        // > or < enough times to move by cells
+        static std::string move(int cells) {
+            return cells >= 0 ? std::string(cells, '>') : std::string(-cells, '<');
+        }
+        // a cell relative to the pointer, without any command characters: @2, @~1
+        static std::string cell(int offset) {
+            return offset >= 0 ? "@" + std::to_string(offset) : "@~" + std::to_string(-offset);
+        }
+};
+
+/**
+ * Where the Evaluator's , gets bytes from and . puts them.
+ * read returns a byte, EOF when the input is over, or BLOCKED if the next byte isn't here yet.
+ */
+class IO {
+public:
+    enum { BLOCKED = -2 };
+    virtual ~IO() {}
+    virtual int read() = 0;
+    virtual void write(unsigned char c) = 0;
+    // a block of output in one go (worth overriding when there's a cheaper way than byte by byte)
+    virtual void write(const char * data, size_t length) {
+        for (size_t i = 0; i < length; i++) write((unsigned char)data[i]);
+    }
+    virtual void flush() {}
+};
+
+// I/O on stdio streams (the console, by default)
+class StdioIO : public IO {
+public:
+    StdioIO(FILE * in = stdin, FILE * out = stdout) : in(in), out(out) {}
+    int read() { return getc(in); }
+    void write(unsigned char c) { putc(c, out); }
+    void write(const char * data, size_t length) { fwrite(data, 1, length, out); }
+    void flush() { fflush(out); }
+private:
+    FILE * in; // where , reads from
+    FILE * out; // where . writes to
+};
+
+// I/O in memory: input is queued up front (or as it arrives), output piles up in a string
+class BufferIO : public IO {
+public:
+    BufferIO(const std::string & input = "", bool closed = true) : input(input), pos(0), closed(closed) {}
+    int read() {
+        if (pos < input.size()) return (unsigned char)input[pos++];
+        return closed ? EOF : BLOCKED;
+    }
+    void write(unsigned char c) { output += (char)c; }
+    void write(const char * data, size_t length) { output.append(data, length); }
+    // more input; closing it means , gets EOF once it runs out instead of blocking
+    void feed(const std::string & more, bool close = false) {
+        input.erase(0, pos);
+        pos = 0;
+        input += more;
+        closed = closed || close;
+    }
+    bool ready() const { return pos < input.size() || closed; }
+    // start over with new input and no output
+    void reset(const std::string & input = "", bool closed = true) {
+        this->input = input;
+        this->pos = 0;
+        this->closed = closed;
+        output.clear();
+    }
+    std::string output; // everything . has written
+private:
+    std::string input; // what , reads
+    size_t pos; // the next byte of input
+    bool closed; // is there more input coming?
+};
+
+/**
+ * The part of a run that doesn't depend on the input, worked out ahead of time (see evaluatePrelude).
+ * It's where the program is when it first wants input: what it printed on the way there,
+ * the tape and pointer, and its place in the tree. Engines can start from here instead of from the top.
+ */
+struct Prelude {
+    Prelude() : finished(false), steps(0), pointer(0), first(0) {}
+    bool finished; // the program ran to the end without reading anything
+    unsigned long long steps; // what getting here cost
+    std::string output; // everything printed on the way (including the final newline, if finished)
+    size_t pointer; // the pointer, as a cell number
+    size_t first; // the leftmost cell the pointer got to
+    std::string cells; // the cells from first up to the rightmost one the pointer got to
+    std::vector<size_t> position; // the next child to run in the program and each loop we're in, outermost first
+    std::string snapshot; // all of it, for Evaluator::start
+};
+
+/**
+ * Run program on a clean tape until it first wants input, so nothing it did depends on the input yet.
+ * Stops early after about budget steps (0 means no limit): that's still a fine place to start from,
+ * just not as far along. Programs that never read anything come back finished.
+ * A program that goes off the tape first comes back at the very start, as if it had no prelude.
+ */
+Prelude evaluatePrelude(const Program * program, unsigned long long budget, int memory = 30000);
+
+// the evaluator. based on http://en.wikipedia.org/wiki/Brainfuck#Commands
+class Evaluator : public Visitor {
+public:
+    // what run() stopped for. OUT_OF_BOUNDS means the program went off either end of the tape, and is over
+    enum Status { PAUSED, BLOCKED, FINISHED, OUT_OF_BOUNDS };
+
+    // create an evaluator with maxMemory cells of tape (going off the end stops the run with OUT_OF_BOUNDS)
+    // input and output default to the console, but any stdio stream works
+    Evaluator(int maxMemory, FILE * in = stdin, FILE * out = stdout)
+        : max(maxMemory), arr(new unsigned char[maxMemory]), io(new StdioIO(in, out)), ownsIO(true),
+          steps(0), inputs(0), outputs(0), inputsDone(0), blocked(false), faulted(false), done(false)
+    {
+        memset(arr, 0, maxMemory);
+        ptr = low = high = arr;
+    }
+    // or do the I/O through io, which has to outlive the evaluator
+    Evaluator(int maxMemory, IO * io)
+        : max(maxMemory), arr(new unsigned char[maxMemory]), io(io), ownsIO(false),
+          steps(0), inputs(0), outputs(0), inputsDone(0), blocked(false), faulted(false), done(false)
+    {
+        memset(arr, 0, maxMemory);
+        ptr = low = high = arr;
+    }
+    ~Evaluator() {
+        delete[] arr;
+        if (ownsIO) delete io;
+    }
+
+    // how many brainfuck commands (and loop tests) we've executed so far
+    unsigned long long getSteps() const {
+        return steps;
+    }
+
+    // how many bytes , has read and . has written so far
+    unsigned long long getInputPosition() const {
+        return inputs;
+    }
+    unsigned long long getOutputPosition() const {
+        return outputs;
+    }
+
+    // where the pointer is, as a cell number
+    size_t getPointer() const {
+        return ptr - arr;
+    }
+
+    // the cells the pointer has been to, and the number of the first one
+    std::string getTouched(size_t & first) const {
+        first = low - arr;
+        return std::string((const char *)low, high - low + 1);
+    }
+
+    // our place in the tree: the next child to run in the program and each loop we're in, outermost first
+    std::vector<size_t> getPosition() const {
+        std::vector<size_t> position;
+        for (auto it = frames.begin(); it != frames.end(); ++it) {
+            position.push_back(it->next);
+        }
+        return position;
+    }
+
+    // handle all the ops of the commandnode
+    void visit(const CommandNode * leaf) {
+        steps += leaf->count;
+        // the cell the command works on: the pointer's, unless an optimizer pass moved the command off to the side.
+        // cells off to the side of where the pointer's been count as touched too.
+        unsigned char * cell = ptr;
+        if (leaf->command == MULTIPLY) {
+            if (!onTape(leaf->source)) {
+                faulted = true;
+                return;
+            }
+            // times 0 is the loop it came from not running, and a loop that doesn't run can't go off the tape
+            if (!ptr[leaf->source]) return;
+        }
+        if (leaf->offset) {
+            if (!onTape(leaf->offset)) {
+                faulted = true;
+                return;
+            }
+            cell += leaf->offset;
+            if (cell < low) low = cell;
+            if (cell > high) high = cell;
+        }
+        switch (leaf->command) {
+        case INCREMENT:
+            *cell += (unsigned char)leaf->count;
+            break;
+        case DECREMENT:
+            *cell -= (unsigned char)leaf->count;
+            break;
+        case SHIFT_RIGHT:
+            if (!onTape(leaf->count)) {
+                faulted = true;
+                return;
+            }
+            ptr += leaf->count;
+            if (ptr > high) high = ptr;
+            break;
+        case SHIFT_LEFT:
+            if (!onTape(-(long long)leaf->count)) {
+                faulted = true;
+                return;
+            }
+            ptr -= leaf->count;
+            if (ptr < low) low = ptr;
+            break;
+        case INPUT:         for (; inputsDone < leaf->count; inputsDone++){
+            int c = io->read();
+            if (c == IO::BLOCKED) {
+                // come back to this command when there's input; run() backs up to it
+                steps -= leaf->count;
+                blocked = true;
+                return;
+            }
+            *cell = c;
+            inputs++;
+        }
+        inputsDone = 0;
+        break;
+        case OUTPUT:        for (int i = 0; i < leaf->count; i++){
+            io->write(*cell);
+        }
+        outputs += leaf->count;
+        break;
+        case ZERO:
+            *cell = 0;
+            break;
+        case PRINT:
+            io->write(leaf->text.data(), leaf->text.size());
+            outputs += leaf->text.size();
+            break;
+        case SET:
+            if (!onTape(leaf->offset + (long long)leaf->count - 1)) {
+                faulted = true;
+                return;
+            }
+            memset(cell, leaf->value, leaf->count);
+            if (cell < low) low = cell;
+            if (cell + leaf->count - 1 > high) high = cell + leaf->count - 1;
+            break;
+        case MULTIPLY:
+            *cell += ptr[leaf->source] * leaf->value;
+            break;
+        case SCAN:
+            // memchr finds the next 0 to the right a lot quicker than we can
+            if (leaf->value == 1) {
+                cell = (unsigned char *)memchr(ptr, 0, arr + max - ptr);
+            } else {
+                long long at = ptr - arr;
+                while (at >= 0 && at < max && arr[at]) at += leaf->value;
+                cell = at >= 0 && at < max ? arr + at : nullptr;
+            }
+            if (!cell) {
+                faulted = true;
+                return;
+            }
+            ptr = cell;
+            if (ptr < low) low = ptr;
+            if (ptr > high) high = ptr;
+            break;
+        }
+    }
+
+    // handle a loop: if we get in, the run loop picks up its children next
+    void visit(const Loop * loop) {
+        if (steps++, *ptr) {
+            // a summary that reaches off the tape goes around the slow way, which stops where it goes off
+            int trips = loop->summary && loop->summary->fits(ptr - arr, max) ? loop->summary->trips(ptr) : -1;
+            if (trips < 0) {
+                frames.push_back(Frame(loop));
+                return;
+            }
+            // skip to the end: after the first time around, trips times around adds trips times as much
+            const Loop::Summary * summary = loop->summary;
+            const std::vector<Loop::Summary::Term> & first = summary->first;
+            if (!first.empty()) {
+                firsts.clear();
+                for (auto it = first.begin(); it != first.end(); ++it) {
+                    if (it == first.begin() || it->target != (it - 1)->target) firsts.push_back(0);
+                    firsts.back() += it->factor * summary->value(ptr, it->source);
+                }
+                auto sum = firsts.begin();
+                for (auto it = first.begin(); it != first.end(); ++it) {
+                    if (it == first.begin() || it->target != (it - 1)->target) touch(ptr + it->target) = *sum++;
+                }
+                trips--;
+            }
+            const std::vector<Loop::Summary::Term> & adds = summary->adds;
+            for (auto it = adds.begin(); it != adds.end(); ++it) {
+                touch(ptr + it->target) += trips * it->factor * summary->value(ptr, it->source);
+            }
+            *ptr = 0;
+            steps += first.size() + adds.size();
+        }
+    }
+
+    // handle a program
+    void visit(const Program * program) {
+        run(program);
+    }
+
+    /**
+     * Run the program for about budget more steps (0 means no limit).
+     * The budget is only checked at loop back-edges, so we can overshoot it by one pass through a loop body.
+     * Returns PAUSED when the budget ran out, BLOCKED when , is waiting on input, and FINISHED at the end.
+     * A paused or blocked evaluator keeps its place in the tree, its tape and its pointer: call run again to resume.
+     * A run that goes off the tape stops on the command that did it, and stays OUT_OF_BOUNDS.
+     */
+    Status run(const Program * program, unsigned long long budget = 0) {
+        if (done) return FINISHED;
+        if (faulted) return OUT_OF_BOUNDS;
+        if (frames.empty()) {
+            frames.push_back(Frame(program));
+        }
+        unsigned long long limit = budget ? steps + budget : ~0ULL;
+        while (!frames.empty()) {
+            Frame & frame = frames.back();
+            if (frame.next < frame.container->children.size()) {
+                frame.container->children[frame.next++]->accept(this);
+                if (faulted) {
+                    io->flush();
+                    return OUT_OF_BOUNDS;
+                }
+                if (blocked) {
+                    blocked = false;
+                    frames.back().next--;
+                    io->flush();
+                    return BLOCKED;
+                }
+            } else if (frames.size() == 1) {
+                frames.pop_back(); // the end of the program
+            } else if (steps++, *ptr) {
+                frame.next = 0; // back around the loop
+                if (steps >= limit) {
+                    io->flush();
+                    return PAUSED;
+                }
+            } else {
+                frames.pop_back(); // out of the loop
+            }
+        }
+        io->write('\n');
+        io->flush();
+        done = true;
+        return FINISHED;
+    }
+
+    // did the program run to the end?
+    bool finished() const {
+        return done;
+    }
+
+    /**
+     * Get ready to run a program from the start again, on a clean tape.
+     * Only the cells the pointer ever got to can be dirty, so that's all we clear.
+     */
+    void reset() {
+        memset(low, 0, high - low + 1);
+        ptr = low = high = arr;
+        frames.clear();
+        steps = inputs = outputs = 0;
+        inputsDone = 0;
+        blocked = false;
+        faulted = false;
+        done = false;
+    }
+
+    /**
+     * Save everything about where a run is: its place in program, the pointer, the tape (just the cells
+     * the pointer got to), and how far it got through its input and output. The snapshot is compact binary
+     * and doesn't depend on this process, so restore can pick it up somewhere else.
+     * Take it between calls to run() (when the run is paused, blocked or hasn't started).
+     */
+    void save(std::ostream & snapshot, const Program * program) const;
+
+    /**
+     * Load a snapshot taken with save into this evaluator, for the same program.
+     * The I/O isn't part of the evaluator: resume with the input from getInputPosition() on.
+     * Returns false (and leaves us alone) if the snapshot is broken, is for another program, or needs more memory.
+     */
+    bool restore(std::istream & snapshot, const Program * program);
+
+    /**
+     * Skip the part of program that doesn't depend on input: pick up where prelude left off
+     * and write out everything it printed in one go. Returns false if prelude is for another program.
+     */
+    bool start(const Prelude & prelude, const Program * program);
+
+private:
+    unsigned char* ptr; // the instruction pointer
+    int max; // the size of memory we have to work in (for memory safety checks)
+    unsigned char* arr; // the actual memory we have to work in
+    unsigned char* low; // the leftmost cell the pointer has been to (everything outside low..high is still 0)
+    unsigned char* high; // the rightmost cell the pointer has been to
+    IO * io; // where , and . go
+    bool ownsIO; // did we make io ourselves?
+    unsigned long long steps; // commands executed so far
+    unsigned long long inputs; // bytes read so far
+    unsigned long long outputs; // bytes written so far
+    int inputsDone; // how much of a blocked , command already got its input
+    bool blocked; // did the last command block on input?
+    bool faulted; // did a command go off the tape?
+    std::vector<unsigned char> firsts; // what a summarized loop's first time around is putting in its cells
+
+    // is the cell offset from the pointer on the tape?
+    bool onTape(long long offset) const {
+        long long at = ptr - arr + offset;
+        return at >= 0 && at < max;
+    }
+
+    // a cell we're about to change, which might be off to the side of where the pointer's been
+    unsigned char & touch(unsigned char * cell) {
+        if (cell < low) low = cell;
+        if (cell > high) high = cell;
+        return *cell;
+    }
+
+    // where we are in a container: the program, or a loop we're inside of
+    struct Frame {
+        const Container * container;
+        size_t next; // the child to run next
+        Frame(const Container * container) : container(container), next(0) {}
+    };
+    std::vector<Frame> frames; // the loops we're in, innermost last
+    bool done; // did we run off the end of the program?
+};
+
+// the compiler outputs c code
+class Compiler : public Visitor {
+public:
+    // write the c code to the console, or to any other stream
+    // with a step budget, the program gives up (exit status 3) once it has run that many steps
+    // with a prelude, the program starts where the prelude left off, on a tape filled in ahead of time
+    Compiler(std::ostream & out = std::cout, unsigned long long budget = 0, const Prelude * prelude = nullptr)
+        : out(out), budget(budget), prelude(prelude), depth(0), onPath(prelude != nullptr) {}
+
+    // handle all the ops of the commandnode
+    void visit(const CommandNode * leaf) {
+        std::string cell = at(leaf->offset);
+        switch (leaf->command) {
+        case INCREMENT:
+            out << cell << " += " << leaf->count << ";" << std::endl;
+            break;
+        case DECREMENT:
+            out << cell << " -= " << leaf->count << ";" << std::endl;
+            break;
+        case SHIFT_RIGHT:
+            out << "ptr += " << leaf->count << ";" << std::endl;
+            break;
+        case SHIFT_LEFT:
+            out << "ptr -= " << leaf->count << ";" << std::endl;
+            break;
+        case INPUT:         for (int i = 0; i < leaf->count; i++){
+            out << cell << " = getchar();" << std::endl;
+        } break;
+        case OUTPUT:        for (int i = 0; i < leaf->count; i++){
+            out << "putchar(" << cell << ");" << std::endl;
+        } break;
+        case ZERO:
+            out << cell << " = 0;" << std::endl;
+            break;
+        case PRINT:
+            out << "fwrite(" << literal(leaf->text) << ", 1, " << leaf->text.size() << ", stdout);" << std::endl;
+            break;
+        case SET:
+            if (leaf->count == 1) out << cell << " = " << leaf->value << ";" << std::endl;
+            else out << "memset(ptr + " << leaf->offset << ", " << leaf->value << ", " << leaf->count << ");" << std::endl;
+            break;
+        case MULTIPLY:
+            out << cell << " += " << at(leaf->source) << " * " << leaf->value << ";" << std::endl;
+            break;
+        case SCAN:
+            out << "while (*ptr) ptr += " << leaf->value << ";" << std::endl;
+            break;
+        }
+    }
+
+    // handle a loop
+    void visit(const Loop * loop) {
+        const Loop::Summary * summary = loop->summary;
+        if (!summary) {
+            around(loop);
+            return;
+        }
+        // skip to the end if the loop gets there and the summary works for the cells (and go around if not)
+        std::string slow;
+        for (auto it = summary->conditions.begin(); it != summary->conditions.end(); ++it) {
+            slow += (slow.empty() ? "" : " || ") + at(it->offset) + (it->equal ? " != " : " == ") + std::to_string(it->value);
+        }
+        if (summary->shift) {
+            slow += (slow.empty() ? "" : " || ") + std::string("*ptr & ") + std::to_string((1 << summary->shift) - 1);
+        }
+        if (!slow.empty()) {
+            out << "if (*ptr && (" << slow << ")) {" << std::endl;
+            around(loop);
+            out << "} else ";
+        }
+        out << "if (*ptr) {" << std::endl;
+        if (summary->step == 0) out << "unsigned char n = 1;" << std::endl;
+        else out << "unsigned char n = -(*ptr >> " << summary->shift << ") * " << summary->inverse
+                 << " & " << (255 >> summary->shift) << ";" << std::endl;
+        const std::vector<Loop::Summary::Term> & first = summary->first;
+        if (!first.empty()) {
+            // the first time around: work out the new cells from the old ones, then store them
+            int sums = 0;
+            for (auto it = first.begin(); it != first.end(); sums++) {
+                int target = it->target;
+                out << "unsigned char first" << sums << " = " << term(*summary, *it++);
+                for (; it != first.end() && it->target == target; ++it) out << " + " << term(*summary, *it);
+                out << ";" << std::endl;
+            }
+            sums = 0;
+            for (auto it = first.begin(); it != first.end(); ++it) {
+                if (it == first.begin() || it->target != (it - 1)->target) out << at(it->target) << " = first" << sums++ << ";" << std::endl;
+            }
+            out << "n--;" << std::endl;
+        }
+        for (auto it = summary->adds.begin(); it != summary->adds.end(); ++it) {
+            out << at(it->target) << " += n * " << term(*summary, *it) << ";" << std::endl;
+        }
+        out << "*ptr = 0;" << std::endl;
+        out << "}" << std::endl;
+    }
+
+    // handle a program
+    void visit(const Program * program) {
+        out << "#include <stdio.h>" << std::endl;
+        out << "#include <string.h>" << std::endl;
+        out << "unsigned char tape[30000];" << std::endl;
+        out << "int main(int argc, char** argv) {" << std::endl;
+        out << "unsigned char *ptr = tape;" << std::endl;
+        if (budget) {
+            out << "unsigned long long steps = " << (prelude ? prelude->steps : 0) << "ULL, budget = " << budget << "ULL;" << std::endl;
+        }
+        if (prelude) {
+            // everything up to the first , already happened: print it, set up the tape, and jump in
+            if (!prelude->output.empty()) {
+                out << "fwrite(" << literal(prelude->output) << ", 1, " << prelude->output.size() << ", stdout);" << std::endl;
+            }
+            if (prelude->finished) {
+                out << "return 0;" << std::endl;
+                out << '}' << std::endl;
+                return;
+            }
+            out << "memcpy(tape + " << prelude->first << ", " << literal(prelude->cells) << ", " << prelude->cells.size() << ");" << std::endl;
+            out << "ptr = tape + " << prelude->pointer << ";" << std::endl;
+            out << "goto resume;" << std::endl;
+        }
+        children(program);
+        out << "putchar('\\n');" << std::endl;
+        out << "return 0;" << std::endl;
+        out << '}' << std::endl;
+    }
+
+private:
+    // a loop the slow way, around and around
+    void around(const Loop * loop) {
+        out << "while (*ptr) {" << std::endl;
+        children(loop);
+        // a pass through the body costs its own commands, the entry tests of its inner loops and this loop's test.
+        // inner loops charge for their own iterations, so this adds up to what the Evaluator counts.
+        unsigned long long cost = 1;
+        for (auto it = loop->children.begin(); it != loop->children.end(); ++it) {
+            const CommandNode * leaf = dynamic_cast<const CommandNode *>(*it);
+            cost += leaf ? leaf->count : 1;
+        }
+        if (budget) {
+            out << "if ((steps += " << cost << "ULL) >= budget) { fflush(stdout); return 3; }" << std::endl;
+        }
+        out << "}" << std::endl;
+    }
+
+    // the children of container, with the resume label where the prelude left off
+    void children(const Container * container) {
+        bool here = onPath && depth < prelude->position.size();
+        bool last = here && depth + 1 == prelude->position.size();
+        size_t resume = here ? prelude->position[depth] : 0;
+        for (size_t i = 0; i < container->children.size(); i++) {
+            if (last && i == resume) out << "resume:;" << std::endl;
+            // the loop we were in is the one just before the next child
+            onPath = here && !last && i + 1 == resume;
+            depth++;
+            container->children[i]->accept(this);
+            depth--;
+        }
+        if (last && resume == container->children.size()) out << "resume:;" << std::endl;
+        onPath = here;
+    }
+
+    // the cell offset from the pointer, in c
+    static std::string at(int offset) {
+        return offset ? "ptr[" + std::to_string(offset) + "]" : "*ptr";
+    }
+
+    // a summarized loop's term, in c
+    static std::string term(const Loop::Summary & summary, const Loop::Summary::Term & term) {
+        std::string factor = std::to_string(term.factor);
+        if (term.source == Loop::Summary::CONSTANT) return factor;
+        if (term.source != Loop::Summary::QUOTIENT && term.source != Loop::Summary::REMAINDER) return factor + " * " + at(term.source);
+        std::string by = summary.divisor ? std::to_string(summary.divisor) : "(" + at(summary.divisorAt) + " ? " + at(summary.divisorAt) + " : 256)";
+        return factor + " * (*ptr " + (term.source == Loop::Summary::QUOTIENT ? "/ " : "% ") + by + ")";
+    }
+
+    // bytes as a c string literal, a line at a time
+    static std::string literal(const std::string & bytes) {
+        static const char digits[] = "01234567";
+        std::string text = "\"";
+        for (size_t i = 0; i < bytes.size(); i++) {
+            if (i && i % 64 == 0) text += "\"\n\"";
+            unsigned char c = bytes[i];
+            if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?') {
+                text += (char)c;
+            } else {
+                text += '\\';
+                text += digits[c >> 6];
+                text += digits[(c >> 3) & 7];
+                text += digits[c & 7];
+            }
+        }
+        return text + "\"";
+    }
+
+    std::ostream & out; // where the c code goes
+    unsigned long long budget; // how many steps the program gets (0 means no limit)
+    const Prelude * prelude; // where to start (or nullptr for the top)
+    size_t depth; // how many containers deep we are
+    bool onPath; // are we in the loop the prelude stopped in (or on the way to it)?
+};
+
+
+/**
+ * The Scheduler runs lots of programs at once on a few worker threads, like green threads.
+ * Each run gets its own Evaluator (so its own tape) and its own in-memory input and output.
+ * Workers take a run off the ready queue, let it go for a slice of steps, and put it back at the end.
+ * A run that wants input it hasn't been given yet is parked (not holding a thread) until feed() brings some.
+ */
+class Scheduler {
+public:
+    Scheduler(int workers = 4, unsigned long long slice = 100000, int memory = 30000);
+    ~Scheduler();
+
+    // start running program (which has to outlive the run) on input, and say which run it is
+    // if the input isn't closed, the run parks when it wants more, until feed() gives it some
+    int spawn(const Program * program, const std::string & input = "", bool closeInput = true);
+
+    // give a run more input (and maybe close it), waking it up if it was parked
+    void feed(int id, const std::string & input, bool close = false);
+
+    // wait for a run to finish, then forget about it and hand back what it printed
+    // (and, in status, whether it got to the end or went off the tape)
+    std::string wait(int id, Evaluator::Status * status = nullptr);
+
+    // how many runs are parked waiting for input
+    int parked();
+
+private:
+    // one program execution: a green thread
+    struct Run {
+        enum State { READY, RUNNING, PARKED, DONE };
+        Run(const Program * program, const std::string & input, bool closed, int memory)
+            : program(program), io(input, closed), eval(memory, &io), state(READY), status(Evaluator::PAUSED),
+              pendingClose(false) {}
+        const Program * program;
+        BufferIO io; // this run's input and output
+        Evaluator eval; // this run's tape, pointer and place in the program
+        State state;
+        Evaluator::Status status; // how it stopped, once it's DONE
+        std::string pending; // input that came in while a worker was running us
+        bool pendingClose;
+    };
+
+    // a worker thread: run slices until the scheduler shuts down
+    void work();
+
+    unsigned long long slice; // steps per turn
+    int memory; // tape size per run
+    int nextId;
+    bool stopping;
+    std::map<int, Run *> runs; // every run we know about, by id
+    std::deque<Run *> ready; // runs waiting for a worker, in turn order
+    std::vector<std::thread> threads;
+    std::mutex m; // guards everything above (but not the insides of a RUNNING run)
+    std::condition_variable wake; // there's a ready run (or we're stopping)
+    std::condition_variable finished; // some run finished
+};
+
+/**
+ * What running a program through the library gives back.
+ */
+struct RunResult {
+    Evaluator::Status status; // FINISHED, PAUSED (out of budget), BLOCKED (the read callback said IO::BLOCKED) or OUT_OF_BOUNDS
+    unsigned long long steps; // how many steps it took
+    std::string output; // what the program printed (the buffer version only)
+};
+
+// read returns a byte, EOF or IO::BLOCKED. write gets output in chunks.
+typedef std::function<int()> ReadCallback;
+typedef std::function<void(const char * data, size_t length)> WriteCallback;
+
+// I/O through callbacks; output is buffered and handed over on flush
+class CallbackIO : public IO {
+public:
+    CallbackIO(ReadCallback reader, WriteCallback writer) : reader(reader), writer(writer) {}
+    ~CallbackIO() { flush(); }
+    int read() { return reader(); }
+    void write(unsigned char c) {
+        buffer += (char)c;
+        if (buffer.size() >= 4096) flush();
+    }
+    void write(const char * data, size_t length) {
+        buffer.append(data, length);
+        if (buffer.size() >= 4096) flush();
+    }
+    void flush() {
+        if (!buffer.empty()) writer(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+private:
+    ReadCallback reader;
+    WriteCallback writer;
+    std::string buffer; // output we haven't handed over yet
+};
+
+/**
+ * Parse and run a program in one go, with a fresh tape of memory cells.
+ * With a budget the run stops (PAUSED) after about that many steps; 0 means no limit.
+ */
+RunResult execute(const char * source, size_t length, const std::string & input,
+    unsigned long long budget = 0, int memory = 30000);
+RunResult execute(const char * source, size_t length, ReadCallback read, WriteCallback write,
+    unsigned long long budget = 0, int memory = 30000);
+
+// the SHA-256 of a source, in hex. Nobody can make up a source that collides with somebody else's.
+std::string digestSource(const char * data, size_t length);
+
+/**
+ * A least-recently-used cache of parsed programs, keyed by the digest of their source.
+ * Programs come out as shared_ptrs, so one can be evicted while somebody's still running it.
+ * It's safe to share between threads.
+ */
+class ProgramCache {
+public:
+    ProgramCache(size_t capacity = 256) : capacity(std::max(capacity, (size_t)1)) {}
+
+    // parse source (unless we have it already) and return its digest
+    std::string add(const char * source, size_t length);
+
+    // the program with this digest, or null if we don't have it (any more)
+    std::shared_ptr<const Program> find(const std::string & digest);
+
+    size_t size();
+
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<const Program> > > Entries;
+    Entries entries; // most recently used first
+    std::unordered_map<std::string, Entries::iterator> index; // where each digest is in entries
+    size_t capacity;
+    std::mutex m;
+};
+
+// a hash of the shape of a tree, so a snapshot can tell if it's being restored into the same program
+unsigned long long fingerprint(const Container * container);
+
+/**
+ * Remembers runs of programs by input prefix, so runs that share a long start of their input can skip it.
+ * It's a trie per program (keyed by fingerprint): each node is the point where the program had read
+ * the bytes on the path to it and wanted another one. A node keeps what the program printed since its parent
+ * and, every stride bytes, an Evaluator snapshot. A new run restores the deepest snapshot along its input,
+ * and adds nodes for the input past that. Once the nodes, their output and their snapshots come to maxBytes,
+ * it stops adding more. It's safe to share between threads.
+ */
+class PrefixCache {
+public:
+    PrefixCache(size_t maxBytes = 256 << 20, int stride = 16, int memory = 30000)
+        : maxBytes(maxBytes), stride(std::max(stride, 1)), memory(memory), nodes(0), bytes(0), skipped(0) {}
+    ~PrefixCache();
+
+    // run program on all of input (then EOF), starting from the longest prefix we know about.
+    // It comes out the same as running it from scratch, budget and all.
+    RunResult run(const Program * program, const std::string & input, unsigned long long budget = 0);
+
+    // how many nodes we have, how much memory they take, and how many bytes of input runs have skipped so far
+    size_t size();
+    size_t getBytes();
+    unsigned long long getSkipped();
+
+private:
+    struct Node {
+        Node() : steps(0), known(false) {}
+        ~Node();
+        std::map<unsigned char, Node *> children; // the next input byte
+        std::string output; // what the program printed between the parent and here
+        std::string snapshot; // the Evaluator here (if we kept one)
+        unsigned long long steps; // how many steps the run had taken by here
+        bool known; // have we actually been here (the root exists before we have)
+    };
+
+    size_t maxBytes;
+    int stride; // keep a snapshot every this many bytes of input
+    int memory; // tape size
+    size_t nodes;
+    size_t bytes; // the nodes and everything they keep
+    unsigned long long skipped;
+    std::map<unsigned long long, Node *> roots; // by program fingerprint
+    std::mutex m;
+
+    // room for size more bytes? If so, they're ours
+    bool reserve(size_t size);
+};
+
+} // namespace brainfuck
+
+#endif
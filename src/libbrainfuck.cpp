@@ -0,0 +1,620 @@
+/*
+= libbrainfuck
+
+The parts of the library that don't need to live in brainfuck.h.
+*/
+
+#include "brainfuck.h"
+#include <streambuf>
+#include <sstream>
+
+using namespace std;
+
+namespace brainfuck {
+
+// a loop we've read to the end goes into the container around it
+static void addLoop(Loop * loop, Container * container) {
+    // [-] and [+] just clear the cell (so does any odd count: it gets to 0 from anywhere)
+    if (loop->children.size() == 1)
+    {
+        CommandNode * leaf = dynamic_cast<CommandNode *>(loop->children[0]);
+        if (leaf && (leaf->command == INCREMENT || leaf->command == DECREMENT) && leaf->count % 2 == 1)
+        {
+            delete loop;
+            container->children.push_back(new CommandNode('0', 1));
+            return;
+        }
+    }
+    container->children.push_back(loop);
+}
+
+/**
+ * Read in the file. The loops we're inside of go on a stack of our own, not the call stack,
+ * so a program can nest as deep as it likes.
+ * Modify as necessary and add whatever functions you need to get things done.
+ */
+void parse(istream & file, Container * container) {
+    char c = '\0';
+    int multiples = 0;
+    vector<Container *> outer; // the containers around the loop we're in, innermost last
+
+    while (file >> c)
+    {
+        switch (c)
+        {
+        case '+':
+        case '-':
+        case '<':
+        case '>':
+        case ',':
+        case '.':
+            multiples = 1;
+            while (file.peek() == c){
+                multiples++;
+                file >> c;
+            }
+            container->children.push_back(new CommandNode(c, multiples));
+            break;
+        case '[':
+            outer.push_back(container);
+            container = new Loop();
+            break;
+        case ']':
+            if (outer.empty()) return;
+            addLoop((Loop *)container, outer.back());
+            container = outer.back();
+            outer.pop_back();
+            break;
+        }
+    }
+    // loops still open at the end of the file end there
+    while (!outer.empty()) {
+        addLoop((Loop *)container, outer.back());
+        container = outer.back();
+        outer.pop_back();
+    }
+}
+
+// a read-only streambuf over somebody else's buffer, so parse can read memory without a copy
+class MemoryBuffer : public streambuf {
+public:
+    MemoryBuffer(const char * data, size_t length) {
+        char * begin = const_cast<char *>(data);
+        setg(begin, begin, begin + length);
+    }
+};
+
+void parse(const char * source, size_t length, Container * container) {
+    MemoryBuffer buffer(source, length);
+    istream in(&buffer);
+    parse(in, container);
+}
+
+Scheduler::Scheduler(int workers, unsigned long long slice, int memory)
+    : slice(slice), memory(memory), nextId(0), stopping(false)
+{
+    for (int i = 0; i < max(1, workers); i++) {
+        threads.push_back(thread(&Scheduler::work, this));
+    }
+}
+Scheduler::~Scheduler() {
+    {
+        lock_guard<mutex> lock(m);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto it = threads.begin(); it != threads.end(); ++it) {
+        it->join();
+    }
+    for (auto it = runs.begin(); it != runs.end(); ++it) {
+        delete it->second;
+    }
+}
+
+int Scheduler::spawn(const Program * program, const string & input, bool closeInput) {
+    Run * run = new Run(program, input, closeInput, memory);
+    lock_guard<mutex> lock(m);
+    int id = nextId++;
+    runs[id] = run;
+    ready.push_back(run);
+    wake.notify_one();
+    return id;
+}
+
+void Scheduler::feed(int id, const string & input, bool close) {
+    lock_guard<mutex> lock(m);
+    auto it = runs.find(id);
+    if (it == runs.end()) return;
+    Run * run = it->second;
+    if (run->state == Run::RUNNING) {
+        // a worker is using the buffers; it picks this up at the end of the slice
+        run->pending += input;
+        run->pendingClose = run->pendingClose || close;
+        return;
+    }
+    run->io.feed(input, close);
+    if (run->state == Run::PARKED) {
+        run->state = Run::READY;
+        ready.push_back(run);
+        wake.notify_one();
+    }
+}
+
+string Scheduler::wait(int id, Evaluator::Status * status) {
+    unique_lock<mutex> lock(m);
+    auto it = runs.find(id);
+    if (it == runs.end()) return "";
+    Run * run = it->second;
+    finished.wait(lock, [run] { return run->state == Run::DONE; });
+    runs.erase(id);
+    lock.unlock();
+    if (status) *status = run->status;
+    string output = run->io.output;
+    delete run;
+    return output;
+}
+
+int Scheduler::parked() {
+    lock_guard<mutex> lock(m);
+    int count = 0;
+    for (auto it = runs.begin(); it != runs.end(); ++it) {
+        if (it->second->state == Run::PARKED) count++;
+    }
+    return count;
+}
+
+void Scheduler::work() {
+    unique_lock<mutex> lock(m);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || !ready.empty(); });
+        if (stopping) return;
+        Run * run = ready.front();
+        ready.pop_front();
+        run->state = Run::RUNNING;
+
+        lock.unlock();
+        Evaluator::Status status = run->eval.run(run->program, slice);
+        lock.lock();
+
+        if (!run->pending.empty() || run->pendingClose) {
+            run->io.feed(run->pending, run->pendingClose);
+            run->pending.clear();
+            run->pendingClose = false;
+        }
+        if (status == Evaluator::BLOCKED && !run->io.ready()) {
+            run->state = Run::PARKED;
+        } else if (status == Evaluator::PAUSED || status == Evaluator::BLOCKED) {
+            run->state = Run::READY;
+            ready.push_back(run);
+        } else {
+            // finished, or off the tape: either way it won't run again
+            run->status = status;
+            run->state = Run::DONE;
+            finished.notify_all();
+        }
+    }
+}
+
+RunResult execute(const char * source, size_t length, const string & input, unsigned long long budget, int memory) {
+    Program program;
+    parse(source, length, &program);
+    BufferIO io(input);
+    Evaluator eval(memory, &io);
+    RunResult result;
+    result.status = eval.run(&program, budget);
+    result.steps = eval.getSteps();
+    result.output.swap(io.output);
+    return result;
+}
+
+RunResult execute(const char * source, size_t length, ReadCallback read, WriteCallback write,
+    unsigned long long budget, int memory)
+{
+    Program program;
+    parse(source, length, &program);
+    CallbackIO io(read, write);
+    Evaluator eval(memory, &io);
+    RunResult result;
+    result.status = eval.run(&program, budget);
+    result.steps = eval.getSteps();
+    return result;
+}
+
+// SHA-256, as in FIPS 180-4
+string digestSource(const char * data, size_t length) {
+    static const unsigned int k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    unsigned int h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    auto rotate = [](unsigned int x, int n) { return x >> n | x << (32 - n); };
+
+    // the message, then a 1 bit, zeros up to 8 bytes short of a whole block, and the length in bits
+    string tail(data + length / 64 * 64, length % 64);
+    tail += '\x80';
+    tail.append((tail.size() <= 56 ? 56 : 120) - tail.size(), '\0');
+    for (int i = 7; i >= 0; i--) tail += (char)((unsigned long long)length * 8 >> (i * 8));
+
+    size_t blocks = length / 64 + tail.size() / 64;
+    for (size_t block = 0; block < blocks; block++) {
+        const unsigned char * bytes = (const unsigned char *)(block < length / 64 ? data + block * 64 : tail.data() + (block - length / 64) * 64);
+        unsigned int w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (unsigned int)bytes[i * 4] << 24 | bytes[i * 4 + 1] << 16 | bytes[i * 4 + 2] << 8 | bytes[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            unsigned int s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ w[i - 15] >> 3;
+            unsigned int s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ w[i - 2] >> 10;
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            unsigned int t1 = hh + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            unsigned int t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+    char hex[65];
+    for (int i = 0; i < 8; i++) snprintf(hex + i * 8, 9, "%08x", h[i]);
+    return string(hex, 64);
+}
+
+string ProgramCache::add(const char * source, size_t length) {
+    string digest = digestSource(source, length);
+    if (find(digest)) return digest;
+
+    // parse without holding the lock; if somebody beats us to it, theirs wins
+    shared_ptr<Program> program(new Program());
+    parse(source, length, program.get());
+
+    lock_guard<mutex> lock(m);
+    if (index.count(digest)) return digest;
+    entries.push_front(make_pair(digest, shared_ptr<const Program>(program)));
+    index[digest] = entries.begin();
+    if (entries.size() > capacity) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+    return digest;
+}
+
+shared_ptr<const Program> ProgramCache::find(const string & digest) {
+    lock_guard<mutex> lock(m);
+    auto it = index.find(digest);
+    if (it == index.end()) return shared_ptr<const Program>();
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second;
+}
+
+size_t ProgramCache::size() {
+    lock_guard<mutex> lock(m);
+    return entries.size();
+}
+
+// 64-bit FNV-1a
+static unsigned long long hashBytes(const char * data, size_t length) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+unsigned long long fingerprint(const Container * container) {
+    // a loop's part is its own fingerprint, so hash depth first, with our own stack (programs nest as deep as they like)
+    struct Level {
+        const Container * container;
+        size_t next; // the next child to hash
+        unsigned long long hash; // the children so far
+    };
+    vector<Level> levels(1, Level{ container, 0, 14695981039346656037ULL });
+    while (true) {
+        Level & level = levels.back();
+        unsigned long long part;
+        if (level.next == level.container->children.size()) {
+            unsigned long long hash = level.hash;
+            levels.pop_back();
+            if (levels.empty()) return hash;
+            part = hash + 0x100;
+        } else {
+            const Node * child = level.container->children[level.next];
+            if (const CommandNode * leaf = dynamic_cast<const CommandNode *>(child)) {
+                part = ((unsigned long long)leaf->count << 8) | leaf->command;
+                if (leaf->offset || leaf->value || leaf->source) {
+                    int extra[] = { leaf->offset, leaf->value, leaf->source };
+                    part ^= hashBytes((const char *)extra, sizeof(extra));
+                }
+                if (!leaf->text.empty()) part ^= hashBytes(leaf->text.data(), leaf->text.size());
+            } else {
+                levels.push_back(Level{ (const Container *)child, 0, 14695981039346656037ULL });
+                continue;
+            }
+        }
+        Level & parent = levels.back();
+        parent.hash = (parent.hash ^ part) * 1099511628211ULL;
+        parent.next++;
+    }
+}
+
+/**
+ * Snapshots are a magic number, then unsigned LEB128 varints:
+ * version, program fingerprint, steps, input position, output position, half-done , count, done,
+ * tape size, pointer, first touched cell, number of touched cells, the touched cells themselves,
+ * number of frames, and each frame's next child.
+ */
+static const char SNAPSHOT_MAGIC[4] = { 'B', 'F', 'S', 'N' };
+static const unsigned SNAPSHOT_VERSION = 1;
+
+static void writeVarint(ostream & out, unsigned long long value) {
+    do {
+        unsigned char byte = value & 0x7f;
+        value >>= 7;
+        out.put(value ? byte | 0x80 : byte);
+    } while (value);
+}
+
+static bool readVarint(istream & in, unsigned long long & value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == EOF) return false;
+        value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+void Evaluator::save(ostream & snapshot, const Program * program) const {
+    snapshot.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    writeVarint(snapshot, SNAPSHOT_VERSION);
+    writeVarint(snapshot, fingerprint(program));
+    writeVarint(snapshot, steps);
+    writeVarint(snapshot, inputs);
+    writeVarint(snapshot, outputs);
+    writeVarint(snapshot, inputsDone);
+    writeVarint(snapshot, done);
+    writeVarint(snapshot, max);
+    writeVarint(snapshot, ptr - arr);
+    writeVarint(snapshot, low - arr);
+    writeVarint(snapshot, high - low + 1);
+    snapshot.write((const char *)low, high - low + 1);
+    writeVarint(snapshot, frames.size());
+    for (auto it = frames.begin(); it != frames.end(); ++it) {
+        writeVarint(snapshot, it->next);
+    }
+}
+
+bool Evaluator::restore(istream & snapshot, const Program * program) {
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    unsigned long long version, print, newSteps, newInputs, newOutputs, newInputsDone, newDone;
+    unsigned long long size, pointer, first, touched, depth;
+    if (!snapshot.read(magic, sizeof(magic)) || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0) return false;
+    if (!readVarint(snapshot, version) || version != SNAPSHOT_VERSION) return false;
+    if (!readVarint(snapshot, print) || print != fingerprint(program)) return false;
+    if (!readVarint(snapshot, newSteps) || !readVarint(snapshot, newInputs) || !readVarint(snapshot, newOutputs)
+        || !readVarint(snapshot, newInputsDone) || !readVarint(snapshot, newDone)
+        || !readVarint(snapshot, size) || !readVarint(snapshot, pointer)
+        || !readVarint(snapshot, first) || !readVarint(snapshot, touched)) return false;
+    if (size > (unsigned long long)max || touched == 0 || first + touched > size || pointer < first || pointer >= first + touched) return false;
+    string cells(touched, '\0');
+    if (!snapshot.read(&cells[0], touched)) return false;
+
+    // walk down the tree to find each frame's container, checking as we go
+    vector<Frame> newFrames;
+    if (!readVarint(snapshot, depth) || depth > (1 << 20)) return false;
+    for (unsigned long long i = 0; i < depth; i++) {
+        unsigned long long next;
+        if (!readVarint(snapshot, next)) return false;
+        const Container * container = program;
+        if (i > 0) {
+            const Frame & parent = newFrames.back();
+            if (parent.next == 0 || parent.next > parent.container->children.size()) return false;
+            container = dynamic_cast<const Loop *>(parent.container->children[parent.next - 1]);
+            if (!container) return false;
+        }
+        if (next > container->children.size()) return false;
+        newFrames.push_back(Frame(container));
+        newFrames.back().next = next;
+    }
+
+    reset();
+    memcpy(arr + first, cells.data(), touched);
+    ptr = arr + pointer;
+    low = arr + first;
+    high = arr + first + touched - 1;
+    frames.swap(newFrames);
+    steps = newSteps;
+    inputs = newInputs;
+    outputs = newOutputs;
+    inputsDone = (int)newInputsDone;
+    done = newDone != 0;
+    return true;
+}
+
+bool Evaluator::start(const Prelude & prelude, const Program * program) {
+    istringstream snapshot(prelude.snapshot);
+    if (!restore(snapshot, program)) return false;
+    io->write(prelude.output.data(), prelude.output.size());
+    return true;
+}
+
+Prelude evaluatePrelude(const Program * program, unsigned long long budget, int memory) {
+    // no input at all, and none coming yet: the first , blocks
+    BufferIO io("", false);
+    Evaluator eval(memory, &io);
+    Prelude prelude;
+    Evaluator::Status status = eval.run(program, budget);
+    if (status == Evaluator::OUT_OF_BOUNDS) {
+        // it goes off the tape before it wants any input: nothing gets worked out ahead of time
+        eval.reset();
+        io.output.clear();
+    }
+    prelude.finished = status == Evaluator::FINISHED;
+    prelude.steps = eval.getSteps();
+    prelude.output = io.output;
+    prelude.pointer = eval.getPointer();
+    prelude.cells = eval.getTouched(prelude.first);
+    prelude.position = eval.getPosition();
+    ostringstream snapshot;
+    eval.save(snapshot, program);
+    prelude.snapshot = snapshot.str();
+    return prelude;
+}
+
+// a trie is as deep as the longest input, so like Container, empty it out instead of deleting recursively
+PrefixCache::Node::~Node() {
+    vector<Node *> doomed;
+    for (auto it = children.begin(); it != children.end(); ++it) {
+        doomed.push_back(it->second);
+    }
+    children.clear();
+    while (!doomed.empty()) {
+        Node * node = doomed.back();
+        doomed.pop_back();
+        for (auto it = node->children.begin(); it != node->children.end(); ++it) {
+            doomed.push_back(it->second);
+        }
+        node->children.clear();
+        delete node;
+    }
+}
+
+PrefixCache::~PrefixCache() {
+    for (auto it = roots.begin(); it != roots.end(); ++it) {
+        delete it->second;
+    }
+}
+
+size_t PrefixCache::size() {
+    lock_guard<mutex> lock(m);
+    return nodes;
+}
+
+size_t PrefixCache::getBytes() {
+    lock_guard<mutex> lock(m);
+    return bytes;
+}
+
+unsigned long long PrefixCache::getSkipped() {
+    lock_guard<mutex> lock(m);
+    return skipped;
+}
+
+bool PrefixCache::reserve(size_t size) {
+    if (bytes + size > maxBytes) return false;
+    bytes += size;
+    return true;
+}
+
+RunResult PrefixCache::run(const Program * program, const string & input, unsigned long long budget) {
+    BufferIO io("", false);
+    Evaluator eval(memory, &io);
+    RunResult result;
+    size_t consumed = 0; // how much input the program has had
+
+    // find the deepest snapshot along the input (from before the budget ran out), collecting what was printed on the way
+    Node * at = nullptr; // the node for where the run is now (null if we're not keeping track)
+    {
+        lock_guard<mutex> lock(m);
+        Node *& root = roots[fingerprint(program)];
+        if (!root && reserve(sizeof(Node))) {
+            root = new Node();
+            nodes++;
+        }
+        string printed, restored;
+        Node * best = nullptr;
+        size_t depth = 0;
+        for (Node * node = root; node && node->known; depth++) {
+            if (budget && node->steps >= budget) break;
+            printed += node->output;
+            if (!node->snapshot.empty()) {
+                best = node;
+                consumed = depth;
+                restored = printed;
+            }
+            if (depth == input.size()) break;
+            auto next = node->children.find(input[depth]);
+            node = next == node->children.end() ? nullptr : next->second;
+        }
+        istringstream snapshot(best ? best->snapshot : "");
+        if (best && eval.restore(snapshot, program)) {
+            skipped += consumed;
+            result.output = restored;
+            at = best;
+        } else {
+            consumed = 0; // nothing to restore (or it wouldn't): run from the start
+            at = root;
+        }
+    }
+
+    bool fresh = at && !at->known; // is at a node we still have to fill in?
+    size_t mark = 0; // how much of io.output belongs to nodes already
+    while (true) {
+        if (budget && eval.getSteps() >= budget) {
+            result.status = Evaluator::PAUSED;
+            break;
+        }
+        result.status = eval.run(program, budget ? budget - eval.getSteps() : 0);
+        if (result.status != Evaluator::BLOCKED) break;
+
+        // the program has read consumed bytes and wants the next one: that's a node
+        if (at) {
+            lock_guard<mutex> lock(m);
+            if (fresh || !at->known) {
+                if (reserve(io.output.size() - mark)) {
+                    at->output = io.output.substr(mark);
+                    at->steps = eval.getSteps();
+                    at->known = true;
+                } else {
+                    at = nullptr; // full up: just run the rest
+                }
+            }
+            if (at && at->snapshot.empty() && consumed % stride == 0) {
+                ostringstream snapshot;
+                eval.save(snapshot, program);
+                if (reserve(snapshot.str().size())) at->snapshot = snapshot.str();
+            }
+            fresh = false;
+        }
+        mark = io.output.size();
+        if (consumed == input.size()) {
+            io.feed("", true); // past the end of the input: no more nodes
+            at = nullptr;
+            continue;
+        }
+        unsigned char next = input[consumed++];
+        io.feed(string(1, (char)next));
+        if (at) {
+            lock_guard<mutex> lock(m);
+            auto it = at->children.find(next);
+            if (it != at->children.end()) {
+                at = it->second;
+            } else if (reserve(sizeof(Node))) {
+                at = at->children[next] = new Node();
+                nodes++;
+                fresh = true;
+            } else {
+                at = nullptr; // full up: just run the rest
+            }
+        }
+    }
+    result.steps = eval.getSteps();
+    result.output += io.output;
+    return result;
+}
+
+} // namespace brainfuck
@@ -0,0 +1,2303 @@
+/*
+= optimizer
+
+The passes from optimizer.h.
+*/
+
+#include "optimizer.h"
+#include <sstream>
+#include <fstream>
+#include <set>
+#include <chrono>
+
+using namespace std;
+
+namespace brainfuck {
+
+/**
+ * Does running container always leave the pointer where it started?
+ * touched gets every cell it might change, relative to where it started.
+ */
+static bool balanced(const Container * container, set<int> & touched) {
+    int at = 0;
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        const CommandNode * leaf = dynamic_cast<const CommandNode *>(*it);
+        if (!leaf) {
+            set<int> inner;
+            if (!balanced((const Container *)*it, inner)) return false;
+            for (auto cell = inner.begin(); cell != inner.end(); ++cell) {
+                touched.insert(at + *cell);
+            }
+            continue;
+        }
+        switch (leaf->command) {
+        case SHIFT_LEFT:    at -= leaf->count; break;
+        case SHIFT_RIGHT:   at += leaf->count; break;
+        case INCREMENT:
+        case DECREMENT:
+        case INPUT:
+        case ZERO:
+        case MULTIPLY:      touched.insert(at + leaf->offset); break;
+        case SET:           for (int i = 0; i < leaf->count; i++) touched.insert(at + leaf->offset + i); break;
+        case SCAN:          return false;
+        case OUTPUT:
+        case PRINT:         break;
+        }
+    }
+    return at == 0;
+}
+
+/**
+ * What we know about the cells around the pointer in a stretch of straight-line code.
+ * Offsets are relative to where the pointer was when we started.
+ */
+class KnownCells {
+public:
+    enum { UNKNOWN = -1 };
+
+    // zeroed means every cell we haven't heard otherwise about is 0, like at the start of the program
+    KnownCells(bool zeroed = false) : at(0), low(0), high(0), zeroed(zeroed) {}
+
+    // the value of the cell at offset, or UNKNOWN
+    int get(int offset) const {
+        auto it = cells.find(offset);
+        if (it != cells.end()) return it->second;
+        return zeroed ? 0 : UNKNOWN;
+    }
+    void put(int offset, int value) {
+        cells[offset] = value;
+    }
+
+    // forget everything (the pointer could be anywhere now) except that the current cell is value
+    void forget(int value = UNKNOWN) {
+        cells.clear();
+        zeroed = false;
+        at = low = high = 0;
+        if (value != UNKNOWN) cells[0] = value;
+    }
+
+    // does leaf only go to cells we know are on the tape? If not, it could be where the program stops.
+    bool safe(const CommandNode * leaf) const {
+        switch (leaf->command) {
+        case SHIFT_LEFT:    return at - leaf->count >= low;
+        case SHIFT_RIGHT:   return at + leaf->count <= high;
+        case SET:           return reached(leaf->offset) && reached(leaf->offset + leaf->count - 1);
+        case MULTIPLY:      return reached(leaf->source) && reached(leaf->offset);
+        case SCAN:          return false;
+        default:            return reached(leaf->offset);
+        }
+    }
+
+    // forget the cells at these offsets from the pointer
+    void forget(const set<int> & offsets) {
+        for (auto it = offsets.begin(); it != offsets.end(); ++it) {
+            put(at + *it, UNKNOWN);
+        }
+    }
+
+    // what we know after a loop at the pointer: it's 0, and if the loop is balanced, cells it doesn't touch keep their values
+    void leave(const Container * loop) {
+        set<int> touched;
+        if (balanced(loop, touched)) {
+            forget(touched);
+            put(at, 0);
+        } else {
+            forget(0);
+        }
+    }
+
+    // follow one straight-line command
+    void apply(const CommandNode * leaf) {
+        int cell = at + leaf->offset, value = get(cell), source = get(at + leaf->source);
+        switch (leaf->command) {
+        case INCREMENT:     if (value != UNKNOWN) put(cell, (value + leaf->count) & 255); break;
+        case DECREMENT:     if (value != UNKNOWN) put(cell, (value - leaf->count) & 255); break;
+        case SHIFT_LEFT:    low = min(low, at -= leaf->count); break;
+        case SHIFT_RIGHT:   high = max(high, at += leaf->count); break;
+        case INPUT:         put(cell, UNKNOWN); break;
+        case ZERO:          put(cell, 0); break;
+        case SET:           for (int i = 0; i < leaf->count; i++) put(cell + i, leaf->value); break;
+        case MULTIPLY:
+            if (value != UNKNOWN && source != UNKNOWN) put(cell, (value + source * leaf->value) & 255);
+            else if (source != 0) put(cell, UNKNOWN);
+            break;
+        case SCAN:          forget(0); break;
+        case OUTPUT:
+        case PRINT:         break;
+        }
+        // if we got past leaf, the cells it checked are on the tape (a MULTIPLY of 0 doesn't check where it adds,
+        // and after a SCAN we start again from where it stopped)
+        if (leaf->command == MULTIPLY) seen(at + leaf->source, at + leaf->source);
+        else if (leaf->command == SET) seen(cell, cell + leaf->count - 1);
+        else if (leaf->command != PRINT && leaf->command != SCAN) seen(cell, cell);
+    }
+
+    // would leaf set cells to what they already are? Its cells have to be ones we know are on the tape,
+    // or it could be leaf that finds out they're off the end of it
+    bool redundant(const CommandNode * leaf) const {
+        if (leaf->command == SCAN) return get(at) == 0;
+        if (leaf->command != ZERO && leaf->command != SET) return false;
+        int count = leaf->command == SET ? leaf->count : 1, value = leaf->command == SET ? leaf->value : 0;
+        for (int i = 0; i < count; i++) {
+            if (!reached(leaf->offset + i) || get(at + leaf->offset + i) != value) return false;
+        }
+        return true;
+    }
+
+    // is the cell at offset from the pointer one we know is on the tape?
+    bool reached(int offset) const {
+        return at + offset >= low && at + offset <= high;
+    }
+
+    int at; // where the pointer is
+private:
+    // cells from to to are on the tape
+    void seen(int from, int to) {
+        low = min(low, from);
+        high = max(high, to);
+    }
+
+    int low, high; // we've been to both, so every cell from low to high is on the tape
+    map<int, int> cells; // what we've worked out so far
+    bool zeroed; // are the cells we haven't worked out 0?
+};
+
+// how far a + or - run adds (mod 256), or a < or > run moves (right); 0 for anything else
+static int net(const CommandNode * leaf) {
+    switch (leaf->command) {
+    case INCREMENT:     return leaf->count & 255;
+    case DECREMENT:     return -leaf->count & 255;
+    case SHIFT_RIGHT:   return leaf->count;
+    case SHIFT_LEFT:    return -leaf->count;
+    default:            return 0;
+    }
+}
+
+int RunFolding::run(Program * program) {
+    return fold(program);
+}
+
+int RunFolding::fold(Container * container) {
+    int changed = 0;
+    vector<Node*> children;
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        CommandNode * leaf = dynamic_cast<CommandNode *>(*it);
+        if (!leaf) {
+            changed += fold((Loop *)*it);
+            children.push_back(*it);
+            continue;
+        }
+        bool adds = leaf->command == INCREMENT || leaf->command == DECREMENT;
+        bool moves = leaf->command == SHIFT_LEFT || leaf->command == SHIFT_RIGHT;
+        if (!adds && !moves) {
+            children.push_back(leaf);
+            continue;
+        }
+        // fold it into the node before, if that's the same kind of thing
+        CommandNode * last = children.empty() ? nullptr : dynamic_cast<CommandNode *>(children.back());
+        int total = net(leaf);
+        bool merge = last && (adds ? (last->command == INCREMENT || last->command == DECREMENT) && last->offset == leaf->offset
+                                   : last->command == SHIFT_LEFT || last->command == SHIFT_RIGHT);
+        if (merge) {
+            total += net(last);
+            delete leaf;
+            leaf = last;
+            children.pop_back();
+        }
+        // wrap adds to the shorter way around, and drop anything that comes to nothing
+        if (adds) total &= 255;
+        Command command = adds ? (total <= 128 ? INCREMENT : DECREMENT) : (total >= 0 ? SHIFT_RIGHT : SHIFT_LEFT);
+        int count = adds ? (total <= 128 ? total : 256 - total) : abs(total);
+        if (merge || command != leaf->command || count != leaf->count) changed++;
+        if (count == 0) {
+            delete leaf;
+            continue;
+        }
+        leaf->command = command;
+        leaf->count = count;
+        children.push_back(leaf);
+    }
+    container->children.swap(children);
+    return changed;
+}
+
+int OutputFolding::run(Program * program) {
+    KnownCells known(true);
+    return fold(program, known);
+}
+
+int OutputFolding::fold(Container * container, KnownCells & known) {
+    int changed = 0;
+    vector<Node*> children;
+    CommandNode * print = nullptr; // the PRINT we're adding on to
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        CommandNode * leaf = dynamic_cast<CommandNode *>(*it);
+        if (!leaf) {
+            KnownCells inside;
+            changed += fold((Loop *)*it, inside);
+            known.leave((Loop *)*it);
+            print = nullptr;
+            children.push_back(*it);
+            continue;
+        }
+        int value = known.get(known.at + leaf->offset);
+        bool printable = value != KnownCells::UNKNOWN && known.reached(leaf->offset);
+        if (leaf->command == PRINT || (leaf->command == OUTPUT && printable)) {
+            string text = leaf->command == PRINT ? leaf->text : string(leaf->count, (char)value);
+            if (print) {
+                print->text += text;
+                delete leaf;
+                changed++;
+            } else if (leaf->command == PRINT) {
+                print = leaf;
+                children.push_back(leaf);
+            } else {
+                print = new CommandNode(text);
+                delete leaf;
+                children.push_back(print);
+                changed++;
+            }
+            continue;
+        }
+        // output we can't work out, input, and anything that could go off the end of the tape
+        // have to stay in order with the PRINTs
+        if (leaf->command == OUTPUT || leaf->command == INPUT || !known.safe(leaf)) print = nullptr;
+        known.apply(leaf);
+        children.push_back(leaf);
+    }
+    container->children.swap(children);
+    return changed;
+}
+
+int KnownValues::run(Program * program) {
+    KnownCells known(true);
+    return propagate(program, known);
+}
+
+int KnownValues::propagate(Container * container, KnownCells & known) {
+    int changed = 0;
+    vector<Node*> children;
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        CommandNode * leaf = dynamic_cast<CommandNode *>(*it);
+        if (!leaf) {
+            Loop * loop = (Loop *)*it;
+            if (known.get(known.at) == 0) {
+                // never runs
+                delete loop;
+                changed++;
+                continue;
+            }
+            KnownCells inside;
+            changed += propagate(loop, inside);
+            known.leave(loop);
+            children.push_back(loop);
+            continue;
+        }
+        if (known.redundant(leaf)) {
+            delete leaf;
+            changed++;
+            continue;
+        }
+        known.apply(leaf);
+        children.push_back(leaf);
+    }
+    container->children.swap(children);
+    return changed;
+}
+
+int SetFusion::run(Program * program) {
+    return fuse(program);
+}
+
+int SetFusion::fuse(Container * container) {
+    int changed = 0;
+    vector<Node*> children;
+    vector<CommandNode *> run; // the straight-line commands we're holding on to
+    map<int, int> cells; // what they set cells to, by offset from where the run started
+    int at = 0; // where the run moved the pointer
+    int lowest = 0, highest = 0; // how far it went either way
+    int setters = 0; // how many ZEROs and SETs went in
+    bool added = false; // did any + or - get folded into a set?
+
+    // put the run back, as SETs and one move if anything got fused
+    auto flush = [&]() {
+        // the SETs and the move only check the ends of the tape where they land, so the run can't have gone further
+        bool covered = cells.empty() || (min(min(cells.begin()->first, 0), at) <= lowest
+            && max(max(cells.rbegin()->first, 0), at) >= highest);
+        if ((setters < 2 && !added) || !covered) {
+            children.insert(children.end(), run.begin(), run.end());
+        } else {
+            // a SET for every stretch of neighbouring cells with the same value
+            for (auto it = cells.begin(); it != cells.end();) {
+                auto end = it;
+                int count = 0;
+                while (end != cells.end() && end->first == it->first + count && end->second == it->second) {
+                    ++end;
+                    ++count;
+                }
+                children.push_back(new CommandNode(SET, count, it->first, it->second));
+                it = end;
+            }
+            if (at > 0) children.push_back(new CommandNode(SHIFT_RIGHT, at));
+            if (at < 0) children.push_back(new CommandNode(SHIFT_LEFT, -at));
+            for (auto it = run.begin(); it != run.end(); ++it) {
+                delete *it;
+            }
+            changed += run.size();
+        }
+        run.clear();
+        cells.clear();
+        at = lowest = highest = setters = 0;
+        added = false;
+    };
+
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        CommandNode * leaf = dynamic_cast<CommandNode *>(*it);
+        if (!leaf) {
+            flush();
+            changed += fuse((Loop *)*it);
+            children.push_back(*it);
+            continue;
+        }
+        switch (leaf->command) {
+        case SHIFT_LEFT:    lowest = min(lowest, at -= leaf->count); break;
+        case SHIFT_RIGHT:   highest = max(highest, at += leaf->count); break;
+        case ZERO:          cells[at + leaf->offset] = 0; setters++; break;
+        case SET:
+            for (int i = 0; i < leaf->count; i++) cells[at + leaf->offset + i] = leaf->value;
+            setters++;
+            break;
+        case INCREMENT:
+        case DECREMENT:
+            if (cells.count(at + leaf->offset)) {
+                int & cell = cells[at + leaf->offset];
+                cell = (cell + (leaf->command == INCREMENT ? leaf->count : -leaf->count)) & 255;
+                added = true;
+                break;
+            }
+            // + on a cell we didn't set: it has to run where it is
+            flush();
+            children.push_back(leaf);
+            continue;
+        default:
+            flush();
+            children.push_back(leaf);
+            continue;
+        }
+        run.push_back(leaf);
+    }
+    flush();
+    container->children.swap(children);
+    return changed;
+}
+
+/**
+ * What one pass through a loop body that only adds and moves (and ends up where it started) adds to each cell.
+ * Returns what it adds to the loop's own cell (mod 256), or 0 if the body isn't that simple.
+ * lowest and highest get the furthest cells it goes to either way; it checks both against the tape.
+ */
+static int addsPerPass(const Loop * loop, map<int, int> & adds, int & lowest, int & highest) {
+    int at = 0;
+    lowest = highest = 0;
+    for (auto child = loop->children.begin(); child != loop->children.end(); ++child) {
+        const CommandNode * leaf = dynamic_cast<const CommandNode *>(*child);
+        if (!leaf) return 0;
+        else if (leaf->command == INCREMENT) adds[at + leaf->offset] += leaf->count;
+        else if (leaf->command == DECREMENT) adds[at + leaf->offset] -= leaf->count;
+        else if (leaf->command == SHIFT_RIGHT) at += leaf->count;
+        else if (leaf->command == SHIFT_LEFT) at -= leaf->count;
+        else return 0;
+        lowest = min(lowest, min(at, at + leaf->offset));
+        highest = max(highest, max(at, at + leaf->offset));
+    }
+    return at == 0 ? adds[0] & 255 : 0;
+}
+
+// x with x * inverse(x) = 1 (mod 256), for odd x
+static int inverse(int x) {
+    int y = x; // right to 3 bits; each Newton step doubles that
+    for (int i = 0; i < 3; i++) {
+        y = y * (2 - x * y) & 255;
+    }
+    return y;
+}
+
+int MultiplyLoops::run(Program * program) {
+    return rewrite(program);
+}
+
+int MultiplyLoops::rewrite(Container * container) {
+    int changed = 0;
+    vector<Node*> children;
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        Loop * loop = dynamic_cast<Loop *>(*it);
+        if (!loop) {
+            children.push_back(*it);
+            continue;
+        }
+        changed += rewrite(loop);
+
+        map<int, int> adds;
+        int lowest, highest; // how far the body goes either way
+        int step = addsPerPass(loop, adds, lowest, highest);
+        if (step % 2 == 0) {
+            children.push_back(loop);
+            continue;
+        }
+
+        // it goes round n times, where cell + n * step = 0 (mod 256): n = -cell / step
+        int perCell = -inverse(step) & 255;
+        vector<CommandNode *> multiplies;
+        int reachLow = 0, reachHigh = 0; // the cells the MULTIPLYs check are on the tape
+        for (auto cell = adds.begin(); cell != adds.end(); ++cell) {
+            int factor = cell->second * perCell & 255;
+            if (cell->first != 0 && factor != 0) {
+                multiplies.push_back(new CommandNode(MULTIPLY, 1, cell->first, factor, 0));
+                reachLow = min(reachLow, cell->first);
+                reachHigh = max(reachHigh, cell->first);
+            }
+        }
+        // a body that goes further out than the cells it changes would find out it's off the end of the tape
+        // where the MULTIPLYs wouldn't, so it stays a loop
+        if (reachLow > lowest || reachHigh < highest) {
+            for (auto it = multiplies.begin(); it != multiplies.end(); ++it) {
+                delete *it;
+            }
+            children.push_back(loop);
+            continue;
+        }
+        children.insert(children.end(), multiplies.begin(), multiplies.end());
+        children.push_back(new CommandNode(ZERO, 1));
+        delete loop;
+        changed++;
+    }
+    container->children.swap(children);
+    return changed;
+}
+
+int Offsets::run(Program * program) {
+    return fold(program);
+}
+
+int Offsets::fold(Container * container) {
+    int changed = 0;
+    vector<Node*> children;
+    int at = 0; // how far the moves so far would have taken the pointer
+    int moves = 0; // how many of them there were
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        CommandNode * leaf = dynamic_cast<CommandNode *>(*it);
+        if (leaf && (leaf->command == SHIFT_LEFT || leaf->command == SHIFT_RIGHT)) {
+            at += leaf->command == SHIFT_RIGHT ? leaf->count : -leaf->count;
+            moves++;
+            delete leaf;
+            continue;
+        }
+        if (leaf && leaf->command != SCAN) {
+            if (at && leaf->command != PRINT) {
+                leaf->offset += at;
+                leaf->source += at;
+                changed++;
+            }
+            children.push_back(leaf);
+            continue;
+        }
+        // a loop (or a scan, which is one) needs the pointer on its cell
+        if (at) children.push_back(new CommandNode(at > 0 ? SHIFT_RIGHT : SHIFT_LEFT, abs(at)));
+        changed += moves - (at != 0);
+        at = moves = 0;
+        if (!leaf) changed += fold((Loop *)*it);
+        children.push_back(*it);
+    }
+    if (at) children.push_back(new CommandNode(at > 0 ? SHIFT_RIGHT : SHIFT_LEFT, abs(at)));
+    changed += moves - (at != 0);
+    container->children.swap(children);
+    return changed;
+}
+
+/**
+ * Like balanced, but cells gets every cell container reads or writes (a loop reads its own cell),
+ * relative to where it started, plus at.
+ */
+static bool uses(const Container * container, set<int> & cells, int at = 0) {
+    int start = at;
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        const CommandNode * leaf = dynamic_cast<const CommandNode *>(*it);
+        if (!leaf) {
+            cells.insert(at);
+            if (!uses((const Container *)*it, cells, at)) return false;
+            continue;
+        }
+        switch (leaf->command) {
+        case SHIFT_LEFT:    at -= leaf->count; break;
+        case SHIFT_RIGHT:   at += leaf->count; break;
+        case MULTIPLY:      cells.insert(at + leaf->source); cells.insert(at + leaf->offset); break;
+        case SET:           for (int i = 0; i < leaf->count; i++) cells.insert(at + leaf->offset + i); break;
+        case SCAN:          return false;
+        case PRINT:         break;
+        default:            cells.insert(at + leaf->offset); break;
+        }
+    }
+    return at == start;
+}
+
+// stretch lowest and highest over every cell container goes to (or uses), starting from at
+static void spread(const Container * container, int & lowest, int & highest, int at) {
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        const CommandNode * leaf = dynamic_cast<const CommandNode *>(*it);
+        if (!leaf) {
+            spread((const Container *)*it, lowest, highest, at);
+            continue;
+        }
+        int from = at + leaf->offset, to = from;
+        switch (leaf->command) {
+        case SHIFT_LEFT:    from = to = at -= leaf->count; break;
+        case SHIFT_RIGHT:   from = to = at += leaf->count; break;
+        case SET:           to = from + leaf->count - 1; break;
+        case MULTIPLY:      from = min(from, at + leaf->source); to = max(to, at + leaf->source); break;
+        default:            break;
+        }
+        lowest = min(lowest, from);
+        highest = max(highest, to);
+    }
+}
+
+// does anything in container read or write?
+static bool talks(const Container * container) {
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        const CommandNode * leaf = dynamic_cast<const CommandNode *>(*it);
+        if (leaf ? leaf->command == INPUT || leaf->command == OUTPUT || leaf->command == PRINT : talks((const Container *)*it)) return true;
+    }
+    return false;
+}
+
+// is container straight-line code, with no loops in it?
+static bool straight(const Container * container) {
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        if (!dynamic_cast<const CommandNode *>(*it)) return false;
+    }
+    return true;
+}
+
+/**
+ * What each time around loop adds to its own cell, if that's the only way the body changes it
+ * (with + and - right in the body, not in inner loops). 0 otherwise.
+ */
+static int countdown(const Loop * loop) {
+    int at = 0, step = 0;
+    for (auto it = loop->children.begin(); it != loop->children.end(); ++it) {
+        const CommandNode * leaf = dynamic_cast<const CommandNode *>(*it);
+        if (!leaf) {
+            set<int> touched;
+            if (!balanced((const Container *)*it, touched) || touched.count(-at)) return 0;
+            continue;
+        }
+        int cell = at + leaf->offset;
+        switch (leaf->command) {
+        case SHIFT_LEFT:    at -= leaf->count; break;
+        case SHIFT_RIGHT:   at += leaf->count; break;
+        case INCREMENT:     if (cell == 0) step += leaf->count; break;
+        case DECREMENT:     if (cell == 0) step -= leaf->count; break;
+        case SET:           if (cell <= 0 && cell + leaf->count > 0) return 0; break;
+        case INPUT:
+        case ZERO:
+        case MULTIPLY:      if (cell == 0) return 0; break;
+        case SCAN:          return 0;
+        case OUTPUT:
+        case PRINT:         break;
+        }
+    }
+    return at == 0 ? step & 255 : 0;
+}
+
+int LoopFusion::run(Program * program) {
+    KnownCells known(true);
+    return fuse(program, known);
+}
+
+int LoopFusion::fuse(Container * container, KnownCells & known) {
+    int changed = 0;
+    // which cells hold the same value: cells with the same number do. cells that aren't here have their own.
+    map<int, int> same;
+    int fresh = 0;
+    auto value = [&](int cell) {
+        auto found = same.find(cell);
+        return found != same.end() ? found->second : same[cell] = --fresh;
+    };
+    auto spoil = [&](const set<int> & cells, int at) {
+        for (auto it = cells.begin(); it != cells.end(); ++it) {
+            same[at + *it] = --fresh;
+        }
+    };
+
+    vector<Node*> children;
+    Loop * last = nullptr; // the loop just before, if there's been nothing since but moves
+    int lastAt = 0; // where it was
+    map<int, int> lastSame; // ...and what we knew when it started
+    KnownCells lastKnown;
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        CommandNode * leaf = dynamic_cast<CommandNode *>(*it);
+        if (leaf) {
+            int cell = known.at + leaf->offset;
+            if (leaf->command == MULTIPLY && leaf->value == 1 && known.get(cell) == 0) {
+                // a copy
+                same[cell] = value(known.at + leaf->source);
+            } else if (leaf->command == SET) {
+                for (int i = 0; i < leaf->count; i++) same[cell + i] = --fresh;
+            } else if (leaf->command != SHIFT_LEFT && leaf->command != SHIFT_RIGHT && leaf->command != OUTPUT && leaf->command != PRINT) {
+                same[cell] = --fresh;
+            }
+            if (leaf->command == SCAN) same.clear();
+            if (leaf->command != SHIFT_LEFT && leaf->command != SHIFT_RIGHT) last = nullptr;
+            known.apply(leaf);
+            children.push_back(leaf);
+            continue;
+        }
+
+        Loop * loop = (Loop *)*it;
+        KnownCells inside;
+        changed += fuse(loop, inside);
+        if (last) {
+            // the same number of times around as the last loop (which always stops, with an odd step),
+            // and no way for the two to get in each other's way?
+            bool equal = lastSame.count(lastAt) && lastSame.count(known.at) && lastSame[lastAt] == lastSame[known.at];
+            equal = equal || (lastKnown.get(lastAt) != KnownCells::UNKNOWN && lastKnown.get(lastAt) == lastKnown.get(known.at));
+            set<int> first, second;
+            bool apart = uses(last, first, lastAt) && uses(loop, second, known.at);
+            for (auto cell = second.begin(); cell != second.end() && apart; ++cell) {
+                apart = !first.count(*cell);
+            }
+            // going around together changes where one of them finds out it's off the end of the tape
+            // (and what the other has printed by then), so everything they go to has to be on it
+            int lowest = lastAt, highest = lastAt;
+            spread(last, lowest, highest, lastAt);
+            spread(loop, lowest, highest, known.at);
+            bool inside = known.reached(lowest - known.at) && known.reached(highest - known.at);
+            int step = countdown(last);
+            // if one of them reads or prints, the other mustn't get stuck in an inner loop halfway
+            bool ordered = talks(last) ? !talks(loop) && straight(loop) : !talks(loop) || straight(last);
+            if (equal && apart && inside && step % 2 && countdown(loop) == step && ordered && !last->summary && !loop->summary) {
+                // go round them both at once
+                int distance = known.at - lastAt;
+                if (distance > 0) last->children.push_back(new CommandNode(SHIFT_RIGHT, distance));
+                if (distance < 0) last->children.push_back(new CommandNode(SHIFT_LEFT, -distance));
+                last->children.insert(last->children.end(), loop->children.begin(), loop->children.end());
+                if (distance > 0) last->children.push_back(new CommandNode(SHIFT_LEFT, distance));
+                if (distance < 0) last->children.push_back(new CommandNode(SHIFT_RIGHT, -distance));
+                set<int> touched;
+                balanced(loop, touched);
+                spoil(touched, known.at);
+                same[known.at] = --fresh;
+                known.leave(loop);
+                loop->children.clear();
+                delete loop;
+                changed++;
+                continue;
+            }
+        }
+        // remember what things were like when it started, for the next loop
+        last = loop;
+        lastAt = known.at;
+        lastSame = same;
+        lastKnown = known;
+        set<int> touched;
+        if (balanced(loop, touched)) {
+            spoil(touched, known.at);
+            same[known.at] = --fresh;
+        } else {
+            same.clear();
+        }
+        known.leave(loop);
+        children.push_back(loop);
+    }
+    container->children.swap(children);
+    return changed;
+}
+
+int InvariantMotion::run(Program * program) {
+    return hoist(program);
+}
+
+int InvariantMotion::hoist(Container * container) {
+    int changed = 0;
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        Loop * loop = dynamic_cast<Loop *>(*it);
+        if (!loop) continue;
+        changed += hoist(loop);
+        set<int> touched;
+        if (!balanced(loop, touched)) continue;
+
+        // a clear or set of a cell nothing else in the body changes (or reads before it) puts the same thing there
+        // every time around, so it only needs doing once, the first time
+        vector<Node*> once, rest;
+        int at = 0;
+        for (size_t i = 0; i < loop->children.size(); i++) {
+            CommandNode * leaf = dynamic_cast<CommandNode *>(loop->children[i]);
+            if (leaf && (leaf->command == SHIFT_LEFT || leaf->command == SHIFT_RIGHT)) {
+                at += leaf->command == SHIFT_RIGHT ? leaf->count : -leaf->count;
+            }
+            bool invariant = leaf && (leaf->command == ZERO || leaf->command == SET);
+            int cell = leaf ? at + leaf->offset : 0;
+            int size = leaf && leaf->command == SET ? leaf->count : 1;
+            if (invariant && cell <= 0 && cell + size > 0) invariant = false;
+            if (invariant) {
+                // everything else in the body, as a container of its own
+                Loop before, after;
+                before.children.assign(loop->children.begin(), loop->children.begin() + i);
+                after.children.assign(loop->children.begin() + i + 1, loop->children.end());
+                // (the loop's balanced, so neither half stops short; after starts where the leaf is)
+                set<int> read, written;
+                uses(&before, read);
+                balanced(&after, written);
+                for (int c = cell; c < cell + size && invariant; c++) {
+                    invariant = !read.count(c) && !written.count(c - at);
+                }
+                // X goes first now, so if it's off the end of the tape, nothing before it can have printed
+                // (or be stuck in a loop) by the time that's found out
+                invariant = invariant && straight(&before) && !talks(&before);
+                before.children.clear();
+                after.children.clear();
+            }
+            if (!invariant) {
+                rest.push_back(loop->children[i]);
+                continue;
+            }
+            leaf->offset = cell;
+            once.push_back(leaf);
+        }
+        if (once.empty()) continue;
+        // [X rest] -> [X [rest]]: if the loop goes around at all, do X, then go around without it
+        Loop * inner = new Loop();
+        inner->children.swap(rest);
+        loop->children.swap(once);
+        loop->children.push_back(inner);
+        changed++;
+    }
+    return changed;
+}
+
+/**
+ * A cell's value as a sum of factors times what cells held before (Summary::CONSTANT for 1), mod 256.
+ * A cell nothing has changed yet is just 1 times itself.
+ */
+typedef map<int, int> Affine;
+
+// sum += factor * terms
+static void addTo(Affine & sum, const Affine & terms, int factor) {
+    for (auto it = terms.begin(); it != terms.end(); ++it) {
+        int total = (sum[it->first] + factor * it->second) & 255;
+        if (total) sum[it->first] = total;
+        else sum.erase(it->first);
+    }
+}
+
+/**
+ * Work out what one time around loop does to each cell it changes, as an Affine of the cells before.
+ * The body can add, clear, set, multiply and move (ending up where it started), and have inner loops that
+ * MultiplyLoops could do (those are just multiplies by the inner loop's cell). Returns false for anything else.
+ * lowest and highest get the furthest cells it could go to either way.
+ */
+static bool affineBody(const Loop * loop, map<int, Affine> & cells, int & lowest, int & highest) {
+    // what's in a cell so far
+    auto value = [&](int cell) -> Affine & {
+        auto found = cells.find(cell);
+        if (found != cells.end()) return found->second;
+        Affine & affine = cells[cell];
+        affine[cell] = 1;
+        return affine;
+    };
+    Affine one;
+    one[Loop::Summary::CONSTANT] = 1;
+    int at = 0;
+    lowest = highest = 0;
+    auto reach = [&](int from, int to) {
+        lowest = min(lowest, from);
+        highest = max(highest, to);
+    };
+    for (auto child = loop->children.begin(); child != loop->children.end(); ++child) {
+        const CommandNode * leaf = dynamic_cast<const CommandNode *>(*child);
+        if (!leaf) {
+            map<int, int> adds;
+            int innerLowest, innerHighest;
+            int step = addsPerPass((const Loop *)*child, adds, innerLowest, innerHighest);
+            if (step % 2 == 0) return false;
+            reach(at + innerLowest, at + innerHighest);
+            int perCell = -inverse(step) & 255;
+            Affine counter = value(at);
+            for (auto cell = adds.begin(); cell != adds.end(); ++cell) {
+                if (cell->first != 0) addTo(value(at + cell->first), counter, cell->second * perCell);
+            }
+            value(at).clear();
+            continue;
+        }
+        int cell = at + leaf->offset;
+        reach(min(cell, at), max(cell, at));
+        switch (leaf->command) {
+        case INCREMENT:     addTo(value(cell), one, leaf->count); break;
+        case DECREMENT:     addTo(value(cell), one, -leaf->count); break;
+        case SHIFT_RIGHT:   at += leaf->count; reach(at, at); break;
+        case SHIFT_LEFT:    at -= leaf->count; reach(at, at); break;
+        case ZERO:          value(cell).clear(); break;
+        case SET:
+            reach(cell, cell + leaf->count - 1);
+            for (int i = 0; i < leaf->count; i++) {
+                value(cell + i).clear();
+                addTo(value(cell + i), one, leaf->value);
+            }
+            break;
+        case MULTIPLY: {
+            reach(min(at + leaf->source, cell), max(at + leaf->source, cell));
+            Affine source = value(at + leaf->source);
+            addTo(value(cell), source, leaf->value);
+            break;
+        }
+        default:            return false;
+        }
+    }
+    return at == 0;
+}
+
+// make cells (what one time around does) the first time around of summary
+static void firstTime(const map<int, Affine> & cells, Loop::Summary * summary) {
+    for (auto cell = cells.begin(); cell != cells.end(); ++cell) {
+        const Affine & affine = cell->second;
+        if (cell->first == 0 || affine == Affine{ { cell->first, 1 } }) continue;
+        Loop::Summary::Term clear = { cell->first, 0, Loop::Summary::CONSTANT };
+        if (affine.empty()) summary->first.push_back(clear);
+        for (auto term = affine.begin(); term != affine.end(); ++term) {
+            Loop::Summary::Term set = { cell->first, term->second, term->first };
+            summary->first.push_back(set);
+        }
+    }
+}
+
+int AffineLoops::run(Program * program) {
+    return summarize(program);
+}
+
+int AffineLoops::summarize(Container * container) {
+    int changed = 0;
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        Loop * loop = dynamic_cast<Loop *>(*it);
+        if (!loop) continue;
+        changed += summarize(loop);
+        // Idioms knows better
+        if (loop->summary) continue;
+
+        map<int, Affine> cells;
+        int lowest, highest;
+        if (!affineBody(loop, cells, lowest, highest)) continue;
+        Affine & counter = cells[0];
+        if (counter.empty()) {
+            // it clears its own cell, so it only goes around once: an if
+            loop->summary = new Loop::Summary();
+            loop->summary->lowest = lowest;
+            loop->summary->highest = highest;
+            firstTime(cells, loop->summary);
+            changed++;
+            continue;
+        }
+        // otherwise the loop's cell has to go up (or down) by the same step every time
+        int step = counter.size() == 2 && counter[0] == 1 ? counter[Loop::Summary::CONSTANT] : 0;
+        if (step == 0) continue;
+
+        // cells that every time around sets to a constant hold it from the first time on
+        map<int, int> constants;
+        for (auto cell = cells.begin(); cell != cells.end(); ++cell) {
+            if (cell->second.empty()) constants[cell->first] = 0;
+            else if (cell->second.size() == 1 && cell->second.count(Loop::Summary::CONSTANT)) {
+                constants[cell->first] = cell->second[Loop::Summary::CONSTANT];
+            }
+        }
+        // so after the first time, the loop does the same with those filled in
+        map<int, Affine> later;
+        for (auto cell = cells.begin(); cell != cells.end(); ++cell) {
+            Affine & affine = later[cell->first];
+            for (auto term = cell->second.begin(); term != cell->second.end(); ++term) {
+                auto constant = constants.find(term->first);
+                if (constant == constants.end()) addTo(affine, Affine{ { term->first, 1 } }, term->second);
+                else addTo(affine, Affine{ { Loop::Summary::CONSTANT, 1 } }, term->second * constant->second);
+            }
+        }
+        // which has to be adding (the same every time) to the cells it changes: the cell itself, plus
+        // constants and cells it leaves alone. that's n times as much for n times around.
+        vector<Loop::Summary::Term> adds;
+        bool simple = true;
+        for (auto cell = later.begin(); cell != later.end() && simple; ++cell) {
+            if (cell->first == 0 || constants.count(cell->first)) continue;
+            Affine affine = cell->second;
+            if (affine[cell->first] != 1) simple = false;
+            affine.erase(cell->first);
+            for (auto term = affine.begin(); term != affine.end() && simple; ++term) {
+                auto source = later.find(term->first);
+                bool unchanged = source == later.end() || source->second == Affine{ { term->first, 1 } };
+                if (term->first != Loop::Summary::CONSTANT && (term->first == 0 || !unchanged)) simple = false;
+                Loop::Summary::Term add = { cell->first, term->second, term->first };
+                adds.push_back(add);
+            }
+        }
+        if (!simple) continue;
+
+        // step = 2^shift * an odd number; the odd part has an inverse
+        Loop::Summary * summary = new Loop::Summary();
+        summary->step = step;
+        summary->shift = 0;
+        while (!(step >> summary->shift & 1)) summary->shift++;
+        summary->inverse = inverse(step >> summary->shift);
+        summary->lowest = lowest;
+        summary->highest = highest;
+        summary->adds.swap(adds);
+        // the first time around is different if it puts constants in cells (that the rest don't change)
+        if (!constants.empty()) firstTime(cells, summary);
+        loop->summary = summary;
+        changed++;
+    }
+    return changed;
+}
+
+// the passes for each optimization level
+static const char * const LEVELS[PassManager::MAX_LEVEL + 1] = {
+    "",
+    "fold-runs",
+    "fold-runs,idioms,known-values,peephole,multiply-loops,offsets,fuse-loops,hoist,fuse-sets,known-values,affine-loops",
+    "fold-runs,idioms,known-values,peephole,multiply-loops,offsets,fuse-loops,hoist,fuse-sets,known-values,rewrites,saturate,affine-loops,fold-output",
+};
+
+/**
+ * The standard peephole rules (see PeepholeRule for how to write them).
+ * The MULTIPLY ones are the common cases of MultiplyLoops, caught early and cheaply.
+ */
+static const PeepholeRule RULES[] = {
+    { "[-]",        "ZERO" },
+    { "[+]",        "ZERO" },
+    { "[-]+a",      "SET a" },
+    { "[-]-a",      "SET -a" },
+    { "[>a]",       "SCAN a" },
+    { "[<a]",       "SCAN -a" },
+    { "[->a+<a]",   "MULTIPLY a 1; ZERO" },
+    { "[-<a+>a]",   "MULTIPLY -a 1; ZERO" },
+    { "[>a+<a-]",   "MULTIPLY a 1; ZERO" },
+    { "[<a+>a-]",   "MULTIPLY -a 1; ZERO" },
+    { "[->a+b<a]",  "MULTIPLY a b; ZERO" },
+    { "[-<a+b>a]",  "MULTIPLY -a b; ZERO" },
+    { "[->a-b<a]",  "MULTIPLY a -b; ZERO" },
+    { "[-<a-b>a]",  "MULTIPLY -a -b; ZERO" },
+};
+
+Peephole::State::~State() {
+    for (auto it = next.begin(); it != next.end(); ++it) {
+        delete it->second;
+    }
+}
+
+Peephole::Peephole() {
+    for (size_t i = 0; i < sizeof(RULES) / sizeof(RULES[0]); i++) {
+        add(RULES[i].pattern, RULES[i].replacement);
+    }
+}
+
+/**
+ * A pattern (see PeepholeRule) as commands with their counts: -1 for variable a, -2 for b...
+ * false if it doesn't make sense.
+ */
+static bool parsePattern(const string & pattern, vector<pair<char, int> > & steps) {
+    bool plain = false; // was the last command just a character (so it can run on, like >>>)?
+    for (size_t i = 0; i < pattern.size();) {
+        char command = pattern[i++];
+        if (!strchr("+-<>,.[]", command)) return false;
+        int count = 1;
+        if (i < pattern.size() && islower((unsigned char)pattern[i])) {
+            if (command == '[' || command == ']') return false;
+            count = -(pattern[i++] - 'a' + 1);
+        } else if (i < pattern.size() && isdigit((unsigned char)pattern[i])) {
+            count = 0;
+            while (i < pattern.size() && isdigit((unsigned char)pattern[i])) {
+                count = count * 10 + (pattern[i++] - '0');
+            }
+            if (count == 0) return false;
+        } else if (plain && steps.back().first == command && command != '[' && command != ']') {
+            steps.back().second++;
+            continue;
+        }
+        plain = !isalnum((unsigned char)pattern[i - 1]);
+        steps.push_back(make_pair(command, count));
+    }
+    return !steps.empty();
+}
+
+bool Peephole::add(const string & pattern, const string & replacement) {
+    vector<pair<char, int> > steps;
+    if (!parsePattern(pattern, steps)) return false;
+    bool bound[26] = { false };
+    for (auto it = steps.begin(); it != steps.end(); ++it) {
+        if (it->second < 0) bound[-it->second - 1] = true;
+    }
+
+    // the replacement: instructions with their arguments, separated by ;
+    vector<Instruction> instructions;
+    stringstream list(replacement);
+    string text;
+    while (getline(list, text, ';')) {
+        stringstream words(text);
+        string name, word;
+        if (!(words >> name)) return false;
+        Instruction instruction;
+        if (name == "ZERO") instruction.command = ZERO;
+        else if (name == "SET") instruction.command = SET;
+        else if (name == "SCAN") instruction.command = SCAN;
+        else if (name == "MULTIPLY") instruction.command = MULTIPLY;
+        else return false;
+        while (words >> word) {
+            Argument argument = { 0, -1, word[0] == '-' };
+            string rest = word.substr(argument.negate ? 1 : 0);
+            if (rest.size() == 1 && islower((unsigned char)rest[0])) {
+                argument.variable = rest[0] - 'a';
+                if (!bound[argument.variable]) return false;
+            } else if (!rest.empty() && rest.find_first_not_of("0123456789") == string::npos) {
+                argument.number = atoi(rest.c_str());
+            } else {
+                return false;
+            }
+            instruction.arguments.push_back(argument);
+        }
+        size_t needs = instruction.command == MULTIPLY ? 2 : instruction.command == SCAN ? 1 : 0;
+        size_t takes = instruction.command == ZERO ? 1 : 2;
+        if (instruction.arguments.size() < needs || instruction.arguments.size() > max(needs, takes)) return false;
+        instructions.push_back(instruction);
+    }
+    if (instructions.empty()) return false;
+
+    // thread the pattern into the trie
+    State * state = &root;
+    for (auto it = steps.begin(); it != steps.end(); ++it) {
+        State *& next = state->next[*it];
+        if (!next) next = new State();
+        state = next;
+    }
+    if (state->rule < 0) {
+        state->rule = (int)replacements.size();
+        replacements.push_back(instructions);
+    }
+    return true;
+}
+
+// the code as tokens: commands with counts, and loops as [ and ]. the rest can't be matched.
+static void tokenize(const Node * node, vector<pair<char, int> > & tokens) {
+    const CommandNode * leaf = dynamic_cast<const CommandNode *>(node);
+    if (!leaf) {
+        tokens.push_back(make_pair('[', 1));
+        const Container * loop = (const Container *)node;
+        for (auto it = loop->children.begin(); it != loop->children.end(); ++it) {
+            tokenize(*it, tokens);
+        }
+        tokens.push_back(make_pair(']', 1));
+        return;
+    }
+    const char * commands = "+-<>,.";
+    if (leaf->offset == 0 && leaf->command <= OUTPUT) {
+        tokens.push_back(make_pair(commands[leaf->command], leaf->count));
+    } else if (leaf->offset == 0 && leaf->command == ZERO) {
+        tokens.push_back(make_pair('[', 1));
+        tokens.push_back(make_pair('-', 1));
+        tokens.push_back(make_pair(']', 1));
+    } else {
+        tokens.push_back(make_pair('\0', 0));
+    }
+}
+
+void Peephole::match(const vector<pair<char, int> > & tokens, size_t at, const State * state,
+                     const vector<bool> & boundary, Match & best, Match & current) const {
+    if (state->rule >= 0 && boundary[at] && (at > best.end || (at == best.end && state->rule < best.rule))) {
+        best = current;
+        best.end = at;
+        best.rule = state->rule;
+    }
+    if (at == tokens.size()) return;
+    char command = tokens[at].first;
+    int count = tokens[at].second;
+    // the exact count
+    auto exact = state->next.find(make_pair(command, count));
+    if (exact != state->next.end()) match(tokens, at + 1, exact->second, boundary, best, current);
+    // or any count, into a variable (that has to agree with what it matched before)
+    for (int variable = 0; variable < 26; variable++) {
+        auto any = state->next.find(make_pair(command, -(variable + 1)));
+        if (any == state->next.end()) continue;
+        int & value = current.values[variable];
+        if (value && value != count) continue;
+        bool fresh = value == 0;
+        value = count;
+        match(tokens, at + 1, any->second, boundary, best, current);
+        if (fresh) value = 0;
+    }
+}
+
+int Peephole::run(Program * program) {
+    return rewrite(program);
+}
+
+int Peephole::rewrite(Container * container) {
+    int changed = 0;
+    vector<pair<char, int> > tokens;
+    vector<size_t> starts; // where each child's tokens start
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        starts.push_back(tokens.size());
+        tokenize(*it, tokens);
+    }
+    // matches have to cover whole children, so they can only end where one starts
+    vector<bool> boundary(tokens.size() + 1, false);
+    for (auto it = starts.begin(); it != starts.end(); ++it) {
+        boundary[*it] = true;
+    }
+    boundary[tokens.size()] = true;
+
+    vector<Node*> children;
+    for (size_t i = 0; i < container->children.size();) {
+        Match best, current;
+        match(tokens, starts[i], &root, boundary, best, current);
+        if (best.rule < 0) {
+            if (Loop * loop = dynamic_cast<Loop *>(container->children[i])) changed += rewrite(loop);
+            children.push_back(container->children[i++]);
+            continue;
+        }
+        // swap the children it covers for the replacement
+        const vector<Instruction> & instructions = replacements[best.rule];
+        for (auto it = instructions.begin(); it != instructions.end(); ++it) {
+            int arguments[2] = { 0, 0 };
+            for (size_t a = 0; a < it->arguments.size(); a++) {
+                const Argument & argument = it->arguments[a];
+                int value = argument.variable >= 0 ? best.values[argument.variable] : argument.number;
+                arguments[a] = argument.negate ? -value : value;
+            }
+            switch (it->command) {
+            case ZERO:      children.push_back(new CommandNode(ZERO, 1, arguments[0])); break;
+            case SET:       children.push_back(new CommandNode(SET, 1, arguments[1], arguments[0] & 255)); break;
+            case SCAN:      children.push_back(new CommandNode(SCAN, 1, 0, arguments[0])); break;
+            case MULTIPLY:  children.push_back(new CommandNode(MULTIPLY, 1, arguments[0], arguments[1] & 255, 0)); break;
+            default:        break;
+            }
+        }
+        for (; i < container->children.size() && starts[i] < best.end; i++) {
+            delete container->children[i];
+        }
+        changed++;
+    }
+    container->children.swap(children);
+    return changed;
+}
+
+/**
+ * A well-known algorithm: what its loop looks like (a pattern, like PeepholeRule's), and a function that fills in
+ * its summary from the counts the pattern's variables matched (false if it doesn't work for them).
+ */
+struct Idiom {
+    const char * name;
+    const char * pattern;
+    bool (*summarize)(const int * values, Loop::Summary * summary);
+};
+
+// n 0 d 0 q 0 0 -> 0 n d-n%d n%d q+n/d 0 0 (the esolangs wiki's divmod). it divides by 256 for d = 0, and gets lost for d = 1.
+static bool divmod(const int *, Loop::Summary * summary) {
+    summary->step = summary->inverse = 255;
+    summary->divisorAt = 2;
+    summary->conditions = { { 2, 1, false }, { 3, 0, true }, { 5, 0, true }, { 6, 0, true } };
+    summary->first = {
+        { 1, 1, 1 }, { 1, 1, 0 },
+        { 2, 1, 2 }, { 2, 255, Loop::Summary::REMAINDER },
+        { 3, 1, Loop::Summary::REMAINDER },
+        { 4, 1, 4 }, { 4, 1, Loop::Summary::QUOTIENT },
+    };
+    return true;
+}
+
+// n d 0 q 0 0 -> 0 d-n%d n%d q+n/d 0 0 (the wiki's other divmod, which doesn't keep n)
+static bool divmodInPlace(const int *, Loop::Summary * summary) {
+    summary->step = summary->inverse = 255;
+    summary->divisorAt = 1;
+    summary->conditions = { { 1, 1, false }, { 2, 0, true }, { 4, 0, true }, { 5, 0, true } };
+    summary->first = {
+        { 1, 1, 1 }, { 1, 255, Loop::Summary::REMAINDER },
+        { 2, 1, Loop::Summary::REMAINDER },
+        { 3, 1, 3 }, { 3, 1, Loop::Summary::QUOTIENT },
+    };
+    return true;
+}
+
+// n d-1 0 0 q -> 0 d-1-n%d 0 0 q+n/d, for a constant d (how 99botles splits a number into digits)
+static bool divmodConstant(const int * values, Loop::Summary * summary) {
+    int d = values[0];
+    if (d < 1 || d > 255) return false;
+    summary->step = summary->inverse = 255;
+    summary->divisor = d;
+    summary->conditions = { { 1, d - 1, true }, { 2, 0, true }, { 3, 0, true } };
+    summary->first = {
+        { 1, d - 1, Loop::Summary::CONSTANT }, { 1, 255, Loop::Summary::REMAINDER },
+        { 4, 1, 4 }, { 4, 1, Loop::Summary::QUOTIENT },
+    };
+    return true;
+}
+
+static const Idiom IDIOMS[] = {
+    { "divmod",             "[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]",            divmod },
+    { "divmod in place",    "[->-[>+>>]>[+[-<+>]>+>>]<<<<<]",               divmodInPlace },
+    { "divmod by constant", "[>>>+<<[>+>[-]<<-]>[<+>-]>[<<+a>>>+<-]<<-<-]", divmodConstant },
+};
+
+// does loop look like steps (from parsePattern)? values gets what the variables matched.
+static bool shaped(const Loop * loop, const vector<pair<char, int> > & steps, int * values) {
+    vector<pair<char, int> > tokens;
+    tokenize(loop, tokens);
+    if (tokens.size() != steps.size()) return false;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (tokens[i].first != steps[i].first) return false;
+        int count = steps[i].second;
+        if (count > 0 && tokens[i].second != count) return false;
+        if (count < 0) {
+            int & value = values[-count - 1];
+            if (value && value != tokens[i].second) return false;
+            value = tokens[i].second;
+        }
+    }
+    return true;
+}
+
+int Idioms::run(Program * program) {
+    return recognize(program);
+}
+
+int Idioms::recognize(Container * container) {
+    int changed = 0;
+    for (auto it = container->children.begin(); it != container->children.end(); ++it) {
+        Loop * loop = dynamic_cast<Loop *>(*it);
+        if (!loop) continue;
+        changed += recognize(loop);
+        for (size_t i = 0; i < sizeof(IDIOMS) / sizeof(IDIOMS[0]); i++) {
+            vector<pair<char, int> > steps;
+            int values[26] = { 0 };
+            parsePattern(IDIOMS[i].pattern, steps);
+            if (!shaped(loop, steps, values)) continue;
+            Loop::Summary * summary = new Loop::Summary();
+            if (IDIOMS[i].summarize(values, summary)) {
+                summary->span();
+                delete loop->summary;
+                loop->summary = summary;
+                changed++;
+                break;
+            }
+            delete summary;
+        }
+    }
+    return changed;
+}
+
+/**
+ * What a block of straight-line code does: how far it moves the pointer, and each cell it changes
+ * as an Affine of what the cells held before.
+ */
+struct Effect {
+    Effect() : shift(0) {}
+    int shift;
+    map<int, Affine> cells;
+};
+
+// can node go in a block?
+static bool arithmetic(const Node * node) {
+    const CommandNode * leaf = dynamic_cast<const CommandNode *>(node);
+    if (!leaf) return false;
+    switch (leaf->command) {
+    case INCREMENT:
+    case DECREMENT:
+    case SHIFT_LEFT:
+    case SHIFT_RIGHT:
+    case ZERO:
+    case SET:
+    case MULTIPLY:      return true;
+    default:            return false;
+    }
+}
+
+// effect, then leaf (which can go in a block)
+static void follow(Effect & effect, const CommandNode * leaf) {
+    auto value = [&](int cell) -> Affine & {
+        auto found = effect.cells.find(cell);
+        if (found != effect.cells.end()) return found->second;
+        Affine & affine = effect.cells[cell];
+        affine[cell] = 1;
+        return affine;
+    };
+    const Affine one = { { Loop::Summary::CONSTANT, 1 } };
+    int cell = effect.shift + leaf->offset;
+    switch (leaf->command) {
+    case INCREMENT:     addTo(value(cell), one, leaf->count); break;
+    case DECREMENT:     addTo(value(cell), one, -leaf->count); break;
+    case SHIFT_RIGHT:   effect.shift += leaf->count; break;
+    case SHIFT_LEFT:    effect.shift -= leaf->count; break;
+    case ZERO:          value(cell).clear(); break;
+    case SET:
+        for (int i = 0; i < leaf->count; i++) {
+            value(cell + i).clear();
+            addTo(value(cell + i), one, leaf->value);
+        }
+        break;
+    case MULTIPLY: {
+        Affine source = value(effect.shift + leaf->source);
+        addTo(value(cell), source, leaf->value);
+        break;
+    }
+    default:            break;
+    }
+}
+
+// every cell effect changes or reads, lowest first
+static vector<int> window(const Effect & effect) {
+    set<int> cells;
+    for (auto cell = effect.cells.begin(); cell != effect.cells.end(); ++cell) {
+        cells.insert(cell->first);
+        for (auto term = cell->second.begin(); term != cell->second.end(); ++term) {
+            if (term->first != Loop::Summary::CONSTANT) cells.insert(term->first);
+        }
+    }
+    return vector<int>(cells.begin(), cells.end());
+}
+
+/**
+ * effect as a key for the database, with the cells counted from the lowest one it uses (which base gets).
+ * Cells that end up holding what they started with get dropped first.
+ */
+static string describe(Effect & effect, int & base) {
+    for (auto cell = effect.cells.begin(); cell != effect.cells.end();) {
+        if (cell->second == Affine{ { cell->first, 1 } }) effect.cells.erase(cell++);
+        else ++cell;
+    }
+    vector<int> cells = window(effect);
+    base = cells.empty() ? 0 : cells[0];
+    stringstream key;
+    key << effect.shift;
+    for (auto cell = effect.cells.begin(); cell != effect.cells.end(); ++cell) {
+        key << ' ' << cell->first - base << '=';
+        if (cell->second.empty()) key << 0;
+        for (auto term = cell->second.begin(); term != cell->second.end(); ++term) {
+            if (term != cell->second.begin()) key << '+';
+            if (term->first == Loop::Summary::CONSTANT) key << term->second;
+            else key << term->second << '*' << term->first - base;
+        }
+    }
+    return key.str();
+}
+
+// nodes (which can go in a block) as code for the database, with base taken off every offset
+static string write(const vector<const CommandNode *> & nodes, int base) {
+    stringstream code;
+    for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+        const CommandNode * leaf = *it;
+        if (it != nodes.begin()) code << "; ";
+        int offset = leaf->offset - base;
+        switch (leaf->command) {
+        case INCREMENT:     code << "ADD " << (leaf->count & 255) << ' ' << offset; break;
+        case DECREMENT:     code << "ADD " << (-leaf->count & 255) << ' ' << offset; break;
+        case SHIFT_RIGHT:   code << "MOVE " << leaf->count; break;
+        case SHIFT_LEFT:    code << "MOVE " << -leaf->count; break;
+        case ZERO:          code << "ZERO " << offset; break;
+        case SET:           code << "SET " << leaf->value << ' ' << offset << (leaf->count > 1 ? " " + to_string(leaf->count) : ""); break;
+        case MULTIPLY:      code << "MULTIPLY " << offset << ' ' << leaf->value << ' ' << leaf->source - base; break;
+        default:            break;
+        }
+    }
+    return code.str();
+}
+
+// code from the database as nodes (for the caller to delete), with base added to every offset. false if it doesn't make sense.
+static bool read(const string & code, int base, vector<CommandNode *> & nodes) {
+    stringstream list(code);
+    string text;
+    while (getline(list, text, ';')) {
+        stringstream words(text);
+        string name;
+        vector<int> arguments;
+        int argument;
+        if (!(words >> name)) continue;
+        while (words >> argument) arguments.push_back(argument);
+        bool fits = words.eof();
+        if (name == "ADD" && arguments.size() == 2) {
+            int amount = arguments[0] & 255;
+            if (amount < 128) nodes.push_back(new CommandNode(INCREMENT, amount, arguments[1] + base));
+            else nodes.push_back(new CommandNode(DECREMENT, 256 - amount, arguments[1] + base));
+        } else if (name == "MOVE" && arguments.size() == 1 && arguments[0]) {
+            nodes.push_back(new CommandNode(arguments[0] > 0 ? SHIFT_RIGHT : SHIFT_LEFT, abs(arguments[0])));
+        } else if (name == "ZERO" && arguments.size() == 1) {
+            nodes.push_back(new CommandNode(ZERO, 1, arguments[0] + base));
+        } else if (name == "SET" && (arguments.size() == 2 || (arguments.size() == 3 && arguments[2] > 0))) {
+            nodes.push_back(new CommandNode(SET, arguments.size() == 3 ? arguments[2] : 1, arguments[1] + base, arguments[0] & 255));
+        } else if (name == "MULTIPLY" && arguments.size() == 3) {
+            nodes.push_back(new CommandNode(MULTIPLY, 1, arguments[0] + base, arguments[1] & 255, arguments[2] + base));
+        } else {
+            fits = false;
+        }
+        if (!fits) {
+            for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+                delete *it;
+            }
+            nodes.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The superoptimizer: the shortest code (of at most limit instructions, plus the move) that does what goal does,
+ * for the caller to delete. false if there's none that short.
+ * It tries every list of ADDs, ZEROs, SETs and MULTIPLYs, shortest first, on the cells goal uses (only writing
+ * the ones it changes), with the constants and factors goal has in it (and 1 and -1): exhaustive, but not over
+ * every number there is. The cells are followed symbolically, so a match is a proof. A list doesn't get finished
+ * when it changes a cell only for the next instruction to overwrite it, splits what one instruction could do,
+ * has two instructions that don't touch each other's cells in the other order, or has more cells left wrong
+ * than instructions left to put them right.
+ */
+class Superoptimizer {
+public:
+    enum { MAX_CELLS = 8 };
+
+    Superoptimizer(const Effect & goal) : goal(goal), cells(window(goal)) {}
+
+    bool search(int limit, vector<CommandNode *> & best) {
+        if (cells.size() > MAX_CELLS) return false;
+        // what each cell needs to end up as, and what it starts as
+        memset(&target, 0, sizeof(target));
+        memset(&start, 0, sizeof(start));
+        set<int> constants = { 1, 255 }, factors = { 1, 255 };
+        for (size_t i = 0; i < cells.size(); i++) {
+            start.cells[i][i] = 1;
+            auto changed = goal.cells.find(cells[i]);
+            if (changed == goal.cells.end()) {
+                target.cells[i][i] = 1;
+                continue;
+            }
+            writable.push_back((int)i);
+            for (auto term = changed->second.begin(); term != changed->second.end(); ++term) {
+                if (term->first == Loop::Summary::CONSTANT) {
+                    target.cells[i][MAX_CELLS] = term->second;
+                    constants.insert(term->second);
+                    constants.insert(-term->second & 255);
+                    continue;
+                }
+                target.cells[i][index(term->first)] = term->second;
+                factors.insert(term->second);
+                // what a cell has to be multiplied by (and added to itself) to be term->second times itself
+                if (term->first == cells[i] && term->second != 1) factors.insert((term->second - 1) & 255);
+            }
+        }
+        // every instruction it can use
+        for (auto cell = writable.begin(); cell != writable.end(); ++cell) {
+            alphabet.push_back(Instruction(ZERO, *cell));
+            for (auto value = constants.begin(); value != constants.end(); ++value) {
+                alphabet.push_back(Instruction(INCREMENT, *cell, *value));
+                alphabet.push_back(Instruction(SET, *cell, *value));
+            }
+            for (size_t source = 0; source < cells.size(); source++) {
+                for (auto factor = factors.begin(); factor != factors.end(); ++factor) {
+                    alphabet.push_back(Instruction(MULTIPLY, *cell, *factor, (int)source));
+                }
+            }
+        }
+        for (int length = 0; length <= limit; length++) {
+            path.clear();
+            if (!find(start, length)) continue;
+            for (auto it = path.begin(); it != path.end(); ++it) {
+                const Instruction & instruction = alphabet[*it];
+                int offset = cells[instruction.cell];
+                switch (instruction.command) {
+                case ZERO:      best.push_back(new CommandNode(ZERO, 1, offset)); break;
+                case SET:       best.push_back(new CommandNode(SET, 1, offset, instruction.value)); break;
+                case MULTIPLY:  best.push_back(new CommandNode(MULTIPLY, 1, offset, instruction.value, cells[instruction.source])); break;
+                default:
+                    if (instruction.value < 128) best.push_back(new CommandNode(INCREMENT, instruction.value, offset));
+                    else best.push_back(new CommandNode(DECREMENT, 256 - instruction.value, offset));
+                    break;
+                }
+            }
+            if (goal.shift) best.push_back(new CommandNode(goal.shift > 0 ? SHIFT_RIGHT : SHIFT_LEFT, abs(goal.shift)));
+            return true;
+        }
+        return false;
+    }
+
+private:
+    // one instruction, on cells by their place in the window
+    struct Instruction {
+        Instruction(Command command, int cell, int value = 0, int source = -1)
+            : command(command), cell(cell), value(value), source(source) {}
+        Command command;
+        int cell;
+        int value;
+        int source;
+    };
+    // each cell in the window as factors on what the cells held before, then a constant
+    struct Tape {
+        unsigned char cells[MAX_CELLS][MAX_CELLS + 1];
+    };
+
+    int index(int cell) const {
+        return (int)(lower_bound(cells.begin(), cells.end(), cell) - cells.begin());
+    }
+
+    void apply(Tape & tape, const Instruction & instruction) const {
+        unsigned char * cell = tape.cells[instruction.cell];
+        switch (instruction.command) {
+        case ZERO:      memset(cell, 0, MAX_CELLS + 1); break;
+        case SET:       memset(cell, 0, MAX_CELLS + 1); cell[MAX_CELLS] = instruction.value; break;
+        case INCREMENT: cell[MAX_CELLS] += instruction.value; break;
+        default: {
+            unsigned char source[MAX_CELLS + 1];
+            memcpy(source, tape.cells[instruction.source], sizeof(source));
+            for (int i = 0; i <= MAX_CELLS; i++) cell[i] += source[i] * instruction.value;
+            break;
+        }
+        }
+    }
+
+    // is there no point in next right after previous?
+    bool pointless(const Instruction & previous, int last, const Instruction & next, int at) const {
+        bool same = previous.cell == next.cell;
+        if (same && (next.command == ZERO || next.command == SET)) return true;
+        if (same && next.command == INCREMENT && previous.command != MULTIPLY) return true;
+        // they don't touch each other's cells, so one order will do
+        bool apart = !same && previous.source != next.cell && next.source != previous.cell;
+        return apart && at < last;
+    }
+
+    bool find(const Tape & tape, int left) {
+        int wrong = 0;
+        for (auto cell = writable.begin(); cell != writable.end(); ++cell) {
+            if (memcmp(tape.cells[*cell], target.cells[*cell], MAX_CELLS + 1)) wrong++;
+        }
+        if (wrong == 0 && left == 0) return true;
+        if (wrong > left) return false;
+        for (size_t i = 0; i < alphabet.size(); i++) {
+            if (!path.empty() && pointless(alphabet[path.back()], path.back(), alphabet[i], (int)i)) continue;
+            Tape next = tape;
+            apply(next, alphabet[i]);
+            if (!memcmp(next.cells[alphabet[i].cell], tape.cells[alphabet[i].cell], MAX_CELLS + 1)) continue;
+            path.push_back((int)i);
+            if (find(next, left - 1)) return true;
+            path.pop_back();
+        }
+        return false;
+    }
+
+    const Effect & goal;
+    vector<int> cells; // the window: the cells goal uses, lowest first
+    vector<int> writable; // the ones it changes, by their place in cells
+    vector<Instruction> alphabet;
+    Tape start, target;
+    vector<int> path; // what's been tried so far, by place in alphabet
+};
+
+RewriteDatabase & RewriteDatabase::standard() {
+    static RewriteDatabase database;
+    return database;
+}
+
+bool RewriteDatabase::load(const string & file) {
+    ifstream in(file.c_str());
+    if (!in) return false;
+    string line;
+    while (getline(in, line)) {
+        size_t tab = line.find('\t');
+        if (line.empty() || line[0] == '#' || tab == string::npos) continue;
+        string key = line.substr(0, tab), code = line.substr(tab + 1);
+        // only code that does what the key says (and starts on the key's lowest cell) gets in
+        vector<CommandNode *> nodes;
+        if (!read(code, 0, nodes)) continue;
+        Effect effect;
+        for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+            follow(effect, *it);
+            delete *it;
+        }
+        int base;
+        if (describe(effect, base) == key && base == 0) rewrites[key] = code;
+    }
+    return true;
+}
+
+bool RewriteDatabase::save(const string & file) const {
+    ofstream out(file.c_str());
+    for (auto it = rewrites.begin(); it != rewrites.end(); ++it) {
+        out << it->first << '\t' << it->second << '\n';
+    }
+    return (bool)out;
+}
+
+int RewriteDatabase::learn(const Program * program, int length) {
+    return learn((const Container *)program, max(2, min(length, (int)MAX_BLOCK)));
+}
+
+int RewriteDatabase::learn(const Container * container, int length) {
+    int shorter = 0;
+    const vector<Node*> & children = container->children;
+    for (size_t i = 0; i < children.size();) {
+        if (!arithmetic(children[i])) {
+            if (Loop * loop = dynamic_cast<Loop *>(children[i])) shorter += learn(loop, length);
+            i++;
+            continue;
+        }
+        size_t end = i;
+        while (end < children.size() && arithmetic(children[end])) end++;
+        // every stretch of it, up to length long (rewrite tries the longest it can at each place)
+        for (size_t first = i; first < end; first++) {
+            vector<const CommandNode *> block;
+            Effect effect;
+            for (size_t k = first; k < end && k < first + length; k++) {
+                block.push_back((const CommandNode *)children[k]);
+                follow(effect, block.back());
+                if (block.size() < 2) continue;
+                Effect goal = effect;
+                int base;
+                string key = describe(goal, base);
+                if (rewrites.count(key)) continue;
+                vector<CommandNode *> best;
+                Superoptimizer superoptimizer(goal);
+                if (superoptimizer.search((int)block.size() - 1 - (goal.shift != 0), best)) {
+                    rewrites[key] = write(vector<const CommandNode *>(best.begin(), best.end()), base);
+                    for (auto it = best.begin(); it != best.end(); ++it) {
+                        delete *it;
+                    }
+                    shorter++;
+                } else {
+                    // nothing shorter: remember that too, so it doesn't get searched again
+                    rewrites[key] = write(block, base);
+                }
+            }
+        }
+        i = end;
+    }
+    return shorter;
+}
+
+/**
+ * The cells a block is sure to check are on the tape: lowest to highest, from where it starts. false if a MULTIPLY
+ * in it adds somewhere outside those (it only checks there when there's something to add), so we can't be sure.
+ */
+static bool bounds(const vector<const CommandNode *> & block, int & lowest, int & highest) {
+    int at = 0;
+    lowest = highest = 0;
+    vector<int> targets;
+    for (auto it = block.begin(); it != block.end(); ++it) {
+        const CommandNode * leaf = *it;
+        int from = at + leaf->offset, to = from;
+        switch (leaf->command) {
+        case SHIFT_LEFT:    from = to = at -= leaf->count; break;
+        case SHIFT_RIGHT:   from = to = at += leaf->count; break;
+        case SET:           to = from + leaf->count - 1; break;
+        case MULTIPLY:      targets.push_back(from); from = to = at + leaf->source; break;
+        default:            break;
+        }
+        lowest = min(lowest, from);
+        highest = max(highest, to);
+    }
+    for (auto it = targets.begin(); it != targets.end(); ++it) {
+        if (*it < lowest || *it > highest) return false;
+    }
+    return true;
+}
+
+int RewriteDatabase::rewrite(Container * container) const {
+    int changed = 0;
+    vector<Node*> children;
+    for (size_t i = 0; i < container->children.size();) {
+        Node * child = container->children[i];
+        if (!arithmetic(child)) {
+            if (Loop * loop = dynamic_cast<Loop *>(child)) changed += rewrite(loop);
+            children.push_back(child);
+            i++;
+            continue;
+        }
+        // the keys of the blocks starting here
+        size_t end = i;
+        while (end < container->children.size() && end - i < MAX_BLOCK && arithmetic(container->children[end])) end++;
+        vector<string> keys;
+        vector<int> bases;
+        Effect effect;
+        for (size_t k = i; k < end; k++) {
+            follow(effect, (const CommandNode *)container->children[k]);
+            Effect tidy = effect;
+            int base;
+            keys.push_back(describe(tidy, base));
+            bases.push_back(base);
+        }
+        // the longest one we know something shorter for
+        size_t size = keys.size();
+        vector<CommandNode *> nodes;
+        for (; size > 1; size--) {
+            auto found = rewrites.find(keys[size - 1]);
+            if (found == rewrites.end() || !read(found->second, bases[size - 1], nodes)) continue;
+            // the shorter code has to find out it's off the end of the tape exactly when the block would
+            vector<const CommandNode *> block, shorter(nodes.begin(), nodes.end());
+            for (size_t k = i; k < i + size; k++) {
+                block.push_back((const CommandNode *)container->children[k]);
+            }
+            int lowest, highest, shorterLowest, shorterHighest;
+            bool same = bounds(block, lowest, highest) && bounds(shorter, shorterLowest, shorterHighest)
+                && lowest == shorterLowest && highest == shorterHighest;
+            if (nodes.size() < size && same) break;
+            for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+                delete *it;
+            }
+            nodes.clear();
+        }
+        if (size < 2) {
+            children.push_back(child);
+            i++;
+            continue;
+        }
+        for (size_t k = i; k < i + size; k++) {
+            delete container->children[k];
+        }
+        children.insert(children.end(), nodes.begin(), nodes.end());
+        i += size;
+        changed++;
+    }
+    container->children.swap(children);
+    return changed;
+}
+
+int Rewrites::run(Program * program) {
+    return database.size() ? database.rewrite(program) : 0;
+}
+
+/**
+ * An e-graph of what cells hold: classes of terms that are known to be equal. A term is what a cell held before the
+ * block, a constant, the sum of two classes, or a class times a constant, all mod 256. Terms get hash-consed, so
+ * adding one that's there already gives back its class; merging two classes makes the terms built on them the same
+ * too, once rebuild has been.
+ */
+class EGraph {
+public:
+    struct Term {
+        enum Kind { CELL, CONSTANT, SUM, SCALE };
+        Kind kind;
+        int a, b; // the cell, the constant, the two classes, or the class and the factor
+        bool operator<(const Term & other) const {
+            return kind != other.kind ? kind < other.kind : a != other.a ? a < other.a : b < other.b;
+        }
+        bool operator==(const Term & other) const {
+            return kind == other.kind && a == other.a && b == other.b;
+        }
+    };
+
+    EGraph() : terms(0), dirty(false) {}
+
+    int cell(int cell) {
+        return add({ Term::CELL, cell, 0 });
+    }
+    int constant(int value) {
+        return add({ Term::CONSTANT, value & 255, 0 });
+    }
+    // sums and products of constants come out folded, so classes don't fill up with every way of writing 0
+    int sum(int a, int b) {
+        int ka = constantOf(a), kb = constantOf(b);
+        if (ka >= 0 && kb >= 0) return constant(ka + kb);
+        if (kb == 0) return find(a);
+        if (ka == 0) return find(b);
+        return add({ Term::SUM, a, b });
+    }
+    int scale(int a, int factor) {
+        int ka = constantOf(a);
+        if (!(factor & 255)) return constant(0);
+        if (ka >= 0) return constant(ka * factor);
+        if ((factor & 255) == 1) return find(a);
+        return add({ Term::SCALE, a, factor & 255 });
+    }
+
+    // how many classes there have been (merged ones too)
+    int size() const {
+        return (int)parent.size();
+    }
+
+    int find(int id) {
+        while (parent[id] != id) id = parent[id] = parent[parent[id]];
+        return id;
+    }
+
+    // the terms in id's class
+    const vector<Term> & members(int id) {
+        return classes[find(id)];
+    }
+
+    // the constant in id's class, or -1
+    int constantOf(int id) {
+        const vector<Term> & list = members(id);
+        for (auto it = list.begin(); it != list.end(); ++it) {
+            if (it->kind == Term::CONSTANT) return it->a;
+        }
+        return -1;
+    }
+
+    // say a and b are equal. false if we knew.
+    bool merge(int a, int b) {
+        a = find(a);
+        b = find(b);
+        if (a == b) return false;
+        if (classes[a].size() < classes[b].size()) swap(a, b);
+        parent[b] = a;
+        classes[a].insert(classes[a].end(), classes[b].begin(), classes[b].end());
+        classes[b].clear();
+        dirty = true;
+        return true;
+    }
+
+    /**
+     * Apply the rules until they don't find anything new, or there are more than limit terms:
+     * sums commute and associate, constants fold, x + 0 = x, x * 1 = x, x * 0 = 0, (x * f) * g = x * fg,
+     * products distribute over sums (both ways), and x + x, x * f + x and x * f + x * g are products.
+     */
+    void saturate(size_t limit) {
+        for (int round = 0; round < 16 && terms <= limit; round++) {
+            // the rules add to the graph as they go, so go by what's there now
+            vector<pair<int, Term> > all;
+            for (size_t id = 0; id < classes.size(); id++) {
+                for (auto it = classes[id].begin(); it != classes[id].end(); ++it) {
+                    all.push_back(make_pair((int)id, *it));
+                }
+            }
+            bool changed = false;
+            for (auto it = all.begin(); it != all.end() && terms <= limit; ++it) {
+                if (apply(it->first, it->second)) changed = true;
+            }
+            rebuild();
+            if (!changed) break;
+        }
+    }
+
+    // put the hash-consing back together after merges: terms on classes that got merged are the same now
+    void rebuild() {
+        while (dirty) {
+            dirty = false;
+            vector<pair<Term, int> > all;
+            for (size_t id = 0; id < classes.size(); id++) {
+                vector<Term> & list = classes[id];
+                for (auto it = list.begin(); it != list.end(); ++it) {
+                    *it = canonical(*it);
+                }
+                sort(list.begin(), list.end());
+                list.erase(unique(list.begin(), list.end()), list.end());
+                for (auto it = list.begin(); it != list.end(); ++it) {
+                    all.push_back(make_pair(*it, (int)id));
+                }
+            }
+            memo.clear();
+            terms = all.size();
+            for (auto it = all.begin(); it != all.end(); ++it) {
+                auto inserted = memo.insert(make_pair(it->first, it->second));
+                if (!inserted.second) merge(inserted.first->second, it->second);
+            }
+        }
+    }
+
+private:
+    Term canonical(Term term) {
+        if (term.kind == Term::SUM) term.b = find(term.b);
+        if (term.kind == Term::SUM || term.kind == Term::SCALE) term.a = find(term.a);
+        return term;
+    }
+
+    int add(Term term) {
+        term = canonical(term);
+        auto found = memo.find(term);
+        if (found != memo.end()) return find(found->second);
+        int id = (int)parent.size();
+        parent.push_back(id);
+        classes.push_back(vector<Term>(1, term));
+        memo[term] = id;
+        terms++;
+        return id;
+    }
+
+    // the rules, on term (which is in class id). true if they found something new.
+    bool apply(int id, const Term & term) {
+        bool changed = false;
+        if (term.kind == Term::SUM) {
+            int a = term.a, b = term.b;
+            changed |= merge(id, sum(b, a));
+            int ka = constantOf(a), kb = constantOf(b);
+            if (ka >= 0 && kb >= 0) changed |= merge(id, constant(ka + kb));
+            if (kb == 0) changed |= merge(id, a);
+            if (find(a) == find(b)) changed |= merge(id, scale(a, 2));
+            vector<Term> left = members(a), right;
+            for (auto it = members(b).begin(); it != members(b).end(); ++it) {
+                if (it->kind == Term::SCALE) right.push_back(*it);
+            }
+            for (auto it = left.begin(); it != left.end(); ++it) {
+                if (it->kind == Term::SUM) changed |= merge(id, sum(it->a, sum(it->b, b)));
+                if (it->kind != Term::SCALE) continue;
+                if (find(it->a) == find(b)) changed |= merge(id, scale(b, it->b + 1));
+                for (auto other = right.begin(); other != right.end(); ++other) {
+                    if (find(other->a) == find(it->a)) changed |= merge(id, scale(it->a, it->b + other->b));
+                    if (other->b == it->b) changed |= merge(id, scale(sum(it->a, other->a), it->b));
+                }
+            }
+        } else if (term.kind == Term::SCALE) {
+            int a = term.a, factor = term.b;
+            if (factor == 1) changed |= merge(id, a);
+            if (factor == 0) changed |= merge(id, constant(0));
+            int ka = constantOf(a);
+            if (ka >= 0) changed |= merge(id, constant(ka * factor));
+            vector<Term> inner = members(a);
+            for (auto it = inner.begin(); it != inner.end(); ++it) {
+                if (it->kind == Term::SCALE) changed |= merge(id, scale(it->a, it->b * factor));
+                if (it->kind == Term::SUM) changed |= merge(id, sum(scale(it->a, factor), scale(it->b, factor)));
+            }
+        }
+        return changed;
+    }
+
+    vector<int> parent; // union-find over classes
+    vector<vector<Term> > classes; // each class's terms (only kept for the roots)
+    map<Term, int> memo; // every term, and its class (maybe not the root)
+    size_t terms;
+    bool dirty; // merged since the last rebuild?
+};
+
+/**
+ * What a command costs on target, roughly. The Evaluator's visit costs about the same for every node, whatever it
+ * does, and a memset is nearly free on top. Compiled, every command is a statement: an add or a store is one
+ * instruction, a multiply-add three (two for a factor of 1), and a memset is a call that needs a few cells to pay off.
+ */
+static int cost(Target target, Command command, int count = 1, int value = 1) {
+    if (target == INTERPRETER) return 4 + (command == MULTIPLY) + (command == SET ? count / 16 : 0);
+    switch (command) {
+    case MULTIPLY:  return value == 1 ? 2 : 3;
+    case SET:       return count == 1 ? 1 : 4 + count / 16;
+    default:        return 1;
+    }
+}
+
+/**
+ * The cheapest way to get each class into cell (of the ones Term::CELL refers to) with the commands there are:
+ * build, from scratch (where the cell still holds what it did before the block), or add, onto what's there.
+ * Costs go down until they can't go down any more, and choices say which term each came from.
+ */
+struct Extraction {
+    enum { NONE = INT_MAX / 4 };
+
+    Extraction(EGraph & graph, int cell, Target target)
+        : graph(graph), cell(cell), target(target),
+          build(graph.size(), NONE), add(graph.size(), NONE), builds(graph.size(), -1), adds(graph.size(), -1),
+          sources(graph.size(), INT_MIN) {
+        int size = graph.size();
+        // which cell (other than this one) each class is, if it is one: a multiply can read it
+        for (int id = 0; id < size; id++) {
+            if (graph.find(id) != id) continue;
+            const vector<EGraph::Term> & list = graph.members(id);
+            for (auto it = list.begin(); it != list.end(); ++it) {
+                if (it->kind == EGraph::Term::CELL && it->a != cell) sources[id] = it->a;
+            }
+        }
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (int id = 0; id < size; id++) {
+                if (graph.find(id) != id) continue;
+                const vector<EGraph::Term> & list = graph.members(id);
+                for (size_t i = 0; i < list.size(); i++) {
+                    int b = buildCost(list[i]), a = addCost(list[i]);
+                    if (b < build[id]) build[id] = b, builds[id] = (int)i, changed = true;
+                    if (a < add[id]) add[id] = a, adds[id] = (int)i, changed = true;
+                }
+            }
+        }
+    }
+
+    int buildCost(const EGraph::Term & term) {
+        switch (term.kind) {
+        case EGraph::Term::CONSTANT:    return cost(target, term.a ? SET : ZERO);
+        case EGraph::Term::CELL:        return term.a == cell ? 0 : cost(target, ZERO) + cost(target, MULTIPLY);
+        case EGraph::Term::SUM:         return min((int)NONE, build[graph.find(term.a)] + add[graph.find(term.b)]);
+        default:                        return min((int)NONE, build[graph.find(term.a)] + cost(target, MULTIPLY, 1, term.b - 1));
+        }
+    }
+
+    int addCost(const EGraph::Term & term) {
+        switch (term.kind) {
+        case EGraph::Term::CONSTANT:    return term.a ? cost(target, INCREMENT) : 0;
+        case EGraph::Term::CELL:        return term.a == cell ? (int)NONE : cost(target, MULTIPLY);
+        case EGraph::Term::SUM:         return min((int)NONE, add[graph.find(term.a)] + add[graph.find(term.b)]);
+        default:                        return sources[graph.find(term.a)] == INT_MIN ? (int)NONE : cost(target, MULTIPLY, 1, term.b);
+        }
+    }
+
+    // the commands that put id in the cell, from scratch or on top. false if it goes round in circles.
+    bool emit(int id, bool scratch, vector<CommandNode *> & nodes, int depth = 0) {
+        id = graph.find(id);
+        int choice = scratch ? builds[id] : adds[id];
+        if (choice < 0 || depth > 64) return false;
+        EGraph::Term term = graph.members(id)[choice];
+        switch (term.kind) {
+        case EGraph::Term::CONSTANT:
+            if (scratch) nodes.push_back(term.a ? new CommandNode(SET, 1, cell, term.a) : new CommandNode(ZERO, 1, cell));
+            else if (term.a) nodes.push_back(term.a < 128 ? new CommandNode(INCREMENT, term.a, cell) : new CommandNode(DECREMENT, 256 - term.a, cell));
+            return true;
+        case EGraph::Term::CELL:
+            if (term.a == cell) return true;
+            if (scratch) nodes.push_back(new CommandNode(ZERO, 1, cell));
+            nodes.push_back(new CommandNode(MULTIPLY, 1, cell, 1, term.a));
+            return true;
+        case EGraph::Term::SUM:
+            return emit(term.a, scratch, nodes, depth + 1) && emit(term.b, false, nodes, depth + 1);
+        default:
+            if (!scratch) {
+                nodes.push_back(new CommandNode(MULTIPLY, 1, cell, term.b, sources[graph.find(term.a)]));
+                return true;
+            }
+            if (!emit(term.a, true, nodes, depth + 1)) return false;
+            // the cell holds a now, so add it to itself factor - 1 times
+            nodes.push_back(new CommandNode(MULTIPLY, 1, cell, (term.b - 1) & 255, cell));
+            return true;
+        }
+    }
+
+    EGraph & graph;
+    int cell;
+    Target target;
+    vector<int> build, add; // by class
+    vector<int> builds, adds; // the term each cost came from, by place in the class
+    vector<int> sources; // the cell each class is, for a multiply to read (INT_MIN for none)
+};
+
+int EqualitySaturation::run(Program * program) {
+    return saturate(program);
+}
+
+int EqualitySaturation::saturate(Container * container) {
+    int changed = 0;
+    vector<Node*> children;
+    for (size_t i = 0; i < container->children.size();) {
+        Node * child = container->children[i];
+        if (!arithmetic(child)) {
+            if (Loop * loop = dynamic_cast<Loop *>(child)) changed += saturate(loop);
+            children.push_back(child);
+            i++;
+            continue;
+        }
+        size_t end = i;
+        while (end < container->children.size() && arithmetic(container->children[end])) end++;
+        if (end - i == 1) {
+            // one command is as cheap as it gets
+            children.push_back(child);
+            i++;
+            continue;
+        }
+
+        // what each cell ends up holding
+        EGraph graph;
+        map<int, int> cells;
+        auto value = [&](int cell) {
+            auto found = cells.find(cell);
+            return found != cells.end() ? found->second : cells[cell] = graph.cell(cell);
+        };
+        int at = 0, before = 0;
+        for (size_t k = i; k < end; k++) {
+            const CommandNode * leaf = (const CommandNode *)container->children[k];
+            int cell = at + leaf->offset, result;
+            before += cost(target, leaf->command, leaf->count, leaf->value);
+            switch (leaf->command) {
+            case INCREMENT:     result = graph.sum(value(cell), graph.constant(leaf->count)); cells[cell] = result; break;
+            case DECREMENT:     result = graph.sum(value(cell), graph.constant(-leaf->count)); cells[cell] = result; break;
+            case SHIFT_RIGHT:   at += leaf->count; break;
+            case SHIFT_LEFT:    at -= leaf->count; break;
+            case ZERO:          cells[cell] = graph.constant(0); break;
+            case SET:
+                for (int c = 0; c < leaf->count; c++) cells[cell + c] = graph.constant(leaf->value);
+                break;
+            default:
+                result = graph.sum(value(cell), graph.scale(value(at + leaf->source), leaf->value));
+                cells[cell] = result;
+                break;
+            }
+        }
+        graph.rebuild();
+        graph.saturate(2000);
+
+        // the cheapest commands for each cell that changed
+        map<int, vector<CommandNode *> > built;
+        bool works = true;
+        for (auto it = cells.begin(); it != cells.end() && works; ++it) {
+            if (graph.find(it->second) == graph.find(graph.cell(it->first))) continue;
+            Extraction extraction(graph, it->first, target);
+            works = extraction.emit(it->second, true, built[it->first]);
+        }
+        // cells get built before any cell they read gets changed, and cells that don't read anything go last,
+        // where neighbouring sets can become one
+        vector<int> order, last;
+        map<int, set<int> > reads;
+        for (auto it = built.begin(); it != built.end(); ++it) {
+            for (auto node = it->second.begin(); node != it->second.end(); ++node) {
+                if ((*node)->command == MULTIPLY && (*node)->source != it->first && built.count((*node)->source)) {
+                    reads[it->first].insert((*node)->source);
+                }
+            }
+        }
+        set<int> done;
+        while (works && done.size() < built.size()) {
+            // the next cell that nobody left to build still needs to read
+            bool found = false;
+            for (auto it = built.begin(); it != built.end() && !found; ++it) {
+                if (done.count(it->first)) continue;
+                bool needed = false;
+                for (auto other = built.begin(); other != built.end() && !needed; ++other) {
+                    needed = !done.count(other->first) && other->first != it->first && reads[other->first].count(it->first);
+                }
+                if (needed) continue;
+                found = true;
+                done.insert(it->first);
+                bool reader = false;
+                for (auto node = it->second.begin(); node != it->second.end(); ++node) {
+                    reader = reader || (*node)->command == MULTIPLY;
+                }
+                (reader ? order : last).push_back(it->first);
+            }
+            // cells that read each other round in a circle would need somewhere to keep one of them
+            works = found;
+        }
+        vector<Node*> nodes;
+        if (works) {
+            for (auto it = order.begin(); it != order.end(); ++it) {
+                nodes.insert(nodes.end(), built[*it].begin(), built[*it].end());
+                built[*it].clear();
+            }
+            sort(last.begin(), last.end());
+            for (size_t k = 0; k < last.size();) {
+                vector<CommandNode *> & first = built[last[k]];
+                // a run of neighbouring cells each just set to the same value
+                size_t run = 1;
+                int value = first.size() == 1 && first[0]->command != INCREMENT && first[0]->command != DECREMENT ? first[0]->value : -1;
+                while (value >= 0 && k + run < last.size() && last[k + run] == last[k] + (int)run) {
+                    vector<CommandNode *> & next = built[last[k + run]];
+                    if (next.size() != 1 || next[0]->command == INCREMENT || next[0]->command == DECREMENT || next[0]->value != value) break;
+                    run++;
+                }
+                int separate = 0;
+                for (size_t r = 0; r < run; r++) separate += cost(target, built[last[k + r]][0]->command);
+                if (run > 1 && cost(target, SET, (int)run) < separate) {
+                    nodes.push_back(new CommandNode(SET, (int)run, last[k], value));
+                    for (size_t r = 0; r < run; r++) {
+                        delete built[last[k + r]][0];
+                        built[last[k + r]].clear();
+                    }
+                    k += run;
+                    continue;
+                }
+                nodes.insert(nodes.end(), first.begin(), first.end());
+                first.clear();
+                k++;
+            }
+            if (at) nodes.push_back(new CommandNode(at > 0 ? SHIFT_RIGHT : SHIFT_LEFT, abs(at)));
+        }
+        for (auto it = built.begin(); it != built.end(); ++it) {
+            for (auto node = it->second.begin(); node != it->second.end(); ++node) {
+                delete *node;
+            }
+        }
+        int after = 0;
+        vector<const CommandNode *> block, rebuilt;
+        for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+            const CommandNode * leaf = (const CommandNode *)*it;
+            after += cost(target, leaf->command, leaf->count, leaf->value);
+            rebuilt.push_back(leaf);
+        }
+        for (size_t k = i; k < end; k++) {
+            block.push_back((const CommandNode *)container->children[k]);
+        }
+        // like the rewrites pass: the new code has to go off the end of the tape exactly when the block would
+        int lowest, highest, rebuiltLowest, rebuiltHighest;
+        works = works && bounds(block, lowest, highest) && bounds(rebuilt, rebuiltLowest, rebuiltHighest)
+            && lowest == rebuiltLowest && highest == rebuiltHighest;
+        if (!works || after >= before) {
+            for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+                delete *it;
+            }
+            children.insert(children.end(), container->children.begin() + i, container->children.begin() + end);
+            i = end;
+            continue;
+        }
+        for (size_t k = i; k < end; k++) {
+            delete container->children[k];
+        }
+        children.insert(children.end(), nodes.begin(), nodes.end());
+        i = end;
+        changed++;
+    }
+    container->children.swap(children);
+    return changed;
+}
+
+Pass * makePass(const string & name, Target target) {
+    if (name == "peephole") return new Peephole();
+    if (name == "affine-loops") return new AffineLoops();
+    if (name == "idioms") return new Idioms();
+    if (name == "fuse-loops") return new LoopFusion();
+    if (name == "hoist") return new InvariantMotion();
+    if (name == "rewrites") return new Rewrites();
+    if (name == "saturate") return new EqualitySaturation(target);
+    if (name == "multiply-loops") return new MultiplyLoops();
+    if (name == "offsets") return new Offsets();
+    if (name == "fold-runs") return new RunFolding();
+    if (name == "fold-output") return new OutputFolding();
+    if (name == "known-values") return new KnownValues();
+    if (name == "fuse-sets") return new SetFusion();
+    return nullptr;
+}
+
+PassManager::~PassManager() {
+    for (auto it = passes.begin(); it != passes.end(); ++it) {
+        delete *it;
+    }
+}
+
+void PassManager::add(Pass * pass) {
+    passes.push_back(pass);
+}
+
+bool PassManager::add(const string & names) {
+    vector<Pass *> more;
+    stringstream list(names);
+    string name;
+    while (getline(list, name, ',')) {
+        if (name.empty()) continue;
+        Pass * pass = makePass(name, target);
+        if (!pass) {
+            for (auto it = more.begin(); it != more.end(); ++it) {
+                delete *it;
+            }
+            return false;
+        }
+        more.push_back(pass);
+    }
+    passes.insert(passes.end(), more.begin(), more.end());
+    return true;
+}
+
+void PassManager::addLevel(int level) {
+    add(LEVELS[max(0, min(level, (int)MAX_LEVEL))]);
+}
+
+int PassManager::run(Program * program) {
+    int changed = 0;
+    reports.clear();
+    for (auto it = passes.begin(); it != passes.end(); ++it) {
+        auto start = chrono::steady_clock::now();
+        Report report;
+        report.name = (*it)->name();
+        report.changed = (*it)->run(program);
+        report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        reports.push_back(report);
+        changed += report.changed;
+    }
+    return changed;
+}
+
+bool runPasses(const string & names, Program * program) {
+    PassManager manager;
+    if (!manager.add(names)) return false;
+    manager.run(program);
+    return true;
+}
+
+} // namespace brainfuck
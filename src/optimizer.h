@@ -0,0 +1,376 @@
+/*
+= optimizer
+
+Passes that rewrite a parsed Program into one that does the same thing in fewer steps.
+Each pass changes the tree in place and says how many nodes it changed.
+The engines run the result like any other tree.
+
+----
+#include "optimizer.h"
+
+brainfuck::Program program;
+brainfuck::parse(file, &program);
+brainfuck::runPasses("fold-output", &program);
+----
+*/
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "brainfuck.h"
+
+namespace brainfuck {
+
+// what a pass optimizes for, where that makes a difference: the Evaluator walking the tree, or the C the Compiler writes
+enum Target { INTERPRETER, COMPILED };
+
+// a rewrite of the whole tree
+class Pass {
+public:
+    virtual ~Pass() {}
+    // what we call it (in --passes and reports)
+    virtual const char * name() const = 0;
+    // rewrite program in place, and return how many nodes changed
+    virtual int run(Program * program) = 0;
+};
+
+class KnownCells;
+
+/**
+ * Run folding: parse only merges runs of the same character, so ++-+- is still four nodes and ><>< four moves.
+ * This folds any mix of + and - (on the same cell) into one net add, wrapping at 256, and any mix of < and >
+ * into one net move. Runs that come to nothing go away, which can let their neighbours fold together too.
+ * (So a program that only steps off the end of the tape and straight back, like <> on the first cell, doesn't stop there.)
+ */
+class RunFolding : public Pass {
+public:
+    const char * name() const { return "fold-runs"; }
+    int run(Program * program);
+private:
+    int fold(Container * container);
+};
+
+/**
+ * Output folding: a . that prints a cell we can work out ahead of time becomes a PRINT of that byte,
+ * and the PRINTs in a stretch of straight-line code get merged into one write (but not across a move that
+ * could go off the end of the tape, so a program that stops there has printed what it did before).
+ * Cell values are followed through the commands between loops, the way KnownValues does it.
+ * The arithmetic stays: later code may still need the cells.
+ */
+class OutputFolding : public Pass {
+public:
+    const char * name() const { return "fold-output"; }
+    int run(Program * program);
+private:
+    int fold(Container * container, KnownCells & known);
+};
+
+/**
+ * Known-value propagation: follow what we know about the cells (all 0 at the start of the program,
+ * the loop cell 0 after every loop) and use it to throw away loops that can never run, and ZEROs and SETs
+ * of cells that already hold that value. That gets rid of comment loops at the top of a program and loops right after loops.
+ * Loops that come back to where they started only spoil the cells they touch; other loops spoil everything.
+ */
+class KnownValues : public Pass {
+public:
+    const char * name() const { return "known-values"; }
+    int run(Program * program);
+private:
+    int propagate(Container * container, KnownCells & known);
+};
+
+/**
+ * Set fusion: a clear followed by + or - ([-]+++) is just a SET of the cell to a constant, and a stretch
+ * of clears and sets with moves in between ([-]>[-]>++++) turns into SETs at offsets from the pointer plus one move.
+ * Neighbouring cells set to the same value share one SET, which the engines do with memset.
+ */
+class SetFusion : public Pass {
+public:
+    const char * name() const { return "fuse-sets"; }
+    int run(Program * program);
+private:
+    int fuse(Container * container);
+};
+
+/**
+ * Multiply loops: a loop that only adds to cells and comes back to where it started, taking its own cell
+ * down (or up) by an odd amount each time, runs a number of times we can work out from its cell.
+ * So [->+++>++<<] is just "add 3 times this cell to the next one, 2 times to the one after, and clear it":
+ * MULTIPLYs and a ZERO, no matter how big the cell is. A body that goes further out than the cells it adds to stays a loop.
+ */
+class MultiplyLoops : public Pass {
+public:
+    const char * name() const { return "multiply-loops"; }
+    int run(Program * program);
+private:
+    int rewrite(Container * container);
+};
+
+/**
+ * Affine loops: a loop that comes back to where it started and does the same sums every time around
+ * can skip to the end. n comes from the loop's cell: with an odd step it's always there (which is what
+ * MultiplyLoops uses), and with an even step 2^k * odd it's there when the cell is a multiple of 2^k
+ * (otherwise the loop never stops). The body gets worked out symbolically: each cell it changes as a sum of
+ * what cells held before. Clears, sets, multiplies and inner multiply loops are all fine, as long as what's
+ * left adds the same thing every time around. Cells it sets to a constant are only different the first time,
+ * so that one gets done on its own. So nests like [>[>+>+<<-]>>[<<+>>-]<<<-] (a = b * c) take no time at all.
+ * This pass doesn't rewrite anything: it gives each such loop a Loop::Summary, and the engines skip to the end
+ * when they can and go around when they can't. It goes last, so nothing moves the loops around afterwards.
+ */
+class AffineLoops : public Pass {
+public:
+    const char * name() const { return "affine-loops"; }
+    int run(Program * program);
+private:
+    int summarize(Container * container);
+};
+
+/**
+ * Loop fusion: generated code likes to copy a cell and then count each copy down in a loop of its own
+ * ([->+>+<<]>[-...]>[-...]). Loops right next to each other (with only moves between) that go around the same
+ * number of times, because their cells held the same value and step the same, and that keep out of each other's
+ * cells, can go around together: one loop, one test per time around. At most one of them can do I/O, and
+ * everything they go to has to be on the tape already, so neither can find out it's off the end at a different time.
+ */
+class LoopFusion : public Pass {
+public:
+    const char * name() const { return "fuse-loops"; }
+    int run(Program * program);
+private:
+    int fuse(Container * container, KnownCells & known);
+};
+
+/**
+ * Invariant motion: a [-] or set in a loop body, of a cell nothing else in the body changes, puts the same
+ * thing there every time around. So it only needs doing the first time: [X rest] becomes [X [rest]],
+ * which does X once if the loop runs at all, then goes around without it. (Only when nothing before X in the
+ * body prints, reads or loops, since X now finds out first if it's off the end of the tape.)
+ */
+class InvariantMotion : public Pass {
+public:
+    const char * name() const { return "hoist"; }
+    int run(Program * program);
+private:
+    int hoist(Container * container);
+};
+
+/**
+ * Idioms: the well-known brainfuck algorithms that take thousands of steps, spotted by their shape and done
+ * natively: divmod by a cell (the esolangs wiki's, which printing a number in decimal is built on) and by a
+ * constant (how 99botles splits a number into digits). Comparisons are ifs ([...[-]]), which AffineLoops does.
+ * An idiom gives its loop a Loop::Summary, with the conditions it needs on the cells (the scratch cells are 0,
+ * say), so the engines go around the slow way when they don't hold. tests.cpp checks every summary against
+ * its loop on every value of the loop's cell. Idioms need to see loops as they were written, so this goes early.
+ */
+class Idioms : public Pass {
+public:
+    const char * name() const { return "idioms"; }
+    int run(Program * program);
+private:
+    int recognize(Container * container);
+};
+
+/**
+ * Offsets: between loops, there's no need to actually move the pointer around. Commands get the offset
+ * of their cell from where the pointer was, and the moves add up to one move at the end (before a loop,
+ * which needs the pointer on its cell). >+>++<<- becomes +@1 ++@2 -.
+ * (Like fold-runs, that means going off the end of the tape stops the program only where a command or the move lands.)
+ */
+class Offsets : public Pass {
+public:
+    const char * name() const { return "offsets"; }
+    int run(Program * program);
+private:
+    int fold(Container * container);
+};
+
+/**
+ * A peephole rule: code that looks like pattern becomes replacement.
+ * Patterns are brainfuck where each command can have a count after it: a number, or a letter that matches
+ * any count (the same letter has to match the same count everywhere). "[->a+b<a]" matches [->>+++<<].
+ * Runs of a command without counts are one command with the run's length, the way the parser sees them: >> is >2.
+ * Replacements are instructions separated by ;, with numbers or letters (maybe with a - in front) for arguments:
+ * ZERO [offset], SET value [offset], SCAN stride, MULTIPLY offset factor.
+ */
+struct PeepholeRule {
+    const char * pattern;
+    const char * replacement;
+};
+
+/**
+ * Peephole: rewrites whatever matches a rule in its table ([-] to ZERO, [->+<] to a move, [>] to SCAN, and so on).
+ * New idioms are just new rules. The patterns get compiled into a trie, so one walk down the code from
+ * each node tries every rule at once; the longest match wins.
+ */
+class Peephole : public Pass {
+public:
+    // starts with the standard rules
+    Peephole();
+    const char * name() const { return "peephole"; }
+    // add a rule. false (and nothing added) if the pattern or the replacement doesn't make sense.
+    bool add(const std::string & pattern, const std::string & replacement);
+    int run(Program * program);
+private:
+    // a number or a variable (-1 for none) in a replacement
+    struct Argument {
+        int number;
+        int variable;
+        bool negate;
+    };
+    struct Instruction {
+        Command command;
+        std::vector<Argument> arguments;
+    };
+    // where we are in the trie: the states after each command and count (-1 for variable a, -2 for b...),
+    // and the rule (if any) that matches here
+    struct State {
+        State() : rule(-1) {}
+        ~State();
+        std::map<std::pair<char, int>, State *> next;
+        int rule;
+    };
+    // a match, or how far one has got: where it ends, which rule, and what its variables matched
+    struct Match {
+        Match() : end(0), rule(-1) {
+            memset(values, 0, sizeof(values));
+        }
+        size_t end;
+        int rule;
+        int values[26];
+    };
+
+    void match(const std::vector<std::pair<char, int> > & tokens, size_t at, const State * state,
+               const std::vector<bool> & boundary, Match & best, Match & current) const;
+    int rewrite(Container * container);
+
+    State root;
+    std::vector<std::vector<Instruction> > replacements; // by rule
+};
+
+/**
+ * The rewrite database: the shortest code the superoptimizer has found for blocks of straight-line code
+ * (adds, moves, clears, sets and multiplies, between loops and I/O), kept in a file from one run to the next.
+ * What a block does is affine mod 256: it moves the pointer some distance, and leaves each cell it changes
+ * holding factors times what cells held before, plus a constant. That's the key (with the cells counted from
+ * the lowest one it uses, so the same block somewhere else on the tape is the same key). Same key, same effect:
+ * that's how the superoptimizer proves what it finds, and how load checks every line it reads.
+ *
+ * A line of the file is a key, a tab and the code: instructions separated by ;, out of ADD amount offset,
+ * ZERO offset, SET value offset [count], MULTIPLY offset factor source and MOVE distance.
+ */
+class RewriteDatabase {
+public:
+    // the longest block anything gets looked up (or searched) for
+    enum { MAX_BLOCK = 8 };
+
+    // the one the rewrites pass uses, unless it's given another (the driver fills it in with --rewrites)
+    static RewriteDatabase & standard();
+
+    // add the rewrites in file. false if it can't be read; lines that don't check out get skipped.
+    bool load(const std::string & file);
+    // write every rewrite to file. false if it can't be written.
+    bool save(const std::string & file) const;
+    // search every stretch of straight-line code in program (up to length commands) that isn't in here yet
+    // for something shorter, and keep what comes out either way. returns how many got shorter.
+    int learn(const Program * program, int length);
+    // swap blocks in container for the shorter code we know for them. returns how many got swapped.
+    int rewrite(Container * container) const;
+
+    size_t size() const {
+        return rewrites.size();
+    }
+
+private:
+    int learn(const Container * container, int length);
+
+    std::map<std::string, std::string> rewrites; // what a block does -> the shortest code we know that does it
+};
+
+/**
+ * Rewrites: swaps blocks of straight-line code for shorter ones out of a RewriteDatabase
+ * (brainfuck.exe --superoptimize fills one in ahead of time). With an empty database it does nothing.
+ * Only when the shorter code is sure to go as far out either way as the block, so it goes off the end of the tape
+ * exactly when the block would.
+ */
+class Rewrites : public Pass {
+public:
+    Rewrites(const RewriteDatabase & database = RewriteDatabase::standard()) : database(database) {}
+    const char * name() const { return "rewrites"; }
+    int run(Program * program);
+private:
+    const RewriteDatabase & database;
+};
+
+/**
+ * Equality saturation: the passes above each rewrite straight-line code one way, so what comes out depends on
+ * the order they go in. This puts what every cell of a block ends up holding into an e-graph (classes of terms
+ * known to be equal), applies the rules of sums and products mod 256 until nothing new comes out (or it gets
+ * too big), and then picks the cheapest way to build each cell out of everything it's equal to: adds, clears,
+ * sets and multiply-adds at offsets, sets fused into one memset, and one move at the end. Cheapest depends on the
+ * engine: the Evaluator pays for every node it visits, so fewer, bigger nodes win, while compiled C pays for the
+ * stores and multiplies themselves, and a memset only pays off for a few cells. A block only gets swapped when
+ * that comes out cheaper than what's there, and goes as far out either way (like Rewrites).
+ */
+class EqualitySaturation : public Pass {
+public:
+    EqualitySaturation(Target target = INTERPRETER) : target(target) {}
+    const char * name() const { return "saturate"; }
+    int run(Program * program);
+private:
+    int saturate(Container * container);
+
+    Target target;
+};
+
+// a new pass called name (for the caller to delete), or nullptr if there's no such pass
+Pass * makePass(const std::string & name, Target target = INTERPRETER);
+
+/**
+ * Runs a list of passes in order, timing each one and counting what it changed.
+ * The optimization levels are ready-made lists: -O0 leaves the tree as parsed, -O1 folds runs,
+ * -O2 also does idioms, peephole rules, multiply loops, offsets, loop fusion and hoisting, clears and sets and
+ * affine loops, and -O3 uses the rewrite database, saturates blocks (for the target) and folds output too
+ * (the driver works out the prelude at -O3 as well).
+ */
+class PassManager {
+public:
+    enum { MAX_LEVEL = 3 };
+
+    // what one pass did
+    struct Report {
+        std::string name;
+        double seconds;
+        int changed;
+    };
+
+    // passes added by name optimize for target
+    PassManager(Target target = INTERPRETER) : target(target) {}
+    ~PassManager();
+
+    // add a pass to the end of the list (we delete it)
+    void add(Pass * pass);
+    // add a comma separated list of passes by name. false (and none added) if one doesn't exist.
+    bool add(const std::string & names);
+    // add the passes for an optimization level, 0 to MAX_LEVEL
+    void addLevel(int level);
+
+    // run the passes over program, in order, and return how many nodes they changed
+    int run(Program * program);
+
+    // what each pass did in the last run
+    const std::vector<Report> & getReports() const {
+        return reports;
+    }
+
+private:
+    Target target;
+    std::vector<Pass *> passes;
+    std::vector<Report> reports;
+};
+
+// run a comma separated list of passes over program, in order. false (and nothing run) if one doesn't exist.
+bool runPasses(const std::string & names, Program * program);
+
+} // namespace brainfuck
+
+#endif
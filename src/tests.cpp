@@ -0,0 +1,1563 @@
+/*
+= Tests
+
+On a POSIX system with gcc (and cc, for the Compiler's C), build the library first (see brainfuck.cpp), then:
+
+----
+g++ -std=c++11 -pthread -o tests.exe tests.cpp libbrainfuck.a
+tests.exe [DIR]
+----
+
+DIR is where the .bf files are; it defaults to the directory this file was compiled from. It says what went
+wrong, if anything, and exits with 1 if it did.
+
+The tests get at the driver's parts (batch, the benchmarks, the generator) by including brainfuck.cpp, with its main
+renamed out of the way.
+*/
+
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <string>
+#include <new>
+#include <sstream>
+#include <random>
+
+#define main brainfuckMain
+#include "brainfuck.cpp"
+#undef main
+
+static int failures = 0;
+static string dir; // where the .bf files are
+
+void fail(const string & what) {
+    if (failures++ < 20) cout << "FAIL " << what << endl;
+}
+
+// everything left in file, from where it is now
+string contents(FILE * file) {
+    string result;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) result.append(buffer, n);
+    return result;
+}
+
+// parse one of the .bf files here. false if it isn't there.
+bool load(const string & name, Program * program) {
+    fstream file((dir + "/" + name).c_str(), fstream::in);
+    if (!file) {
+        fail(name + ": No such file.");
+        return false;
+    }
+    parse(file, program);
+    return true;
+}
+
+// what program prints when the Evaluator runs it on input
+string evaluated(Program * program, const string & input) {
+    FILE * in = tmpfile(), * out = tmpfile();
+    fwrite(input.data(), 1, input.size(), in);
+    rewind(in);
+    {
+        Evaluator eval(30000, in, out);
+        program->accept(&eval);
+    }
+    rewind(out);
+    string printed = contents(out);
+    fclose(in);
+    fclose(out);
+    return printed;
+}
+
+/**
+ * What program prints when the Compiler's C for it (with a step budget and a prelude, if there are any) runs on input,
+ * built with $CC (or cc), and how it exited. false if it won't build.
+ */
+bool compiled(Program * program, const string & input, string & printed, unsigned long long budget = 0, int * status = nullptr,
+              const Prelude * prelude = nullptr) {
+    char scratch[] = "/tmp/bftests-XXXXXX";
+    if (!mkdtemp(scratch)) return false;
+    string dir = scratch;
+    {
+        ofstream c((dir + "/program.c").c_str());
+        Compiler compile(c, budget, prelude);
+        program->accept(&compile);
+    }
+    ofstream((dir + "/input").c_str()) << input;
+    const char * cc = getenv("CC");
+    string build = string(cc ? cc : "cc") + " -O1 -o " + dir + "/program " + dir + "/program.c";
+    bool built = system(build.c_str()) == 0;
+    if (built) {
+        FILE * out = popen((dir + "/program < " + dir + "/input").c_str(), "r");
+        printed = contents(out);
+        int exited = pclose(out);
+        if (status) *status = WIFEXITED(exited) ? WEXITSTATUS(exited) : -1;
+    }
+    remove((dir + "/program.c").c_str());
+    remove((dir + "/program").c_str());
+    remove((dir + "/input").c_str());
+    rmdir(dir.c_str());
+    return built;
+}
+
+// the two engines the benchmark compares have to agree on what its workloads print
+void testEngines() {
+    const char * workloads[] = { "helloworld.bf", "99botles.bf", "bench/hanoi.bf", "bench/mandelbrot.bf", "bench/numbers.bf" };
+    for (const char * name : workloads) {
+        Program program;
+        if (!load(name, &program)) continue;
+        string expected = evaluated(&program, ""), printed;
+        if (expected.size() < 2) fail(string(name) + ": the Evaluator printed nothing");
+        if (!compiled(&program, "", printed)) fail(string(name) + ": the Compiler's C didn't build");
+        else if (printed != expected) fail(string(name) + ": the Compiler's C printed something else");
+    }
+}
+
+void testParseSize() {
+    const char * texts[] = { "", "12", "512K", "3k", "16M", "2g" };
+    const unsigned long long sizes[] = { 0, 12, 512 << 10, 3 << 10, 16 << 20, 2ull << 30 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (parseSize(texts[i]) != sizes[i]) fail(string("parseSize(\"") + texts[i] + "\")");
+    }
+}
+
+// generated sources are (about) as big as asked, nest no deeper than asked, and the same seed gives the same source
+void testGenerate() {
+    const unsigned long long sizes[] = { 1000, 200000 };
+    for (unsigned long long size : sizes) {
+        for (int depth = 0; depth <= 3; depth++) {
+            string sources[2];
+            for (int k = 0; k < 2; k++) {
+                FILE * out = tmpfile();
+                generate(out, size, depth, k ? 0 : 0.25, 4, 42);
+                rewind(out);
+                sources[k] = contents(out);
+                fclose(out);
+            }
+            string name = "generate(" + to_string(size) + ", depth " + to_string(depth) + ")";
+            if (sources[0].size() < size || sources[0].size() > size + (1 << 16) + depth) fail(name + ": wrong size");
+            int open = 0, deepest = 0;
+            for (char c : sources[0]) {
+                if (c == '[') deepest = max(deepest, ++open);
+                if (c == ']' && --open < 0) break;
+            }
+            if (open != 0 || deepest > depth) fail(name + ": unbalanced or too deep");
+            if (sources[1].find_first_not_of("+-<>[].,") != string::npos) fail(name + ": comments it wasn't asked for");
+
+            FILE * again = tmpfile();
+            generate(again, size, depth, 0.25, 4, 42);
+            rewind(again);
+            if (contents(again) != sources[0]) fail(name + ": not the same twice");
+            fclose(again);
+        }
+    }
+}
+
+// allocations are only counted while they point at a counter
+void testAllocations() {
+    unsigned long long counted = 0;
+    allocations = &counted;
+    Program * program = new Program();
+    allocations = nullptr;
+    delete new Program();
+    delete program;
+    if (counted != 1) fail("allocations: counted " + to_string(counted) + ", not 1");
+}
+
+// an engine that does nothing but exit with status
+class ExitEngine : public Engine {
+public:
+    ExitEngine(int status) : status(status) {}
+    const char * name() const { return "exit"; }
+    bool prepare(Program *) { return true; }
+    void run() { _exit(status); }
+private:
+    int status;
+};
+
+// samples say whether the child exited cleanly, and counters we can't read say so (as null) instead of making things up
+void testSamples() {
+    if (jsonCounter(-1) != "null" || jsonCounter(1234) != "1234") fail("jsonCounter");
+    long long unread[Counters::COUNT];
+    Counters().read(unread);
+    for (long long value : unread) if (value != -1) fail("Counters: read a counter that was never attached");
+
+    Program program;
+    if (!load("helloworld.bf", &program)) return;
+    EvaluatorEngine evaluator;
+    ExitEngine failing(3);
+    evaluator.prepare(&program);
+    Sample good = runSample(evaluator), bad = runSample(failing);
+    if (!good.ok || bad.ok) fail("runSample: wrong exit status");
+    if (good.seconds <= 0 || good.peakKb <= 0) fail("runSample: no time or memory");
+    for (long long value : good.counters) if (value < -1) fail("runSample: a negative counter");
+    if (good.counters[Counters::INSTRUCTIONS] == 0) fail("runSample: ran no instructions");
+}
+
+// the name of a new scratch file with text in it (remove it when you're done)
+string scratchFile(const string & text) {
+    char name[] = "/tmp/bftests-XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0 || write(fd, text.data(), text.size()) != (ssize_t)text.size()) fail("couldn't write a scratch file");
+    if (fd >= 0) close(fd);
+    return name;
+}
+
+void parse(const string & source, Program * program) {
+    parse(source.data(), source.size(), program);
+}
+
+/**
+ * Run program with a tape of memory cells, budget steps at a time (0 means all at once), until it stops.
+ * Says how it stopped, how many times it paused on the way, and what it printed.
+ */
+Evaluator::Status sliced(Program * program, int memory, unsigned long long budget, int & pauses, string & printed) {
+    FILE * out = tmpfile();
+    Evaluator::Status status;
+    {
+        Evaluator eval(memory, stdin, out);
+        pauses = 0;
+        while ((status = eval.run(program, budget)) == Evaluator::PAUSED) pauses++;
+        if (eval.run(program, budget) != status) fail("run: didn't stay stopped");
+    }
+    rewind(out);
+    printed = contents(out);
+    fclose(out);
+    return status;
+}
+
+// running a bit at a time prints the same as running all at once, and going off the tape stops the run
+void testBudget() {
+    const char * programs[] = { "helloworld.bf", "99botles.bf" };
+    for (const char * name : programs) {
+        Program program;
+        if (!load(name, &program)) continue;
+        string expected = evaluated(&program, ""), printed;
+        int pauses;
+        for (unsigned long long budget : { 1, 7, 100 }) {
+            if (sliced(&program, 30000, budget, pauses, printed) != Evaluator::FINISHED || printed != expected || !pauses) {
+                fail(string(name) + ": wrong with a budget of " + to_string(budget));
+            }
+        }
+        string compiledOut;
+        int status = 0;
+        if (!compiled(&program, "", compiledOut, 100, &status) || status != 3) fail(string(name) + ": compiled budget didn't run out");
+        if (!compiled(&program, "", compiledOut, 1ull << 40, &status) || status != 0 || compiledOut != expected) {
+            fail(string(name) + ": compiled with a budget to spare");
+        }
+    }
+
+    const struct { const char * source; int memory; Evaluator::Status status; const char * printed; } runs[] = {
+        { "<", 10, Evaluator::OUT_OF_BOUNDS, "" },
+        { ">>>>>>>>><<<<<<<<<", 10, Evaluator::FINISHED, "\n" },
+        { ">>>>>>>>>>", 10, Evaluator::OUT_OF_BOUNDS, "" },
+        { "+++++++++++++++++++++++++++++++++.[>+]", 100, Evaluator::OUT_OF_BOUNDS, "!" },
+        { "+[-<+]", 100, Evaluator::OUT_OF_BOUNDS, "" },
+    };
+    for (auto & run : runs) {
+        Program program;
+        parse(run.source, &program);
+        string printed;
+        int pauses;
+        for (unsigned long long budget : { 0, 5 }) {
+            if (sliced(&program, run.memory, budget, pauses, printed) != run.status || printed != run.printed) {
+                fail(string(run.source) + ": wrong status or output with a budget of " + to_string(budget));
+            }
+        }
+    }
+}
+
+// wait (a while) until the scheduler has count runs parked
+bool parks(Scheduler & scheduler, int count) {
+    for (int i = 0; i < 5000 && scheduler.parked() != count; i++) this_thread::sleep_for(chrono::milliseconds(1));
+    return scheduler.parked() == count;
+}
+
+// runs take turns, a run waiting on input parks until it's fed, and every run comes back with how it stopped
+void testScheduler() {
+    const char * names[] = { "helloworld.bf", "99botles.bf" };
+    Program programs[2];
+    string expected[2];
+    for (int i = 0; i < 2; i++) {
+        if (!load(names[i], &programs[i])) return;
+        BufferIO io;
+        Evaluator eval(30000, &io);
+        eval.run(&programs[i]);
+        expected[i] = io.output;
+    }
+    {
+        // more runs than workers, in small slices, so they all have to take turns
+        Scheduler scheduler(3, 1000);
+        vector<int> ids;
+        for (int i = 0; i < 40; i++) ids.push_back(scheduler.spawn(&programs[i % 2]));
+        for (int i = 0; i < 40; i++) {
+            Evaluator::Status status = Evaluator::PAUSED;
+            if (scheduler.wait(ids[i], &status) != expected[i % 2] || status != Evaluator::FINISHED) {
+                fail("Scheduler: run " + to_string(i) + " went wrong");
+            }
+        }
+        if (scheduler.wait(ids[0]) != "") fail("Scheduler: waited for a run twice");
+    }
+    {
+        // a run that never ends doesn't keep the only worker from the others
+        Program forever, echo, offTape;
+        parse("+[]", &forever);
+        parse(",+[-.,+]", &echo);
+        parse("+[>+]", &offTape);
+        Scheduler scheduler(1, 100, 100);
+        scheduler.spawn(&forever);
+        if (scheduler.wait(scheduler.spawn(&programs[0])) != expected[0]) fail("Scheduler: a run didn't get a turn");
+
+        // input comes in bits, and the run parks in between
+        int id = scheduler.spawn(&echo, "ab", false);
+        if (!parks(scheduler, 1)) fail("Scheduler: a run waiting on input didn't park");
+        scheduler.feed(id, "cd");
+        if (!parks(scheduler, 1)) fail("Scheduler: a fed run didn't park again");
+        scheduler.feed(id, "e", true);
+        Evaluator::Status status = Evaluator::PAUSED;
+        if (scheduler.wait(id, &status) != "abcde\n" || status != Evaluator::FINISHED) fail("Scheduler: fed input went astray");
+        if (scheduler.parked() != 0) fail("Scheduler: parked runs left over");
+
+        // going off the tape is the end of the run, too
+        if (scheduler.wait(scheduler.spawn(&offTape), &status) != "" || status != Evaluator::OUT_OF_BOUNDS) {
+            fail("Scheduler: a run that went off the tape");
+        }
+    }
+}
+
+// every job runs, once
+void testThreadPool() {
+    atomic<int> total(0);
+    vector<atomic<int> > runs(1000);
+    {
+        ThreadPool pool(4);
+        for (size_t i = 0; i < runs.size(); i++) {
+            pool.submit([&, i] {
+                runs[i]++;
+                total++;
+            });
+        }
+    }
+    if (total != 1000) fail("ThreadPool: ran " + to_string(total) + " jobs, not 1000");
+    for (auto & count : runs) if (count != 1) fail("ThreadPool: a job ran " + to_string(count) + " times");
+}
+
+// what batch() prints on cout and cerr, and what it returns
+int batched(const vector<string> & files, int workers, bool stream, unsigned long long budget, string & out, string & err) {
+    stringstream outs, errs;
+    streambuf * oldOut = cout.rdbuf(outs.rdbuf()), * oldErr = cerr.rdbuf(errs.rdbuf());
+    int status = batch(files, workers, stream, budget);
+    cout.rdbuf(oldOut);
+    cerr.rdbuf(oldErr);
+    out = outs.str();
+    err = errs.str();
+    return status;
+}
+
+// with more files than workers, everything still comes back, in argument order (or all of it, streamed)
+void testBatch() {
+    const char * names[] = { "helloworld.bf", "99botles.bf" };
+    string offTape = scratchFile("+[>+]");
+    vector<string> files;
+    map<string, string> expected;
+    for (int i = 0; i < 12; i++) {
+        string file = dir + "/" + names[i % 2];
+        Program program;
+        if (!load(names[i % 2], &program)) return;
+        expected[file] = evaluated(&program, "");
+        files.push_back(file);
+    }
+    string out, err, want;
+    for (auto & file : files) want += "==> " + file + " <==\n" + expected[file];
+    if (batched(files, 3, false, 0, out, err) != 0 || out != want || !err.empty()) fail("batch: wrong output, or out of order");
+    if (batched(files, 3, true, 0, out, err) != 0 || out.size() != want.size()) fail("batch: wrong output, streamed");
+    for (auto & file : files) {
+        if (out.find("==> " + file + " <==\n" + expected[file]) == string::npos) fail("batch: " + file + " missing, streamed");
+    }
+
+    // files that aren't there, go off the tape or run out of steps are reported, and fail the batch
+    files.insert(files.begin() + 5, offTape);
+    files.insert(files.begin() + 2, dir + "/nonexistent.bf");
+    if (batched(files, 3, false, 0, out, err) != 1 || err.find("nonexistent.bf: No such file.") == string::npos
+        || err.find(offTape + ": Went off the end of the tape.") == string::npos || err.find("Ran out of steps") != string::npos) {
+        fail("batch: didn't report the bad files");
+    }
+    if (batched(files, 2, false, 1000, out, err) != 1 || err.find("99botles.bf: Ran out of steps.") == string::npos) {
+        fail("batch: didn't report running out of steps");
+    }
+    remove(offTape.c_str());
+}
+
+// execute() runs a source straight from memory, through a string or through callbacks, on as many threads as you like
+void testExecute() {
+    Program program;
+    if (!load("99botles.bf", &program)) return;
+    string expected = evaluated(&program, "");
+    ifstream file((dir + "/99botles.bf").c_str());
+    string source((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    RunResult result = execute(source.data(), source.size(), "");
+    if (result.status != Evaluator::FINISHED || result.output != expected || !result.steps) fail("execute: wrong result");
+    RunResult paused = execute(source.data(), source.size(), "", 1000);
+    if (paused.status != Evaluator::PAUSED || paused.output != expected.substr(0, paused.output.size())) fail("execute: with a budget");
+    if (execute("+[<+]", 5, "", 0, 100).status != Evaluator::OUT_OF_BOUNDS) fail("execute: off the tape");
+
+    // input a byte at a time (blocking once in a while), output in chunks
+    const char * echo = ",+[-.,+]";
+    string input = "Hello!", printed;
+    size_t next = 0;
+    int calls = 0;
+    auto read = [&]() -> int {
+        if (++calls % 3 == 0) return IO::BLOCKED;
+        return next < input.size() ? (unsigned char)input[next++] : EOF;
+    };
+    auto write = [&](const char * data, size_t length) { printed.append(data, length); };
+    RunResult blocked = execute(echo, strlen(echo), read, write);
+    if (blocked.status != Evaluator::BLOCKED || printed != "He") fail("execute: callbacks that block");
+    printed.clear();
+    next = 0;
+    calls = 1;
+    auto steady = [&]() -> int { return next < input.size() ? (unsigned char)input[next++] : EOF; };
+    if (execute(echo, strlen(echo), steady, write).status != Evaluator::FINISHED || printed != "Hello!\n") fail("execute: callbacks");
+
+    // no shared state: runs on separate threads don't get in each other's way
+    vector<thread> threads;
+    vector<string> outputs(8);
+    for (size_t i = 0; i < outputs.size(); i++) {
+        threads.push_back(thread([&, i] { outputs[i] = execute(source.data(), source.size(), "").output; }));
+    }
+    for (auto & t : threads) t.join();
+    for (auto & output : outputs) if (output != expected) fail("execute: wrong output on a thread");
+}
+
+void testDigests() {
+    const struct { size_t as; const char * digest; } digests[] = {
+        { 0, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+        { 55, "9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318" },
+        { 56, "b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a" },
+        { 63, "7d3e74a05d7db15bce4ad9ec0658ea98e3f06eeecf16b4c6fff2da457ddc2f34" },
+        { 64, "ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb" },
+        { 65, "635361c48bb9eab14198e76ea8ab7f1a41685d6ad62aa9146d301d4f17eb0ae0" },
+        { 119, "31eba51c313a5c08226adf18d4a359cfdfd8d2e816b13f4af952f7ea6584dcfb" },
+        { 120, "2f3d335432c70b580af0e8e1b3674a7c020d683aa5f73aaaedfdc55af904c21c" },
+        { 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+    };
+    for (auto & digest : digests) {
+        string as(digest.as, 'a');
+        if (digestSource(as.data(), as.size()) != digest.digest) fail("digestSource of " + to_string(digest.as) + " a's");
+    }
+    if (digestSource("abc", 3) != "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") fail("digestSource of abc");
+}
+
+// a cache hit is the same program, and the least recently used program goes first
+void testProgramCache() {
+    ProgramCache cache(2);
+    string a = cache.add("+.", 2), b = cache.add("-.", 2);
+    shared_ptr<const Program> first = cache.find(a);
+    if (!first || cache.add("+.", 2) != a || cache.find(a) != first || cache.size() != 2) fail("ProgramCache: a hit");
+    string c = cache.add(">.", 2);
+    if (cache.find(b) || !cache.find(a) || !cache.find(c) || cache.size() != 2) fail("ProgramCache: evicted the wrong one");
+    if (cache.find(digestSource("-.", 2)) || cache.find("") || first->children.size() != 2) fail("ProgramCache: found what isn't there");
+}
+
+// however deep loops nest, parsing them and throwing them away takes no more stack than flat code
+void testDeepNesting() {
+    string open(2000000, '['), balanced = open + string(2000000, ']');
+    Program unclosed, closed;
+    parse(open, &unclosed);
+    parse(balanced, &closed);
+    const Container * inner = &closed;
+    int depth = 0;
+    while (inner->children.size() == 1 && (inner = dynamic_cast<const Loop *>(inner->children[0]))) depth++;
+    if (depth != 2000000 || unclosed.children.size() != 1) fail("parse: lost some loops nested deep");
+    if (execute(balanced.data(), balanced.size(), "").status != Evaluator::FINISHED) fail("execute: nested deep");
+}
+
+// one request to the daemon on fd, and the first line of what it says back (after any OUT chunks, which go in printed)
+string request(int fd, const string & header, const string & body, string * printed = nullptr) {
+    string line;
+    if (!writeFully(fd, header + "\n") || !writeFully(fd, body) || !readLine(fd, line)) return "";
+    while (line.compare(0, 4, "OUT ") == 0) {
+        string chunk(strtoul(line.c_str() + 4, nullptr, 10), '\0');
+        if (!readFully(fd, &chunk[0], chunk.size()) || !readLine(fd, line)) return "";
+        if (printed) *printed += chunk;
+    }
+    return line;
+}
+
+// LOAD, RUN, MISS and ERR, straight through serveClient
+void testServe() {
+    Program program;
+    if (!load("helloworld.bf", &program)) return;
+    string expected = evaluated(&program, "");
+    ifstream file((dir + "/helloworld.bf").c_str());
+    string source((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    ProgramCache cache;
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        fail("serve: no socketpair");
+        return;
+    }
+    thread server(serveClient, fds[1], &cache, 100000, 4 << 20);
+    int fd = fds[0];
+    string digest = digestSource(source.data(), source.size());
+    if (request(fd, "RUN " + digest + " 0", "") != "MISS " + digest) fail("serve: RUN before LOAD");
+    if (request(fd, "LOAD " + to_string(source.size()), source) != "OK " + digest) fail("serve: LOAD");
+
+    string printed, line = request(fd, "RUN " + digest + " 0", "", &printed);
+    if (printed != expected || line.compare(0, 13, "END finished ") != 0) fail("serve: RUN");
+
+    const struct { const char * source; const char * end; } runs[] = {
+        { "+[]", "END paused " }, { "+[<+]", "END out-of-bounds " }, { ",[-],.", "END finished " },
+    };
+    for (auto & run : runs) {
+        string length = to_string(strlen(run.source));
+        request(fd, "LOAD " + length, run.source);
+        line = request(fd, "RUN " + digestSource(run.source, strlen(run.source)) + " 1", "x");
+        if (line.compare(0, strlen(run.end), run.end) != 0) fail(string("serve: ") + run.source + " said " + line);
+    }
+
+    // as deep as you like, but no bigger than the limit
+    string deep(3 << 20, '[');
+    if (request(fd, "LOAD " + to_string(deep.size()), deep).compare(0, 3, "OK ") != 0) fail("serve: LOAD nested deep");
+    if (request(fd, "LOAD " + to_string((4 << 20) + 1), "") != "ERR too big") fail("serve: LOAD too big");
+    server.join();
+    close(fd);
+    if (cache.size() != 5) fail("serve: cached " + to_string(cache.size()) + " programs, not 5");
+}
+
+// what run writes to stdout, and what it returns (fork-server children write straight to our fd 1, so swap that for a file)
+int printedBy(function<int()> run, string & out) {
+    stringstream errs;
+    streambuf * oldErr = cerr.rdbuf(errs.rdbuf());
+    fflush(stdout);
+    FILE * capture = tmpfile();
+    int saved = dup(1);
+    dup2(fileno(capture), 1);
+    int status = run();
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+    cerr.rdbuf(oldErr);
+    rewind(capture);
+    out = contents(capture);
+    fclose(capture);
+    return status;
+}
+
+// one run per line, in order, with more lines than children at once
+void testForkServer() {
+    string echo = scratchFile(",+[-.,+]"), offTape = scratchFile("+[>+]"), lines, expected;
+    for (int i = 0; i < 20; i++) {
+        lines += "line " + to_string(i) + "\n";
+        expected += "line " + to_string(i) + "\n"; // the Evaluator ends every finished run with one
+    }
+    string inputs = scratchFile(lines), out;
+    auto forkServed = [&](const string & program, const string & inputs, unsigned long long prelude = 0,
+                          const Optimization & optimization = Optimization()) {
+        return printedBy([&]() { return forkServer(program, inputs, 3, 100000, prelude, optimization); }, out);
+    };
+    if (forkServed(echo, inputs) != 0 || out != expected) fail("fork-server: echo printed " + out);
+    string greet = scratchFile("++++++++[>++++++++<-]>+.,+[-.,+]"); // prints A, then echoes
+    string greeted;
+    for (size_t at = 0; at < expected.size(); at = expected.find('\n', at) + 1) greeted += "A" + expected.substr(at, expected.find('\n', at) + 1 - at);
+    if (forkServed(greet, inputs, 1000) != 0 || out != greeted) fail("fork-server: with a prelude, printed " + out);
+    Optimization o3;
+    o3.level = 3;
+    if (forkServed(greet, inputs, PRELUDE_STEPS, o3) != 0 || out != greeted) fail("fork-server: at -O3, printed " + out);
+    remove(greet.c_str());
+    if (forkServed(offTape, inputs) != 1) fail("fork-server: runs off the tape didn't fail");
+    if (forkServed(echo, "/nonexistent") != 1) fail("fork-server: no inputs file");
+    remove(echo.c_str());
+    remove(offTape.c_str());
+    remove(inputs.c_str());
+}
+
+// reset() clears everything the last run touched, either side of where it started, and any fault
+void testReset() {
+    Program dirty, clean, offTape;
+    parse("+>++>+++<<<-", &dirty); // off the left end, once it's made a mess on the right
+    parse(">.>.<<.", &clean);
+    parse("+[>+]", &offTape);
+    BufferIO io;
+    Evaluator eval(30000, &io);
+    if (eval.run(&dirty) != Evaluator::OUT_OF_BOUNDS) fail("reset: didn't go off the left end");
+    eval.reset();
+    if (eval.run(&clean) != Evaluator::FINISHED || io.output != string(3, '\0') + "\n") fail("reset: the tape is still dirty");
+    eval.reset();
+    if (eval.run(&offTape) != Evaluator::OUT_OF_BOUNDS) fail("reset: didn't run off the tape");
+    io.reset();
+    eval.reset();
+    if (eval.run(&clean) != Evaluator::FINISHED || io.output != string(3, '\0') + "\n") fail("reset: the far end is still dirty");
+}
+
+// --each gives the same output as one run per input, split on newlines or NULs, with --memo or without
+void testEach() {
+    string echo = scratchFile(",+[-.,+]"), offTape = scratchFile("+[>+]");
+    string lines = scratchFile("one\ntwo\n\nthree\n"), records = scratchFile(string("one\ntwo\0three", 13)), out;
+    Program program;
+    parse(",+[-.,+]", &program);
+    string linesOut, recordsOut;
+    for (const char * input : { "one", "two", "", "three" }) linesOut += evaluated(&program, input);
+    recordsOut = evaluated(&program, "one\ntwo") + evaluated(&program, "three");
+    for (bool memo : { false, true }) {
+        string how = memo ? "each --memo: " : "each: ";
+        if (printedBy([&]() { return each(echo, lines, false, memo, 0); }, out) != 0 || out != linesOut) fail(how + "lines printed " + out);
+        if (printedBy([&]() { return each(echo, records, true, memo, 0); }, out) != 0 || out != recordsOut) fail(how + "records printed " + out);
+        if (printedBy([&]() { return each(offTape, lines, false, memo, 0); }, out) != 1) fail(how + "runs off the tape didn't fail");
+    }
+    remove(echo.c_str());
+    remove(offTape.c_str());
+    remove(lines.c_str());
+    remove(records.c_str());
+}
+
+/**
+ * Run program on input a slice of budget steps at a time, saving a snapshot after each slice and carrying on
+ * in a new Evaluator restored from it, as if it moved to another machine every time. What did it print?
+ */
+string hopped(Program * program, const string & input, unsigned long long budget, int & hops) {
+    string printed;
+    unique_ptr<BufferIO> io(new BufferIO(input));
+    unique_ptr<Evaluator> eval(new Evaluator(30000, io.get()));
+    for (hops = 0; eval->run(program, budget) == Evaluator::PAUSED; hops++) {
+        stringstream snapshot;
+        eval->save(snapshot, program);
+        printed += io->output;
+        unique_ptr<BufferIO> nextIO(new BufferIO(input.substr(eval->getInputPosition())));
+        unique_ptr<Evaluator> next(new Evaluator(30000, nextIO.get()));
+        if (!next->restore(snapshot, program)) {
+            fail("snapshot: didn't restore after " + to_string(eval->getSteps()) + " steps");
+            return printed;
+        }
+        eval = move(next);
+        io = move(nextIO);
+    }
+    return printed + io->output;
+}
+
+// a run that hops from snapshot to snapshot prints what it would have all at once, and bad snapshots don't restore
+void testSnapshots() {
+    Program bottles, echo;
+    if (!load("99botles.bf", &bottles)) return;
+    parse(",+[-.,+]", &echo);
+    int hops;
+    if (hopped(&bottles, "", 5000, hops) != evaluated(&bottles, "") || hops < 10) fail("snapshot: 99botles came out different");
+    string input = "a few bytes of input";
+    if (hopped(&echo, input, 7, hops) != evaluated(&echo, input) || hops < 10) fail("snapshot: echo came out different");
+
+    BufferIO io(input);
+    Evaluator eval(30000, &io);
+    eval.run(&echo, 50);
+    stringstream saved;
+    eval.save(saved, &echo);
+    string snapshot = saved.str();
+    auto restores = [&](const string & data, Program * program, int memory) {
+        stringstream in(data);
+        Evaluator other(memory, &io);
+        return other.restore(in, program);
+    };
+    if (!restores(snapshot, &echo, 30000)) fail("snapshot: didn't restore");
+    for (size_t length = 0; length < snapshot.size(); length++) {
+        if (restores(snapshot.substr(0, length), &echo, 30000)) fail("snapshot: restored " + to_string(length) + " bytes of it");
+    }
+    for (size_t at = 0; at < 6; at++) { // the magic number, the version and the fingerprint
+        string corrupt = snapshot;
+        corrupt[at] ^= 0x01;
+        if (restores(corrupt, &echo, 30000)) fail("snapshot: restored with byte " + to_string(at) + " corrupted");
+    }
+    if (restores(snapshot, &bottles, 30000)) fail("snapshot: restored into another program");
+    if (restores(snapshot, &echo, 100)) fail("snapshot: restored onto a smaller tape");
+
+    // --run stops at the end of the tape instead of going round again
+    string offTape = scratchFile("+[>+]"), out;
+    if (printedBy([&]() { return runFile(offTape, "", "", 0, 0, Optimization()); }, out) != 1) fail("--run: kept going off the tape");
+    remove(offTape.c_str());
+}
+
+// runs through a PrefixCache come out just like runs from scratch, whatever the stride, budget or room it has
+void testPrefixCache() {
+    const char * sources[] = { ",+[-.,+]", ">,+[>,+]<[-.<]" }; // echo, and backwards
+    const char * words[] = { "app", "apple", "apples", "applesauce", "apply", "", "band", "bandana", "band", "apple" };
+    for (const char * source : sources) {
+        Program program;
+        parse(source, &program);
+        const struct { size_t maxBytes; int stride; unsigned long long budget; } caches[] = {
+            { 1 << 20, 1, 0 }, { 1 << 20, 4, 0 }, { 1 << 20, 1, 60 }, { 2000, 1, 0 },
+        };
+        for (auto & c : caches) {
+            PrefixCache cache(c.maxBytes, c.stride);
+            for (const char * word : words) {
+                RunResult cached = cache.run(&program, word, c.budget);
+                RunResult plain = execute(source, strlen(source), word, c.budget);
+                if (cached.status != plain.status || cached.output != plain.output || cached.steps != plain.steps) {
+                    fail(string("prefix cache: ") + source + " on \"" + word + "\" came out different, stride "
+                        + to_string(c.stride) + ", budget " + to_string(c.budget) + ", " + to_string(c.maxBytes) + " bytes");
+                }
+            }
+            if (!cache.getSkipped()) fail("prefix cache: never skipped anything, stride " + to_string(c.stride));
+            if (cache.getBytes() > c.maxBytes) fail("prefix cache: took " + to_string(cache.getBytes()) + " bytes");
+        }
+    }
+}
+
+/**
+ * Starting from a prelude, whole or cut short by its budget, prints what running from the top does,
+ * in the Evaluator and in the Compiler's C.
+ */
+void testPrelude() {
+    Program bottles;
+    if (!load("99botles.bf", &bottles)) return;
+    Prelude whole = evaluatePrelude(&bottles, 0);
+    if (!whole.finished || whole.output != evaluated(&bottles, "") || whole.steps != countSteps(&bottles)) fail("prelude: 99botles");
+
+    const char * sources[] = { "++++++++[>++++++++<-]>+.,+[-.,+]", "+++[>+++[>+++<-]<-]>>.<<,+[-.,+]", ",." };
+    string input = "some input";
+    for (const char * source : sources) {
+        Program program;
+        parse(source, &program);
+        string expected = evaluated(&program, input);
+        for (unsigned long long budget : { 0, 1, 20 }) {
+            Prelude prelude = evaluatePrelude(&program, budget);
+            if (prelude.finished) fail(string("prelude: ") + source + " finished without reading");
+            BufferIO io(input);
+            Evaluator eval(30000, &io);
+            if (!eval.start(prelude, &program) || eval.run(&program) != Evaluator::FINISHED || io.output != expected) {
+                fail(string("prelude: ") + source + " came out different, budget " + to_string(budget));
+            }
+            string printed;
+            if (!compiled(&program, input, printed, 0, nullptr, &prelude) || printed != expected) {
+                fail(string("prelude: ") + source + " compiled came out different, budget " + to_string(budget));
+            }
+        }
+    }
+    Program offTape;
+    parse("+<,.", &offTape);
+    Prelude none = evaluatePrelude(&offTape, 0);
+    if (none.steps || !none.output.empty() || !none.position.empty()) fail("prelude: went off the tape and kept it");
+
+    // the benchmark counts the prelude's steps apart from the ones it times
+    EvaluatorEngine plain, ahead(true);
+    plain.prepare(&bottles);
+    ahead.prepare(&bottles);
+    if (plain.skipped() || ahead.skipped() != whole.steps) fail("prelude: the benchmark's +prelude steps");
+}
+
+// how many command nodes of one kind program has, loops and all
+int commands(const Container * container, Command command) {
+    int count = 0;
+    for (const Node * child : container->children) {
+        if (const CommandNode * leaf = dynamic_cast<const CommandNode *>(child)) count += leaf->command == command;
+        else count += commands((const Container *)child, command);
+    }
+    return count;
+}
+
+// a program prints the same after fold-output, in the Evaluator and in the Compiler's C, and . folds where it should
+void testOutputFolding() {
+    const char * names[] = { "helloworld.bf", "99botles.bf" };
+    for (const char * name : names) {
+        Program plain, folded;
+        if (!load(name, &plain) || !load(name, &folded)) continue;
+        if (!runPasses("fold-output", &folded)) fail("fold-output: no such pass");
+        string expected = evaluated(&plain, ""), printed;
+        if (evaluated(&folded, "") != expected) fail(string("fold-output: ") + name + " printed something else");
+        if (!compiled(&folded, "", printed) || printed != expected) fail(string("fold-output: ") + name + " compiled printed something else");
+    }
+
+    const struct { const char * source; int prints; } runs[] = {
+        { "++++++++[>++++++++<-]+++.+.>.", 1 }, // after a loop, only its own cell is known
+        { "+++++.>,.<.", 2 }, // input comes between them
+        { "+++++[.-].", 1 }, // inside a loop, nothing is
+        { ">+++.<.>>,[.>]<.", 1 },
+    };
+    for (auto & run : runs) {
+        Program plain, folded;
+        parse(run.source, &plain);
+        parse(run.source, &folded);
+        runPasses("fold-output", &folded);
+        if (commands(&folded, PRINT) != run.prints) fail(string("fold-output: ") + run.source + " has " + to_string(commands(&folded, PRINT)) + " PRINTs");
+        if (evaluated(&folded, "xyz") != evaluated(&plain, "xyz")) fail(string("fold-output: ") + run.source + " printed something else");
+    }
+    // a PRINT doesn't jump ahead of a move off the end of the tape; moves back inside what's been seen are fine
+    Program edge;
+    parse("+.>>>>>>>>>>+.", &edge);
+    runPasses("fold-output", &edge);
+    BufferIO io("");
+    Evaluator eval(10, &io);
+    if (eval.run(&edge) != Evaluator::OUT_OF_BOUNDS || io.output != "\x01") fail("fold-output: printed past the end of the tape");
+    Program inside;
+    parse("+.>>>++.<<.>>.", &inside);
+    runPasses("fold-output", &inside);
+    if (commands(&inside, PRINT) != 2) fail("fold-output: moves back over seen cells split the PRINTs");
+
+    // the fingerprint tells PRINTs apart by what they print
+    Program three, four;
+    parse("+++.", &three);
+    parse("++++.", &four);
+    runPasses("fold-output", &three);
+    runPasses("fold-output", &four);
+    for (Program * program : { &three, &four }) { // leave just the PRINTs
+        delete program->children.front();
+        program->children.erase(program->children.begin());
+    }
+    if (fingerprint(&three) == fingerprint(&four)) fail("fold-output: the fingerprint doesn't cover PRINT text");
+    Program program;
+    if (runPasses("fold-output,no-such-pass", &program)) fail("fold-output: ran a pass that doesn't exist");
+}
+
+// how many loops program has, all the way down
+int loops(const Container * container) {
+    int count = 0;
+    for (const Node * child : container->children) {
+        if (!dynamic_cast<const CommandNode *>(child)) count += 1 + loops((const Container *)child);
+    }
+    return count;
+}
+
+// known-values throws away the loops and ZEROs that can't do anything, and nothing else; parse makes the ZEROs
+void testKnownValues() {
+    const struct { const char * source; int zeros, loops; } parsed[] = {
+        { "[-]", 1, 0 }, { "[+]", 1, 0 }, { "[---]", 1, 0 }, { "[--]", 0, 1 }, { "[[-]]", 1, 1 }, { "[>]", 0, 1 },
+    };
+    for (auto & run : parsed) {
+        Program program;
+        parse(run.source, &program);
+        if (commands(&program, ZERO) != run.zeros || loops(&program) != run.loops) fail(string("parse: ") + run.source + " came out wrong");
+    }
+
+    const struct { const char * source; int zeros, loops; } passes[] = {
+        { "[a comment, with . and , in it]+[-]", 1, 0 }, // the comment loop never runs
+        { "+[>+<-][-]>.", 0, 1 }, // after a loop its cell is 0
+        { "+>+<[->+<]>[-]<[>]", 1, 1 }, // a balanced loop only spoils what it touches... so the cell it stopped on stays 0
+        { "+>+<[>]>[-]", 1, 1 }, // ...but after one that isn't, nothing's known but its own cell
+        { ",[-]", 1, 0 },
+    };
+    for (auto & run : passes) {
+        Program plain, known;
+        parse(run.source, &plain);
+        parse(run.source, &known);
+        runPasses("known-values", &known);
+        if (commands(&known, ZERO) != run.zeros || loops(&known) != run.loops) {
+            fail(string("known-values: ") + run.source + " has " + to_string(commands(&known, ZERO)) + " ZEROs and "
+                + to_string(loops(&known)) + " loops");
+        }
+        if (evaluated(&known, "xyz") != evaluated(&plain, "xyz")) fail(string("known-values: ") + run.source + " printed something else");
+    }
+
+    const char * names[] = { "helloworld.bf", "99botles.bf", "bench/hanoi.bf" };
+    for (const char * name : names) {
+        Program plain, known;
+        if (!load(name, &plain) || !load(name, &known)) continue;
+        runPasses("known-values,fold-output", &known);
+        if (evaluated(&known, "") != evaluated(&plain, "")) fail(string("known-values: ") + name + " printed something else");
+    }
+}
+
+// how program stops, and what it prints, on a tape of memory cells
+Evaluator::Status ran(Program * program, const string & input, int memory, string & printed) {
+    BufferIO io(input);
+    Evaluator eval(memory, &io);
+    Evaluator::Status status = eval.run(program);
+    printed = io.output;
+    return status;
+}
+
+// what the Printer writes for program
+string printed(Program * program) {
+    stringstream out;
+    streambuf * old = cout.rdbuf(out.rdbuf());
+    Printer printer;
+    program->accept(&printer);
+    cout.rdbuf(old);
+    return out.str();
+}
+
+// fuse-sets turns clear/add/move runs into SETs without changing what happens, even at the ends of the tape
+void testSetFusion() {
+    const struct { const char * source; int sets; } runs[] = {
+        { "[-]+++.", 1 },
+        { "+[-]>[-]>[-]<<.>.>.", 1 }, // one 3-cell fill
+        { "+[-]>[-]++>[-]<<.>.>.", 3 },
+        { ",[-]-->+++<.>.", 1 }, // the + is on a cell the run didn't set, so it ends the run
+        { ",>,<[-]>[-]+<<+>.>.", 2 },
+        { "+[>[-]+++<-]>.", 1 },
+        { ">>>>>>>>>[-]+>><<[-].", 0 }, // goes off the end of a 10-cell tape in the middle
+        { ">>>>>>>>[-]+.>[-]>[-]", 2 }, // sets a cell off the end
+        { "[-]<<[-]>>", 2 },
+    };
+    for (auto & run : runs) {
+        Program plain, fused;
+        parse(run.source, &plain);
+        parse(run.source, &fused);
+        runPasses("fuse-sets", &fused);
+        if (commands(&fused, SET) != run.sets) fail(string("fuse-sets: ") + run.source + " has " + to_string(commands(&fused, SET)) + " SETs");
+        string expected, got;
+        for (int memory : { 30000, 10 }) {
+            Evaluator::Status status = ran(&plain, "ab", memory, expected);
+            if (ran(&fused, "ab", memory, got) != status || got != expected) {
+                fail(string("fuse-sets: ") + run.source + " ran differently on " + to_string(memory) + " cells");
+            }
+        }
+        Program reprinted;
+        parse(printed(&fused), &reprinted);
+        if (evaluated(&reprinted, "ab") != evaluated(&plain, "ab")) fail(string("fuse-sets: ") + run.source + " printed as " + printed(&fused));
+    }
+
+    // a SET of cells that already hold its value goes, but not one that could be the first to go off the tape
+    Program known, edge;
+    parse("+[-]>[-]+++.[-]+++.", &known);
+    runPasses("fuse-sets,known-values", &known);
+    if (commands(&known, SET) != 2) fail("known-values: kept a SET that didn't change anything");
+    parse("[-]<<<[-]>>>.", &edge);
+    runPasses("fuse-sets,known-values", &edge);
+    string out;
+    if (ran(&edge, "", 30000, out) != Evaluator::OUT_OF_BOUNDS) fail("known-values: dropped a SET off the end of the tape");
+    // and a PRINT doesn't jump ahead of a SET off the end of the tape
+    Program printing;
+    parse("+.>>>>>>>>>>[-]+<<<<<<<<<<.", &printing);
+    runPasses("fuse-sets,fold-output", &printing);
+    if (ran(&printing, "", 10, out) != Evaluator::OUT_OF_BOUNDS || out != "\x01") fail("fold-output: printed past a SET off the tape");
+
+    const char * names[] = { "99botles.bf", "bench/hanoi.bf" };
+    for (const char * name : names) {
+        Program plain, fused;
+        if (!load(name, &plain) || !load(name, &fused)) continue;
+        runPasses("known-values,fuse-sets,fold-output", &fused);
+        string expected = evaluated(&plain, ""), compiledOut;
+        if (evaluated(&fused, "") != expected) fail(string("fuse-sets: ") + name + " printed something else");
+        if (!compiled(&fused, "", compiledOut) || compiledOut != expected) fail(string("fuse-sets: ") + name + " compiled printed something else");
+    }
+}
+
+// the commands in a program, as command/count pairs, loops in brackets
+string listed(const Container * container) {
+    string list;
+    for (const Node * child : container->children) {
+        const CommandNode * leaf = dynamic_cast<const CommandNode *>(child);
+        list += leaf ? to_string(leaf->command) + "x" + to_string(leaf->count) + " " : "[ " + listed((const Container *)child) + "] ";
+    }
+    return list;
+}
+
+// fold-runs nets out mixed + - and < > runs, and the program does what it did
+void testRunFolding() {
+    const struct { const char * source; const char * folded; } runs[] = {
+        { "++-+-><><+><+", "+++" },
+        { "+++--->><<", "" },
+        { ">>><", ">>" },
+        { "+>-<-", "+>-<-" }, // on different cells
+        { ",[+-]-[><++]", ",[]-[++]" },
+    };
+    for (auto & run : runs) {
+        Program folded, expected;
+        parse(run.source, &folded);
+        parse(run.folded, &expected);
+        runPasses("fold-runs", &folded);
+        if (listed(&folded) != listed(&expected)) fail(string("fold-runs: ") + run.source + " came out as " + printed(&folded));
+    }
+    Program wrap;
+    parse(string(200, '+') + string(3, '-') + ".", &wrap);
+    runPasses("fold-runs", &wrap);
+    const CommandNode * net = dynamic_cast<const CommandNode *>(wrap.children[0]);
+    if (!net || net->command != DECREMENT || net->count != 59) fail("fold-runs: 197 +s didn't come out as 59 -s");
+    else if (evaluated(&wrap, "") != string(1, (char)197) + "\n") fail("fold-runs: 197 +s printed something else");
+
+    const char * names[] = { "99botles.bf", "bench/hanoi.bf" };
+    for (const char * name : names) {
+        Program plain, folded;
+        if (!load(name, &plain) || !load(name, &folded)) continue;
+        runPasses("fold-runs", &folded);
+        if (evaluated(&folded, "") != evaluated(&plain, "")) fail(string("fold-runs: ") + name + " printed something else");
+    }
+}
+
+// a pass leaves what a program prints, and where it stops, the same as the plain program, even at the ends of a 10-cell tape
+void sameRuns(const string & passes, const char * source, Program * plain, Program * optimized) {
+    string expected, got;
+    for (int memory : { 30000, 10 }) {
+        Evaluator::Status status = ran(plain, "ab", memory, expected);
+        if (ran(optimized, "ab", memory, got) != status || got != expected) {
+            fail(passes + ": " + source + " ran differently on " + to_string(memory) + " cells");
+        }
+    }
+}
+
+// multiply-loops turns add-and-come-back loops into MULTIPLYs
+void testMultiplyLoops() {
+    const struct { const char * source; int multiplies; } runs[] = {
+        { "+++++[->+++>++<<]>.>.", 2 },
+        { "-[+>+<]>.", 1 }, // once round
+        { "+++[->-<]>.", 1 }, // times -1
+        { "+++[--->+<]>.", 1 }, // 3 * 171 = 1 (mod 256), so once round
+        { "++++[-->+<]>.", 0 }, // even steps might never get to 0
+        { "++[>++[->+<]<-]>>.", 1 },
+        { "+[->>><<+<]", 0 }, // goes further than it adds
+        { "+[>+<-]", 1 },
+        { ">>>>>>>>>[->+<].", 1 }, // never runs, so never goes off a 10-cell tape
+        { ">>>>>>>>>+[->+<].", 1 }, // does
+        { "+[-<+>]", 1 }, // off the left end
+    };
+    for (auto & run : runs) {
+        Program plain, multiplied;
+        parse(run.source, &plain);
+        parse(run.source, &multiplied);
+        runPasses("multiply-loops", &multiplied);
+        if (commands(&multiplied, MULTIPLY) != run.multiplies) {
+            fail(string("multiply-loops: ") + run.source + " has " + to_string(commands(&multiplied, MULTIPLY)) + " MULTIPLYs");
+        }
+        sameRuns("multiply-loops", run.source, &plain, &multiplied);
+        string expected, got;
+        if (ran(&plain, "", 30000, expected) == Evaluator::FINISHED && (!compiled(&multiplied, "", got) || got != expected)) {
+            fail(string("multiply-loops: ") + run.source + " compiled printed " + got);
+        }
+    }
+}
+
+// offsets takes the moves out of straight-line code
+void testOffsets() {
+    Program moved;
+    parse(">+>++<<-", &moved);
+    runPasses("offsets", &moved);
+    if (moved.children.size() != 3 || commands(&moved, SHIFT_RIGHT) || commands(&moved, SHIFT_LEFT)) {
+        fail("offsets: >+>++<<- came out as " + printed(&moved));
+    }
+    const char * sources[] = {
+        ">+>++<<-.>.>.",
+        "+[>+>+<<-]>>.",
+        ",>,<.>.", // input at an offset
+        "++>+++[<.>-]>>.", // the move before a loop
+        ">>>>>>>>>>+", // lands off the end of a 10-cell tape
+        ">>>>>>>>>.>.<<<<<<<<<<.", // prints off the end
+        "+>>>>>>>>>>[-]", // the loop's cell is off the end
+        "<+",
+    };
+    for (const char * source : sources) {
+        Program plain, offset;
+        parse(source, &plain);
+        parse(source, &offset);
+        runPasses("offsets", &offset);
+        sameRuns("offsets", source, &plain, &offset);
+        Program reprinted;
+        parse(printed(&offset), &reprinted);
+        sameRuns("offsets (printed)", source, &plain, &reprinted);
+    }
+}
+
+// every level runs programs the way -O0 does, in the Evaluator and compiled
+void testLevels() {
+    const char * sources[] = {
+        "+++++[->+++>++<<]>.>.[-]+++.>>>>>>>>>[-]+.",
+        "[-]>[-]++>+++[-<+>]<<.>.",
+        ",[>+++[->++<]<-]>>.",
+        ">>>>>>>>[-]+.>[-]>[-]",
+        "+[->>>>>>>>>>+<<<<<<<<<<]",
+    };
+    for (const char * source : sources) {
+        for (int level = 0; level <= PassManager::MAX_LEVEL; level++) {
+            for (int target = INTERPRETER; target <= COMPILED; target++) {
+                Program plain, optimized;
+                parse(source, &plain);
+                parse(source, &optimized);
+                PassManager manager((Target)target);
+                manager.addLevel(level);
+                manager.run(&optimized);
+                sameRuns("-O" + to_string(level) + (target == COMPILED ? " for the Compiler" : ""), source, &plain, &optimized);
+            }
+        }
+    }
+
+    const char * names[] = { "99botles.bf", "bench/hanoi.bf" };
+    for (const char * name : names) {
+        Program plain;
+        if (!load(name, &plain)) continue;
+        string expected = evaluated(&plain, "");
+        for (int level = 1; level <= PassManager::MAX_LEVEL; level++) {
+            // the Evaluator runs what's optimized for it, and the Compiler what's optimized for it
+            Program forEvaluator, forCompiler;
+            load(name, &forEvaluator);
+            load(name, &forCompiler);
+            PassManager interpreter(INTERPRETER), compiler(COMPILED);
+            interpreter.addLevel(level);
+            compiler.addLevel(level);
+            if (!interpreter.run(&forEvaluator) || !compiler.run(&forCompiler)) fail(string("-O") + to_string(level) + ": didn't change " + name);
+            string compiledOut;
+            if (evaluated(&forEvaluator, "") != expected) fail(string("-O") + to_string(level) + ": " + name + " printed something else");
+            if (!compiled(&forCompiler, "", compiledOut) || compiledOut != expected) {
+                fail(string("-O") + to_string(level) + ": " + name + " compiled printed something else");
+            }
+        }
+    }
+
+    // one report per pass, and a list with a pass that doesn't exist adds none of it
+    PassManager manager;
+    manager.addLevel(2);
+    if (manager.add("offsets,no-such-pass")) fail("PassManager: added a pass that doesn't exist");
+    Program program;
+    parse("+++[->+<]>.", &program);
+    manager.run(&program);
+    if (manager.getReports().size() != 11) fail("PassManager: -O2 made " + to_string(manager.getReports().size()) + " reports");
+
+    // the options the driver takes
+    const char * args[] = { "brainfuck.exe", "-O2", "--passes", "offsets", "--report", "--budget" };
+    Optimization optimization;
+    int parsed = 0;
+    for (int i = 1; i < 6; i++) parsed += optimization.parse(6, (char **)args, i);
+    if (parsed != 3 || optimization.level != 2 || optimization.passes != "offsets" || !optimization.report) {
+        fail("Optimization: didn't parse -O2 --passes offsets --report");
+    }
+}
+
+// peephole swaps idioms for the commands that do them, from its rule table
+void testPeephole() {
+    const struct { const char * source; Command command; int count; } runs[] = {
+        { "+++[-].", ZERO, 1 },
+        { "+++[+].", ZERO, 1 },
+        { "[-]+++++.", SET, 1 },
+        { "[-]---.", SET, 1 },
+        { "+>+>+<<[>]<.", SCAN, 1 },
+        { "+>>+>>+[<<]>.", SCAN, 1 },
+        { "+++[->>+++<<]>>.", MULTIPLY, 1 },
+        { "+++[>+<-]>.", MULTIPLY, 1 },
+        { ">+++[-<++>]<.", MULTIPLY, 1 },
+        { "+++[->+>+<<]", MULTIPLY, 0 }, // no rule for two targets (multiply-loops gets it)
+        { "+>+>+>+>+>+>+>+>+>+[>]", SCAN, 1 }, // off the end of a 10-cell tape
+        { "+>>+>>+>>+>>+[>>]", SCAN, 1 }, // so is this, two at a time
+        { "+[<]", SCAN, 1 }, // off the left end
+        { ">>>>>>>>>[->+<]", MULTIPLY, 1 }, // never runs, so never goes off a 10-cell tape
+        { ">>>>>>>>>+[->+<]", MULTIPLY, 1 }, // does
+    };
+    for (auto & run : runs) {
+        Program plain, rewritten;
+        parse(run.source, &plain);
+        parse(run.source, &rewritten);
+        runPasses("peephole", &rewritten);
+        if (commands(&rewritten, run.command) != run.count) fail(string("peephole: ") + run.source + " came out as " + printed(&rewritten));
+        sameRuns("peephole", run.source, &plain, &rewritten);
+    }
+
+    // a PRINT doesn't jump ahead of a SCAN, which could go off the tape
+    Program scanned;
+    parse("+.[<].", &scanned);
+    runPasses("peephole,fold-output", &scanned);
+    string out;
+    if (ran(&scanned, "", 10, out) != Evaluator::OUT_OF_BOUNDS || out != "\x01") fail("fold-output: printed past a SCAN off the tape");
+
+    // rules added at run time, and ones that don't make sense
+    Peephole peephole;
+    if (!peephole.add("[-]>a[-]<a", "ZERO; ZERO a")) fail("peephole: refused a good rule");
+    if (peephole.add("[a]", "ZERO") || peephole.add("[-]", "NOPE") || peephole.add("+", "SET b") || peephole.add("", "ZERO")
+        || peephole.add("[>]", "SCAN") || peephole.add("[-]", "ZERO 1 2")) {
+        fail("peephole: took a bad rule");
+    }
+    Program pair;
+    parse("+>+<[-]>>[-]<<.", &pair);
+    peephole.run(&pair);
+    if (commands(&pair, ZERO) != 2 || loops(&pair) != 0) fail("peephole: a run-time rule came out as " + printed(&pair));
+}
+
+// affine-loops gives add-only loops a summary the engines skip to the end with
+void testAffineLoops() {
+    const struct { const char * source; bool summarized; } runs[] = {
+        { "++++++[-->+++<]>.", true }, // an even step multiply-loops can't do
+        { "+++++[->++>+++<<]>.>.", true },
+        { "++++++[--<+>]", true }, // off the left end
+        { ">>>>>>>>++[-->+<]>.", true }, // fits a 10-cell tape
+        { ">>>>>>>>>++[-->+<]", true }, // doesn't
+        { ">>>>>>>>++[-->>><<<]", true }, // adds to nothing, but still goes off the end on the way
+        { "++[-->+<-]", true },
+        { "++[->+<.]", false }, // output
+        { "++[->+<[-]]", true }, // an if: the inner loop clears its cell
+        { "++[->]", false }, // moves
+    };
+    for (auto & run : runs) {
+        Program plain, summarized;
+        parse(run.source, &plain);
+        parse(run.source, &summarized);
+        runPasses("affine-loops", &summarized);
+        const Loop * loop = nullptr;
+        for (Node * child : summarized.children) {
+            if (!loop) loop = dynamic_cast<const Loop *>(child);
+        }
+        if (!loop || (loop->summary != nullptr) != run.summarized) fail(string("affine-loops: ") + run.source + " summarized wrong");
+        sameRuns("affine-loops", run.source, &plain, &summarized);
+        string expected, got;
+        if (ran(&plain, "", 30000, expected) == Evaluator::FINISHED && (!compiled(&summarized, "", got) || got != expected)) {
+            fail(string("affine-loops: ") + run.source + " compiled printed " + got);
+        }
+    }
+
+    // an odd cell with an even step never gets to 0, summary or not
+    Program forever;
+    parse("+++[-->+<]", &forever);
+    runPasses("affine-loops", &forever);
+    const Loop * loop = dynamic_cast<const Loop *>(forever.children.back());
+    const unsigned char odd = 3, even = 4;
+    if (!loop || !loop->summary || loop->summary->trips(&odd) != -1 || loop->summary->trips(&even) != 2) fail("affine-loops: wrong trips");
+    BufferIO io("");
+    Evaluator eval(30000, &io);
+    if (eval.run(&forever, 10000) != Evaluator::PAUSED) fail("affine-loops: a loop that never stops stopped");
+}
+
+// affine-loops also does nests of multiply loops, and bodies that set cells
+void testNestedAffine() {
+    const char * nested[] = {
+        "+++>+++++<[>[>+>+<<-]>>[<<+>>-]<<<-]>>.", // 3 * 5
+        "+++[>[-]++>+<<-]>.>.", // sets a cell the first time around
+        "++++[>+++[>++<-]<-]>>.",
+        ">>>>>>>+++>+++++<[>[>+>+<<-]>>[<<+>>-]<<<-]", // goes off the end of a 10-cell tape
+        ">>>>>>>+++[>[>>>+<<<-]<-]", // only the inner loop would, and it never runs
+        "++[>-[>+<-]<--]>>.", // an inner loop whose cell changes every time around
+    };
+    for (const char * source : nested) {
+        Program plain, summarized;
+        parse(source, &plain);
+        parse(source, &summarized);
+        runPasses("affine-loops", &summarized);
+        const Loop * loop = nullptr;
+        for (Node * child : summarized.children) {
+            if (!loop) loop = dynamic_cast<const Loop *>(child);
+        }
+        if (!loop || !loop->summary) fail(string("affine-loops: didn't summarize ") + source);
+        sameRuns("affine-loops", source, &plain, &summarized);
+        string expected, got;
+        if (ran(&plain, "", 30000, expected) == Evaluator::FINISHED && (!compiled(&summarized, "", got) || got != expected)) {
+            fail(string("affine-loops: ") + source + " compiled printed " + got);
+        }
+    }
+    // steps: the summary skips to the end of the nest
+    Program plain, summarized;
+    const char * nest = "+++++++++++[>++++++++++++[>+>+<<-]>>[<<+>>-]<<<-]";
+    parse(nest, &plain);
+    parse(nest, &summarized);
+    runPasses("affine-loops", &summarized);
+    BufferIO slowIO(""), fastIO("");
+    Evaluator slow(30000, &slowIO), fast(30000, &fastIO);
+    slow.run(&plain);
+    fast.run(&summarized);
+    if (fast.getSteps() * 10 > slow.getSteps()) fail("affine-loops: the nest took " + to_string(fast.getSteps()) + " steps");
+}
+
+void testLoopFusion() {
+    struct {
+        const char * source;
+        int loops; // how many are left
+    } runs[] = {
+        // two copies counted down together (the [-]s make them loops multiply-loops can't do)
+        { ">>>>>>>><<<<<<<<+++++[->+>+<<]>[->>>+>>[-]<<<<<]>[->>>++>>[-]<<<<<]>>>.>.", 1 },
+        { "+++++[->+>+<<]>[->>>+>>[-]<<<<<]>[->>>++>>[-]<<<<<]>>>.>.", 2 }, // not knowing the cells are on the tape
+        { ">>>>>>>><<<<<<<<+++++[->+>+<<]>[->>>+>>[-]<<<<<]>[->>++>>[-]<<<<]>>>.>.", 2 }, // the second adds to a cell the first counts
+        { ">>>>>>>><<<<<<<<+++++[->+>+<<]>[->>>+>>[-]<<<<<]>--[->>>++>>[-]<<<<<]>>>.>.", 2 }, // different counts
+        { ">>>>>>>><<<<<<<<+++++>+++++<[->>>+>>[-]<<<<<]>[->>>++>>[-]<<<<<]>>>.>.", 1 }, // the same constant
+        { ">>>>>><<<<<<+++++[->+>+<<]>[-.]>[->>,<<]", 2 }, // both do I/O
+        { ">>>>>>>>><<<<<<<<<+++[->+>+<<]>[-.]>[->>>>>+>[-]<<<<<<]", 1 },
+        { ">>>>>>>>><<<<<<<<<+++[->+>+<<]>[-.]>[->>>>>>>>+>[-]<<<<<<<<<]", 2 }, // the second goes off a 10-cell tape
+    };
+    for (auto & run : runs) {
+        Program plain, fused;
+        parse(run.source, &plain);
+        parse(run.source, &fused);
+        runPasses("multiply-loops,fuse-loops", &fused);
+        if (loops(&fused) != run.loops) fail(string("fuse-loops: ") + run.source + " left " + to_string(loops(&fused)) + " loops");
+        sameRuns("fuse-loops", run.source, &plain, &fused);
+    }
+}
+
+void testInvariantMotion() {
+    struct {
+        const char * source;
+        bool hoisted;
+    } runs[] = {
+        { "+++[>>[-]<<->+<]>.", true },
+        { "+++[>[-]>++++<+<-]>.>.", false }, // the body adds to the cell it clears
+        { "+++[>>.[-]<<-]", false }, // reads it first
+        { "+++[>>>>>>>>>>[-]<<<<<<<<<<-]", true }, // off the end of a 10-cell tape either way
+        { "+++[.>>>>>>>>>>[-]<<<<<<<<<<-]", false }, // but this prints first
+        { "+++[>+<[-]]", false }, // clears the loop's own cell
+    };
+    for (auto & run : runs) {
+        Program plain, hoisted;
+        parse(run.source, &plain);
+        parse(run.source, &hoisted);
+        runPasses("peephole", &hoisted);
+        int before = loops(&hoisted);
+        runPasses("hoist", &hoisted);
+        if ((loops(&hoisted) > before) != run.hoisted) fail(string("hoist: ") + run.source + " hoisted wrong");
+        sameRuns("hoist", run.source, &plain, &hoisted);
+    }
+}
+
+void testRewrites() {
+    // the superoptimizer finds +@0 +@0 +@1 for +>+<+, and the database keeps it from one run to the next
+    const char * source = "+>+<+.>.";
+    Program program;
+    parse(source, &program);
+    RewriteDatabase database;
+    if (database.learn(&program, 5) < 1) fail("RewriteDatabase: found nothing shorter for " + string(source));
+    string file = scratchFile("");
+    if (!database.save(file)) fail("RewriteDatabase: couldn't save");
+    RewriteDatabase loaded;
+    if (!loaded.load(file) || loaded.size() != database.size() || !database.size()) fail("RewriteDatabase: lost rewrites");
+    Rewrites rewrites(loaded);
+    Program plain, rewritten;
+    parse(source, &plain);
+    parse(source, &rewritten);
+    if (!rewrites.run(&rewritten) || rewritten.children.size() >= plain.children.size()) fail("rewrites: didn't shorten +>+<+");
+    sameRuns("rewrites", source, &plain, &rewritten);
+
+    // a line whose code doesn't do what its key says doesn't get in
+    ifstream saved(file.c_str());
+    string line;
+    getline(saved, line);
+    string forged = scratchFile(line.substr(0, line.find('\t')) + "\tADD 5 0\n");
+    RewriteDatabase checked;
+    if (!checked.load(forged) || checked.size()) fail("RewriteDatabase: loaded a rewrite that's wrong");
+    remove(file.c_str());
+    remove(forged.c_str());
+
+    // the +- can go, but not the trip out to cell 10: that's off the end of a 10-cell tape
+    const char * offTape = ">>>>>>>>>>+-<<<<<<<<<<.";
+    Program far, kept;
+    parse(offTape, &far);
+    parse(offTape, &kept);
+    RewriteDatabase farDatabase;
+    farDatabase.learn(&far, 5);
+    Rewrites(farDatabase).run(&kept);
+    const CommandNode * out = kept.children.empty() ? nullptr : dynamic_cast<const CommandNode *>(kept.children[0]);
+    if (!out || out->command != SHIFT_RIGHT || out->count != 10) fail(string("rewrites: ") + offTape + " became " + listed(&kept));
+    sameRuns("rewrites", offTape, &far, &kept);
+}
+
+void testSaturate() {
+    struct {
+        const char * source;
+        bool saturated;
+    } runs[] = {
+        { "+>+<+>+<.>.", true }, // +2 +2@1
+        { ">++<[-]+++>>+++<<.>.>.", true },
+        { "+.>,.<.", false }, // one command at a time between the I/O
+        { ">>>>>>>>>>+-<<<<<<<<<<+.", false }, // nothing but the +, except on a 10-cell tape
+    };
+    for (auto & run : runs) {
+        for (int target = INTERPRETER; target <= COMPILED; target++) {
+            Program plain, saturated;
+            parse(run.source, &plain);
+            parse(run.source, &saturated);
+            EqualitySaturation pass((Target)target);
+            string name = string("saturate") + (target == COMPILED ? " for the Compiler" : "");
+            if ((pass.run(&saturated) > 0) != run.saturated) fail(name + ": " + run.source + " became " + listed(&saturated));
+            sameRuns(name, run.source, &plain, &saturated);
+        }
+    }
+}
+
+/**
+ * Does the idioms pass recognize source, and does the summary it gives the loop do what the loop does?
+ * Run both on a little tape of made up cells (with the summary's conditions holding), for every value
+ * of the loop's cell and, when it divides by a cell, a spread of divisors.
+ */
+void testIdiom(const string & name, const string & source) {
+    Program parsed;
+    parse(source, &parsed);
+    runPasses("idioms", &parsed);
+    Loop * loop = parsed.children.size() == 1 ? dynamic_cast<Loop *>(parsed.children[0]) : nullptr;
+    if (!loop || !loop->summary) {
+        fail("idioms: didn't recognize " + name);
+        return;
+    }
+    Loop::Summary * summary = loop->summary;
+    static const int divisors[] = { 0, 2, 3, 10, 255 };
+    size_t tries = summary->divisor ? 1 : sizeof(divisors) / sizeof(divisors[0]);
+    unsigned int seed = 1;
+    for (int n = 1; n < 256; n++) {
+        for (size_t d = 0; d < tries; d++) {
+            Program program;
+            program.children.push_back(new CommandNode(SHIFT_RIGHT, 16));
+            for (int offset = -8; offset <= 16; offset++) {
+                seed = seed * 1103515245 + 12345;
+                int value = offset == 0 ? n : seed >> 16 & 255;
+                if (!summary->divisor && offset == summary->divisorAt) value = divisors[d];
+                for (auto it = summary->conditions.begin(); it != summary->conditions.end(); ++it) {
+                    if (it->offset == offset && (value == it->value) != it->equal) value = it->equal ? it->value : (value + 1) & 255;
+                }
+                program.children.push_back(new CommandNode(SET, 1, offset, value));
+            }
+            string results[2];
+            for (int k = 0; k < 2; k++) {
+                BufferIO io;
+                Evaluator evaluator(64, &io);
+                loop->summary = k ? summary : nullptr;
+                program.children.push_back(loop);
+                Evaluator::Status status = evaluator.run(&program, 1 << 20);
+                program.children.pop_back();
+                size_t first;
+                if (status == Evaluator::FINISHED) results[k] = evaluator.getTouched(first) + to_string(evaluator.getPointer());
+            }
+            loop->summary = summary;
+            if (results[0].empty() || results[0] != results[1]) {
+                fail("idioms: " + name + " is wrong for n = " + to_string(n) + (tries > 1 ? ", d = " + to_string(divisors[d]) : ""));
+                return;
+            }
+        }
+    }
+}
+
+void testIdioms() {
+    testIdiom("divmod", "[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]");
+    testIdiom("divmod in place", "[->-[>+>>]>[+[-<+>]>+>>]<<<<<]");
+    // every small divisor and a spread of the rest, up to 254 (the slow way around takes about n times d steps)
+    for (int d = 1; d < 256; d += d < 16 ? 1 : 17) {
+        testIdiom("divmod by " + to_string(d), "[>>>+<<[>+>[-]<<-]>[<+>-]>[<<" + string(d, '+') + ">>>+<-]<<-<-]");
+    }
+
+    // near the end of a 10-cell tape, the summary mustn't skip a loop that would have gone off it
+    const char * edges[] = {
+        ">>>+++++++>+++<[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]>>>.>.", // just fits
+        ">>>>+++++++>+++<[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]", // doesn't
+        ">>>>+++++++>+++<[->-[>+>>]>[+[-<+>]>+>>]<<<<<]>>>.>.",
+        ">>>>>+++++++>+++<[->-[>+>>]>[+[-<+>]>+>>]<<<<<]",
+        ">>>>>+++++++++++++>+++++++++<[>>>+<<[>+>[-]<<-]>[<+>-]>[<<++++++++++>>>+<-]<<-<-]>>>.>.",
+        ">>>>>>+++++++++++++>+++++++++<[>>>+<<[>+>[-]<<-]>[<+>-]>[<<++++++++++>>>+<-]<<-<-]",
+    };
+    for (const char * source : edges) {
+        Program plain, summarized;
+        parse(source, &plain);
+        parse(source, &summarized);
+        runPasses("idioms", &summarized);
+        const Loop * loop = nullptr;
+        for (Node * child : summarized.children) {
+            if (!loop) loop = dynamic_cast<const Loop *>(child);
+        }
+        if (!loop || !loop->summary) fail(string("idioms: didn't recognize ") + source);
+        sameRuns("idioms", source, &plain, &summarized);
+    }
+}
+
+/**
+ * Run source on input at an optimization level for target (with the prelude, starting from there), with the pointer
+ * starting at cell start. Says whether it finished within budget steps, and what it printed on the way.
+ */
+bool optimized(const string & source, const string & input, int level, Target target, bool prelude, int start,
+               unsigned long long budget, string & printed) {
+    Program program;
+    parse(source, &program);
+    if (start) program.children.insert(program.children.begin(), new CommandNode(SHIFT_RIGHT, start));
+    PassManager manager(target);
+    manager.addLevel(level);
+    manager.run(&program);
+    BufferIO io(input);
+    Evaluator evaluator(2 * start + 30000, &io);
+    if (prelude) evaluator.start(evaluatePrelude(&program, budget, 2 * start + 30000), &program);
+    Evaluator::Status status = evaluator.run(&program, budget);
+    printed = io.output;
+    return status == Evaluator::FINISHED;
+}
+
+// source has to print the same thing at every level, for both targets (and at -O3 from the prelude), as it does as parsed
+void sameAtEveryLevel(const string & name, const string & source, const string & input, int start, unsigned long long budget) {
+    string expected;
+    if (!optimized(source, input, 0, INTERPRETER, false, start, budget, expected)) return;
+    for (int level = 1; level <= PassManager::MAX_LEVEL; level++) {
+        for (int target = INTERPRETER; target <= COMPILED; target++) {
+            for (int prelude = 0; prelude <= (level == PassManager::MAX_LEVEL); prelude++) {
+                string printed;
+                if (!optimized(source, input, level, (Target)target, prelude != 0, start, 10 * budget, printed) || printed != expected) {
+                    fail(name + " printed something else at -O" + to_string(level) + (target == COMPILED ? " for the Compiler" : "")
+                        + (prelude ? " with the prelude" : ""));
+                }
+            }
+        }
+    }
+}
+
+void testOptimizedPrograms() {
+    const char * names[] = { "helloworld.bf", "99botles.bf", "bench/hanoi.bf", "bench/mandelbrot.bf", "bench/numbers.bf" };
+    for (const char * name : names) {
+        ifstream file((dir + "/" + name).c_str());
+        if (!file) {
+            fail(string(name) + ": No such file.");
+            continue;
+        }
+        stringstream source;
+        source << file.rdbuf();
+        sameAtEveryLevel(name, source.str(), "", 0, 0);
+    }
+}
+
+// a random program, made up mostly of the kinds of loops the passes look for
+string randomProgram(mt19937 & random, int depth, int length) {
+    static const char * loops[] = {
+        "[-]", "[+]", "[>]", "[<<]", "[->>+<<]", "[-<+++>]", "[>+<-]", "[-<<-->>]", "[-->+<]", "[>+++<++++]",
+        "[<-->>-<------]", "[>[>+>+<<-]>>[<<+>>-]<<<-]", "[>[-]++[>+++<-]<-]", "[>>[-]<[>+<-]<-]", "[->[-]+++>+<<]",
+        "[->>[-<+<+>>]<[->+<]<]", "[>+<[-]]", "[>>-<[-]+++<[-]]", "[->+>+<<]>[-.>>+<<]>[->>+<<]",
+        "[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]", "[->-[>+>>]>[+[-<+>]>+>>]<<<<<]",
+        ">+++++++++<[>>>+<<[>+>[-]<<-]>[<+>-]>[<<++++++++++>>>+<-]<<-<-]", ">>+++<<[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]",
+        "[>[-]+++<.-]", "[.>[-]<-[->+<]]", "[->+>+<<]>[->>>[-]<<<]>[--]", "[>>[-]+<<-[>+<-]>>++<<]",
+    };
+    string source;
+    for (int i = 0; i < length; i++) {
+        int kind = random() % 20;
+        if (kind < 2 && depth < 3) source += "[" + randomProgram(random, depth + 1, random() % 8 + 1) + "]";
+        else if (kind < 3) source += ",";
+        else if (kind < 6) source += loops[random() % (sizeof(loops) / sizeof(loops[0]))];
+        else source += string(random() % 3 + 1, "+-<>."[random() % 5]);
+    }
+    return source;
+}
+
+void testRandomPrograms(int count) {
+    mt19937 random(603);
+    for (int i = 0; i < count; i++) {
+        string source = randomProgram(random, 0, random() % 30 + 1);
+        string input;
+        for (int j = 0; j < 20; j++) input += (char)(random() % 7);
+        sameAtEveryLevel(source, source, input, 1000, 200000);
+    }
+}
+
+int main(int argc, char * argv[]) {
+    string source = __FILE__;
+    dir = argc > 1 ? argv[1] : source.rfind('/') == string::npos ? "." : source.substr(0, source.rfind('/'));
+    testEngines();
+    testParseSize();
+    testGenerate();
+    testAllocations();
+    testSamples();
+    testBudget();
+    testScheduler();
+    testThreadPool();
+    testBatch();
+    testExecute();
+    testDigests();
+    testProgramCache();
+    testDeepNesting();
+    testServe();
+    testForkServer();
+    testReset();
+    testEach();
+    testSnapshots();
+    testPrefixCache();
+    testPrelude();
+    testOutputFolding();
+    testKnownValues();
+    testSetFusion();
+    testRunFolding();
+    testMultiplyLoops();
+    testOffsets();
+    testLevels();
+    testPeephole();
+    testAffineLoops();
+    testNestedAffine();
+    testIdioms();
+    testLoopFusion();
+    testInvariantMotion();
+    testRewrites();
+    testSaturate();
+    testOptimizedPrograms();
+    testRandomPrograms(2000);
+    cout << (failures ? to_string(failures) + " failed." : "All passed.") << endl;
+    return failures ? 1 : 0;
+}